@@ -1,11 +1,53 @@
 #include "bip.h"
+#include "counters.h"
 #include <cblas.h>
 #include <lapacke.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
 
-extern void print_matrix_double(double *A, int n, int m);
+// the intermediate results of every update are only printed by a verbose estimator
+#define PRINT_MATRIX(_title, _A, _n, _m) \
+	do { if (m_verbose) { printf("%s", _title); print_matrix_real(_A, _n, _m); } } while (0)
+
+// observation noise (std. dev. in pixels) assumed by the square-root filter. The sensors report whole pixels,
+// and in replays of the recorded traces larger values only made the estimate lag.
+#define ETKF_OBSERVATION_STD 1.0
+
+// same format as print_matrix_double (mysim.cpp), for either precision
+template <typename T>
+static void print_matrix_real(const T *A, int n, int m)
+{
+	for (int i=0; i < n; i++)
+	{
+		for (int j=0; j < m; j++)
+			printf("%11.3f ", (double)A[i *m + j]);
+		putc('\n', stdout);
+	}
+	putc('\n', stdout);
+}
+
+// C = alpha * A . op(B), in the precision of the ensemble (A is never transposed here)
+static void Matrix_Multiply(CBLAS_TRANSPOSE transB, int m, int n, int k, double alpha, const real_t *A, int lda,
+	const real_t *B, int ldb, real_t *C, int ldc)
+{
+#ifdef SINGLE_PRECISION
+	cblas_sgemm(CblasRowMajor, CblasNoTrans, transB, m, n, k, alpha, A, lda, B, ldb, 0, C, ldc);
+#else
+	cblas_dgemm(CblasRowMajor, CblasNoTrans, transB, m, n, k, alpha, A, lda, B, ldb, 0, C, ldc);
+#endif
+}
+
+// K = P . S^-1 (B x D . D x D = B x D): P and K have a row for every state, the latent coefficients too
+void kalman_gain(const real_t *partial, const real_t *S_inv, real_t *gain, unsigned int states)
+{
+	Matrix_Multiply(CblasNoTrans, states, NUM_STATE_VARIABLES, NUM_STATE_VARIABLES, 1,
+		partial, NUM_STATE_VARIABLES, S_inv, NUM_STATE_VARIABLES, gain, NUM_STATE_VARIABLES);
+}
 
 // subtract a vector B (size m) from A n x m matrix, put result in C (n x m matrix)
-static void Matrix_Subtract_Vector(double *A, double *B, double *C, int n, int m)
+template <typename T>
+static void Matrix_Subtract_Vector(T *A, double *B, real_t *C, int n, int m)
 {
    int i,j;
    for (i=0; i < n; i++)
@@ -17,7 +59,8 @@ static void Matrix_Subtract_Vector(double *A, double *B, double *C, int n, int m
 	}
 }
 
-static void Matrix_Add_Matrix(double *A, double *B, double *C, int n, int m)
+template <typename T>
+static void Matrix_Add_Matrix(T *A, real_t *B, T *C, int n, int m)
 {
    int i,j;
    for (i=0; i < n; i++)
@@ -29,7 +72,7 @@ static void Matrix_Add_Matrix(double *A, double *B, double *C, int n, int m)
 	}
 }
 
-static void Matrix_Subtract_Matrix(double *A, double *B, double *C, int n, int m)
+static void Matrix_Subtract_Matrix(real_t *A, real_t *B, real_t *C, int n, int m)
 {
    int i,j;
    for (i=0; i < n; i++)
@@ -41,114 +84,207 @@ static void Matrix_Subtract_Matrix(double *A, double *B, double *C, int n, int m
 	}
 }
 
-BIP::BIP()
+BIP::BIP(CDemoLibrary *library, unsigned int members, unsigned int latent_rank) : m_filter(FILTER_ENKF),
+		m_num_members(members), m_library(library), m_interactions(library->interactions()), m_latent(NULL),
+		m_num_states(NUM_ENSEMBLE_STATES)
 {
-	printf("BIP constructor\n");
+	m_library->AddRef();
+	if (latent_rank)
+	{
+		m_latent = m_library->latent(std::min(latent_rank, (unsigned int)MAX_LATENT_FUNCTIONS));
+		if (m_latent)
+			m_num_states += m_latent->rank();
+		else
+			printf("WARNING: no latent model, the ensemble follows the demonstrations\n");
+	}
+	m_members = (CInteraction**)calloc(sizeof(CInteraction*), m_num_members);
+	m_weights = (double*)calloc(sizeof(double), m_num_states * m_num_members);
+	m_scratch = (real_t*)calloc(sizeof(real_t), 3 * NUM_STATE_VARIABLES * m_num_members);
+	m_scratch_w = (double*)calloc(sizeof(double), m_num_members);
 }
 
 BIP::~BIP()
 {
+	free(m_members);
+	free(m_weights);
+	free(m_scratch);
+	free(m_scratch_w);
+	m_library->Release();
 }
 
-void BIP::add_demonstration(CInteraction *interaction)
+// the ensemble, plus the scratch matrices of one update
+size_t BIP::memory_usage()
 {
-	m_interactions.push_back(interaction);
+	const size_t D = NUM_STATE_VARIABLES;
+	const size_t B = m_num_states;
+	const size_t E = m_num_members;
+	const size_t ensemble = sizeof(*this) + sizeof(CInteraction*) * E + sizeof(double) * B * E;
+
+	if (m_filter == FILTER_ETKF)
+		return ensemble + sizeof(real_t) * (3 * D * E) + sizeof(double) * (D * D + 2 * D + 2 * B + D * B + E);
+	return ensemble + sizeof(real_t) * (2 * D * D + 2 * B * E + 2 * B * D + 4 * D * E) + sizeof(double) * (B + D * D);
 }
 
-// must be called after all demonstrations are added
+// resets the per-trial ensemble state; the demonstrations are left untouched
 void BIP::create_initial_ensemble()
 {
-	printf("%s\n", __func__);
+	if (m_verbose)
+		printf("%s\n", __func__);
+
+	// When the library holds exactly one demonstration per member, every trial uses all of them and the
+	// initial ensemble only depends on the demonstrations, so it is shared through the library.
+	bool whole_library = (m_interactions.size() == m_num_members);
+	CRandom members(RNG_BLOCK_MEMBERS, m_trial);
+	m_library->DrawMembers(m_members, m_num_members, members);
+	const double *shared = m_library->initial_ensemble(m_num_states * m_num_members);
+	if (whole_library && shared)
+	{
+		memcpy(m_weights, shared, sizeof(double) * m_num_states * m_num_members);
+		PRINT_MATRIX("", m_weights, m_num_states, m_num_members);
+		return;
+	}
 
 	const double range = 0.1;
-	interaction_list::iterator interaction = m_interactions.begin();
-	for (int i=0; i < NUM_ENSEMBLE_MEMBERS; i++)
+	for (int i=0; i < m_num_members; i++)
 	{
-		m_weights[i + NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_PHASE] = 0;
-		m_weights[i + NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_PHASE_VEL] = (double)1/(double)(*interaction)->length();
-		double variation = (double)rand() / (double)RAND_MAX * range;
-		m_weights[i + NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_WEIGHT] = 1;// - (range/2) + variation;
-		interaction++;
+		m_weights[i + m_num_members * ENSEMBLE_STATE_PHASE] = 0;
+		m_weights[i + m_num_members * ENSEMBLE_STATE_PHASE_VEL] = (double)1/(double)m_members[i]->length();
+		double variation = CRandom(RNG_BLOCK_ENSEMBLE, m_trial, 0, i).uniform() * range;
+		m_weights[i + m_num_members * ENSEMBLE_STATE_WEIGHT] = 1;// - (range/2) + variation;
+		set_coefficients(i);
 	}
+	if (whole_library)
+		m_library->set_initial_ensemble(m_weights, m_num_states * m_num_members);
 
-	print_matrix_double(m_weights, NUM_ENSEMBLE_STATES, NUM_ENSEMBLE_MEMBERS);
+	PRINT_MATRIX("", m_weights, m_num_states, m_num_members);
 }
 
+/*
+	Rebuild the ensemble from the demonstrations whose launch looks most like the one being observed
+	(see knn.h). The phase is left alone, since it is recomputed from the sample number on every update.
+*/
+bool BIP::retrieve_members(const double *features)
+{
+	std::vector<CInteraction*> nearest(m_num_members);
+	unsigned int found = m_library->similarity().Query(features, m_num_members, nearest.data());
 
-void BIP::get_phase_stats(double *phase_velocity_mean, double *phase_velocity_var)
+	if (!found)
+		return false;
+
+	// a library smaller than the ensemble repeats the nearest demonstrations
+	for (unsigned int i=0; i < m_num_members; i++)
+	{
+		m_members[i] = nearest[i % found];
+		m_weights[i + m_num_members * ENSEMBLE_STATE_PHASE_VEL] = (double)1/(double)m_members[i]->length();
+		m_weights[i + m_num_members * ENSEMBLE_STATE_WEIGHT] = 1;
+		set_coefficients(i);
+	}
+
+	return true;
+}
+
+// a member starts out as its demonstration, projected on the latent model
+void BIP::set_coefficients(unsigned int member)
 {
-	double tmp = 0;
+	double z[MAX_LATENT_FUNCTIONS];
+
+	if (!m_latent)
+		return;
+	m_latent->project(m_members[member], z);
+	for (unsigned int k=0; k < m_latent->rank(); k++)
+		m_weights[m_num_members * (NUM_ENSEMBLE_STATES + k) + member] = z[k];
+}
 
-	for (interaction_list::iterator i = m_interactions.begin();
-		i != m_interactions.end(); i++)
+/*
+	The robot goes wherever the estimate sends it, so its own position says nothing about the throw. The
+	demonstrations tie the robot to the ball, but the latent coefficients are free enough to just follow the
+	robot, so in the latent space its reading is left out of the correction: every member predicts the mean,
+	and that is what is observed.
+*/
+void BIP::ignore_robot(real_t *hx, real_t *ha, double *observed)
+{
+	double mean = hx[m_num_members * STATE_VAR_ROBOT_X] - ha[m_num_members * STATE_VAR_ROBOT_X];
+
+	for (unsigned int e=0; e < m_num_members; e++)
 	{
-		tmp += (double)(*i)->length();
+		hx[m_num_members * STATE_VAR_ROBOT_X + e] = mean;
+		ha[m_num_members * STATE_VAR_ROBOT_X + e] = 0;
 	}
+	observed[STATE_VAR_ROBOT_X] = mean;
+}
 
-	*phase_velocity_mean = (double)1 / (double)(tmp / (double)m_interactions.size());
+// the trajectory of a member: its demonstration, or its coefficients in the latent model
+void BIP::member_sample(unsigned int member, double phase, double sample[])
+{
+	double z[MAX_LATENT_FUNCTIONS];
 
-	//The variance is the average of the squared deviations from the mean, i.e., var = mean(abs(x - x.mean())**2).
-	double diff;
-	tmp = 0;
-	for (interaction_list::iterator i = m_interactions.begin();
-		i != m_interactions.end(); i++)
+	if (!m_latent)
 	{
-		diff = ((double)1/(double)(*i)->length()) - *phase_velocity_mean;
-		tmp += (diff * diff);
+		m_members[member]->get_sample(phase, sample);
+		return;
 	}
-	
-	*phase_velocity_var = tmp / m_interactions.size();
+	for (unsigned int k=0; k < m_latent->rank(); k++)
+		z[k] = m_weights[m_num_members * (NUM_ENSEMBLE_STATES + k) + member];
+	m_latent->get_sample(z, phase, sample);
 }
 
-// ensemble: D x E
-void BIP::hx(double *matrix)
+// from the library's running statistics of the demonstration lengths (see CPhaseStats)
+void BIP::get_phase_stats(double *phase_velocity_mean, double *phase_velocity_var)
+{
+	const CPhaseStats &stats = m_library->lengths();
+
+	*phase_velocity_mean = stats.mean();
+	*phase_velocity_var = stats.variance();
+}
+
+// ensemble: D x E. Each prediction is perturbed by uniform noise of the given range (0 for none).
+void BIP::hx(real_t *matrix, double range)
 {
-	const double range = 0.1;
 	unsigned int demonstration = 0;
 	double sample[NUM_STATE_VARIABLES];
 
 	// look up the sample at this phase directly from the demonstrations
-	for (interaction_list::iterator i = m_interactions.begin(); i != m_interactions.end(); i++)
+	for (demonstration = 0; demonstration < m_num_members; demonstration++)
 	{
-		double variation = (double)rand() / (double)RAND_MAX * range - (range/2.0);
-		(*i)->get_sample(m_weights[ENSEMBLE_STATE_PHASE], sample);
+		CRandom random(RNG_BLOCK_PREDICTION, m_trial, m_tick, demonstration);
+		double variation = random.noise(range);
+		member_sample(demonstration, m_weights[ENSEMBLE_STATE_PHASE], sample);
 		//printf("Got sample from demonstration %i:\n", demonstration);
 		//print_matrix_double(sample, 1, NUM_STATE_VARIABLES);
 
-		matrix[NUM_ENSEMBLE_MEMBERS * STATE_VAR_BALL_X + demonstration] = sample[STATE_VAR_BALL_X] *
-			m_weights[NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_WEIGHT + demonstration] + variation;
-		variation = (double)rand() / (double)RAND_MAX * range - (range/2.0);
-		matrix[NUM_ENSEMBLE_MEMBERS * STATE_VAR_BALL_Y + demonstration] = sample[STATE_VAR_BALL_Y] *
-			m_weights[NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_WEIGHT + demonstration] + variation;
-		variation = (double)rand() / (double)RAND_MAX * range - (range/2.0);
-		matrix[NUM_ENSEMBLE_MEMBERS * STATE_VAR_ROBOT_X + demonstration] = sample[STATE_VAR_ROBOT_X] *
-			m_weights[NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_WEIGHT + demonstration] + variation;
-		demonstration++;
+		matrix[m_num_members * STATE_VAR_BALL_X + demonstration] = sample[STATE_VAR_BALL_X] *
+			m_weights[m_num_members * ENSEMBLE_STATE_WEIGHT + demonstration] + variation;
+		variation = random.noise(range);
+		matrix[m_num_members * STATE_VAR_BALL_Y + demonstration] = sample[STATE_VAR_BALL_Y] *
+			m_weights[m_num_members * ENSEMBLE_STATE_WEIGHT + demonstration] + variation;
+		variation = random.noise(range);
+		matrix[m_num_members * STATE_VAR_ROBOT_X + demonstration] = sample[STATE_VAR_ROBOT_X] *
+			m_weights[m_num_members * ENSEMBLE_STATE_WEIGHT + demonstration] + variation;
 	}
 }
 
 /*
- NUM_STATE_VARIABLES * NUM_ENSEMBLE_MEMBERS
+ NUM_STATE_VARIABLES * m_num_members
 */
-void BIP::get_ha_matrix(double *hx, double *ha)
+void BIP::get_ha_matrix(real_t *hx, real_t *ha)
 {
 	double mean[NUM_STATE_VARIABLES];
 	unsigned int vars, index;
 
-	for (vars = 0; vars < NUM_ENSEMBLE_STATES; vars++)
+	for (vars = 0; vars < NUM_STATE_VARIABLES; vars++)
 		mean[vars] = 0;
 
 	for (vars = 0; vars < NUM_STATE_VARIABLES; vars++)
 	{
-		for (index=0; index < NUM_ENSEMBLE_MEMBERS; index++)
+		for (index=0; index < m_num_members; index++)
 		{
-			mean[vars] += hx[NUM_ENSEMBLE_MEMBERS * vars + index];
+			mean[vars] += hx[m_num_members * vars + index];
 		}
-		mean[vars] /= NUM_ENSEMBLE_MEMBERS;
+		mean[vars] /= m_num_members;
 	}
 
 	// ha is the deviation of the predicted state from the mean
-	Matrix_Subtract_Vector(hx, mean, ha, NUM_STATE_VARIABLES, NUM_ENSEMBLE_MEMBERS);
+	Matrix_Subtract_Vector(hx, mean, ha, NUM_STATE_VARIABLES, m_num_members);
 }
 
 /* Transforms the given basis space weights to measurement space for the given phase values
@@ -171,9 +307,9 @@ void BIP::get_mean_trajectory(double range_start, double range_end, unsigned int
 		trajectory[sample_index + num_samples * STATE_VAR_ROBOT_X] = 0;
 
 		// look up the sample at this phase directly from the demonstrations
-		for (interaction_list::iterator i = m_interactions.begin(); i != m_interactions.end(); i++)
+		for (unsigned int member = 0; member < m_num_members; member++)
 		{
-			(*i)->get_sample(phase, sample);
+			member_sample(member, phase, sample);
 			//printf("Got sample at phase %f:\n", phase);
 			//print_matrix_double(sample, 1, NUM_STATE_VARIABLES);
 			apply_weights(valid_samples, sample);
@@ -220,103 +356,150 @@ double* BIP::generate_probable_trajectory_recursive(double *trajectory, double *
 }
 */
 
-void BIP::estimate_state(double sample, double *sensors, double *sensorNoise, double *predictedState)
+void BIP::estimate_state(double sample, double *sensors, double *predictedState)
 {
-	double *currMean = (double *)calloc(sizeof(double), NUM_ENSEMBLE_STATES);// vector of averages used to derive At
-	double *S = (double *)calloc(sizeof(double), NUM_STATE_VARIABLES * NUM_STATE_VARIABLES);		// Innovation co-variance
-	double *A_matrix = (double *)calloc(sizeof(double), NUM_ENSEMBLE_STATES * NUM_ENSEMBLE_MEMBERS);
-	double *partialKalman = (double *)calloc(sizeof(double), NUM_ENSEMBLE_STATES * NUM_STATE_VARIABLES);
-	double *HX_matrix = (double *)calloc(sizeof(double), NUM_STATE_VARIABLES * NUM_ENSEMBLE_MEMBERS);// HtXt|t-1
-	double *ha =        (double *)calloc(sizeof(double), NUM_STATE_VARIABLES * NUM_ENSEMBLE_MEMBERS);// HtAt
-	double *R = (double *)calloc(sizeof(double), NUM_STATE_VARIABLES * NUM_STATE_VARIABLES);		// random noise
-	double *KalmanGain = (double *)calloc(sizeof(double), NUM_ENSEMBLE_STATES * NUM_STATE_VARIABLES);
-	double *observations = (double *)calloc(sizeof(double), NUM_STATE_VARIABLES * NUM_ENSEMBLE_MEMBERS);
-	double *sensorDiff = (double *)calloc(sizeof(double), NUM_STATE_VARIABLES * NUM_ENSEMBLE_MEMBERS);
-	double *KalmanDiff = (double *)calloc(sizeof(double), NUM_ENSEMBLE_STATES * NUM_ENSEMBLE_MEMBERS);
-
-	// build sensor readings for each ensemble member
-	add_sensor_noise(sensors, observations, 0.1, NUM_STATE_VARIABLES, NUM_ENSEMBLE_MEMBERS);
+	m_tick++;
+	if (m_filter == FILTER_ETKF)
+	{
+		estimate_state_etkf(sample, sensors, predictedState);
+		return;
+	}
+
+	double *currMean = (double *)calloc(sizeof(double), m_num_states);// vector of averages used to derive At
+	real_t *S = (real_t *)calloc(sizeof(real_t), NUM_STATE_VARIABLES * NUM_STATE_VARIABLES);		// Innovation co-variance
+	real_t *A_matrix = (real_t *)calloc(sizeof(real_t), m_num_states * m_num_members);
+	real_t *partialKalman = (real_t *)calloc(sizeof(real_t), m_num_states * NUM_STATE_VARIABLES);
+	real_t *HX_matrix = (real_t *)calloc(sizeof(real_t), NUM_STATE_VARIABLES * m_num_members);// HtXt|t-1
+	real_t *ha =        (real_t *)calloc(sizeof(real_t), NUM_STATE_VARIABLES * m_num_members);// HtAt
+	real_t *R = (real_t *)calloc(sizeof(real_t), NUM_STATE_VARIABLES * NUM_STATE_VARIABLES);		// random noise
+	real_t *KalmanGain = (real_t *)calloc(sizeof(real_t), m_num_states * NUM_STATE_VARIABLES);
+	real_t *observations = (real_t *)calloc(sizeof(real_t), NUM_STATE_VARIABLES * m_num_members);
+	real_t *sensorDiff = (real_t *)calloc(sizeof(real_t), NUM_STATE_VARIABLES * m_num_members);
+	real_t *KalmanDiff = (real_t *)calloc(sizeof(real_t), m_num_states * m_num_members);
+	double observed[NUM_STATE_VARIABLES];
+	CStageCounter stages;
 
 	// make forward prediction for each ensemble member
+	stages.start(STAGE_PROPAGATE);
 	propagate_ensemble(sample);
 
-	printf("ensemble:\n");
-	print_matrix_double(m_weights, NUM_ENSEMBLE_STATES, NUM_ENSEMBLE_MEMBERS);
-
-	get_ensemble_mean(currMean, m_weights);
-	//printf("ensemble mean:\n");
-	//print_matrix_double(currMean, NUM_ENSEMBLE_STATES, 1);
-
-	// A is the deviation of the current weights from the mean (B x E)
-	Matrix_Subtract_Vector(m_weights, currMean, A_matrix, NUM_ENSEMBLE_STATES, NUM_ENSEMBLE_MEMBERS);
-	printf("A:\n");
-	print_matrix_double(A_matrix, NUM_ENSEMBLE_STATES, NUM_ENSEMBLE_MEMBERS);
+	PRINT_MATRIX("ensemble:\n", m_weights, m_num_states, m_num_members);
 
 	// hx matrix (D x E)
-	hx(HX_matrix);
-	printf("HX:\n");
-	print_matrix_double(HX_matrix, NUM_STATE_VARIABLES, NUM_ENSEMBLE_MEMBERS);
+	stages.start(STAGE_HX);
+	hx(HX_matrix, 0.1);
+	PRINT_MATRIX("HX:\n", HX_matrix, NUM_STATE_VARIABLES, m_num_members);
 
 	// ha = HX - avg(HX) (D x E)
+	stages.start(STAGE_HA);
 	get_ha_matrix(HX_matrix, ha);
-	printf("HA:\n");
-	print_matrix_double(ha, NUM_STATE_VARIABLES, NUM_ENSEMBLE_MEMBERS);
+	memcpy(observed, sensors, sizeof(observed));
+	if (m_latent)
+		ignore_robot(HX_matrix, ha, observed);
+	PRINT_MATRIX("HA:\n", ha, NUM_STATE_VARIABLES, m_num_members);
 
 	// generate some random noise
+	stages.start(STAGE_GAIN);
 	generate_noise(R, 0.1, NUM_STATE_VARIABLES, NUM_STATE_VARIABLES);
 	//printf("R:\n");
 	//print_matrix_double(R, NUM_STATE_VARIABLES, NUM_STATE_VARIABLES);
 
 	// S is the innovation covariance (D x E . E x D = D x D)
-	cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
-		NUM_STATE_VARIABLES, NUM_STATE_VARIABLES, NUM_ENSEMBLE_MEMBERS, (double)1/(double)(NUM_ENSEMBLE_MEMBERS-1),
-		ha, NUM_ENSEMBLE_MEMBERS,
-		ha, NUM_ENSEMBLE_MEMBERS, 0, S, NUM_STATE_VARIABLES);
+	Matrix_Multiply(CblasTrans,
+		NUM_STATE_VARIABLES, NUM_STATE_VARIABLES, m_num_members, (double)1/(double)(m_num_members-1),
+		ha, m_num_members,
+		ha, m_num_members, S, NUM_STATE_VARIABLES);
 	Matrix_Add_Matrix(S, R, S, NUM_STATE_VARIABLES, NUM_STATE_VARIABLES);
-	printf("S:\n");
-	print_matrix_double(S, NUM_STATE_VARIABLES, NUM_STATE_VARIABLES);
+	if (m_latent)
+	{
+		// the robot's reading has no spread left, only the noise: keep it out of S so S stays invertible
+		for (int i=0; i < NUM_STATE_VARIABLES; i++)
+			S[NUM_STATE_VARIABLES * STATE_VAR_ROBOT_X + i] = S[NUM_STATE_VARIABLES * i + STATE_VAR_ROBOT_X] = 0;
+		S[NUM_STATE_VARIABLES * STATE_VAR_ROBOT_X + STATE_VAR_ROBOT_X] = 1;
+	}
+	PRINT_MATRIX("S:\n", S, NUM_STATE_VARIABLES, NUM_STATE_VARIABLES);
 
-	// Calculate S-inverse
+	// Calculate S-inverse (always in double: S can be close to singular)
 	int pivots[NUM_STATE_VARIABLES];
-	LAPACKE_dgetrf(LAPACK_ROW_MAJOR, NUM_STATE_VARIABLES, NUM_STATE_VARIABLES, S, NUM_STATE_VARIABLES, pivots);
-	LAPACKE_dgetri(LAPACK_ROW_MAJOR, NUM_STATE_VARIABLES, S, NUM_STATE_VARIABLES, pivots);
+	double S_inv[NUM_STATE_VARIABLES * NUM_STATE_VARIABLES];
+	for (int i=0; i < NUM_STATE_VARIABLES * NUM_STATE_VARIABLES; i++)
+		S_inv[i] = S[i];
+	LAPACKE_dgetrf(LAPACK_ROW_MAJOR, NUM_STATE_VARIABLES, NUM_STATE_VARIABLES, S_inv, NUM_STATE_VARIABLES, pivots);
+	LAPACKE_dgetri(LAPACK_ROW_MAJOR, NUM_STATE_VARIABLES, S_inv, NUM_STATE_VARIABLES, pivots);
+	for (int i=0; i < NUM_STATE_VARIABLES * NUM_STATE_VARIABLES; i++)
+		S[i] = S_inv[i];
 	//printf("S-inv:\n");
 	//print_matrix_double(S, NUM_STATE_VARIABLES, NUM_STATE_VARIABLES);
 
-	// partial Kalman (B x E . E x D = B x D)
-	cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
-		NUM_ENSEMBLE_STATES, NUM_STATE_VARIABLES, NUM_ENSEMBLE_MEMBERS, (double)1/(double)(NUM_ENSEMBLE_MEMBERS-1),
-		A_matrix, NUM_ENSEMBLE_MEMBERS,
-		ha, NUM_ENSEMBLE_MEMBERS, 0, partialKalman, NUM_STATE_VARIABLES);
-	printf("partial K:\n");
-	print_matrix_double(partialKalman, NUM_ENSEMBLE_STATES, NUM_STATE_VARIABLES);
-
-	// Calculate Kalman gain (B x D . D x D = B x D)
-	cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
-		NUM_ENSEMBLE_STATES, NUM_STATE_VARIABLES, NUM_STATE_VARIABLES, (double)1/(double)(NUM_ENSEMBLE_MEMBERS-1),
-		S, NUM_STATE_VARIABLES,
-		partialKalman, NUM_STATE_VARIABLES, 0, KalmanGain, NUM_STATE_VARIABLES);
-	for (int i=0; i < NUM_ENSEMBLE_STATES; i++)
-	KalmanGain[NUM_ENSEMBLE_STATES * ENSEMBLE_STATE_PHASE + i] = 0;
-	printf("K:\n");
-	print_matrix_double(KalmanGain, NUM_ENSEMBLE_STATES, NUM_STATE_VARIABLES);
-
-	// Calculate difference (B x D . D x E = B x E)
-	Matrix_Subtract_Matrix(observations, HX_matrix, sensorDiff, NUM_STATE_VARIABLES, NUM_ENSEMBLE_MEMBERS);
-	printf("observations - HX:\n");
-	print_matrix_double(sensorDiff, NUM_STATE_VARIABLES, NUM_ENSEMBLE_MEMBERS);
-	cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
-		NUM_ENSEMBLE_STATES, NUM_ENSEMBLE_MEMBERS, NUM_STATE_VARIABLES, 1,
-		KalmanGain, NUM_STATE_VARIABLES,
-		sensorDiff, NUM_ENSEMBLE_MEMBERS, 0, KalmanDiff, NUM_ENSEMBLE_MEMBERS);
-	printf("K diff:\n");
-	print_matrix_double(KalmanDiff, NUM_ENSEMBLE_STATES, NUM_ENSEMBLE_MEMBERS);
-
-	// Update ensemble (B x E += B x E)
-	Matrix_Add_Matrix(m_weights, KalmanDiff, m_weights, NUM_ENSEMBLE_STATES, NUM_ENSEMBLE_MEMBERS);
+	// Mahalanobis distance of the innovation: the readings against the mean prediction (HX - HA)
+	double innovation[NUM_STATE_VARIABLES];
+	double distance = 0;
+	for (int d=0; d < NUM_STATE_VARIABLES; d++)
+		innovation[d] = observed[d] - (HX_matrix[m_num_members * d] - ha[m_num_members * d]);
+	for (int i=0; i < NUM_STATE_VARIABLES; i++)
+		for (int j=0; j < NUM_STATE_VARIABLES; j++)
+			distance += innovation[i] * S_inv[NUM_STATE_VARIABLES * i + j] * innovation[j];
+	distance = sqrt(std::max(distance, 0.0));
+
+	// The rest is the expensive part. The random numbers are keyed by the update, so skipping it doesn't
+	// change what the later updates draw.
+	if (!skip_correction(distance))
+	{
+		get_ensemble_mean(currMean, m_weights);
+		//printf("ensemble mean:\n");
+		//print_matrix_double(currMean, m_num_states, 1);
+
+		// A is the deviation of the current weights from the mean (B x E)
+		Matrix_Subtract_Vector(m_weights, currMean, A_matrix, m_num_states, m_num_members);
+		PRINT_MATRIX("A:\n", A_matrix, m_num_states, m_num_members);
+
+		// partial Kalman (B x E . E x D = B x D)
+		Matrix_Multiply(CblasTrans,
+			m_num_states, NUM_STATE_VARIABLES, m_num_members, (double)1/(double)(m_num_members-1),
+			A_matrix, m_num_members,
+			ha, m_num_members, partialKalman, NUM_STATE_VARIABLES);
+		PRINT_MATRIX("partial K:\n", partialKalman, m_num_states, NUM_STATE_VARIABLES);
+
+		// Calculate Kalman gain (S holds the inverse by now)
+		kalman_gain(partialKalman, S, KalmanGain, m_num_states);
+		for (int i=0; i < NUM_STATE_VARIABLES; i++)
+		KalmanGain[NUM_STATE_VARIABLES * ENSEMBLE_STATE_PHASE + i] = 0;
+		PRINT_MATRIX("K:\n", KalmanGain, m_num_states, NUM_STATE_VARIABLES);
+
+		// build sensor readings for each ensemble member
+		stages.start(STAGE_UPDATE);
+		add_sensor_noise(observed, observations, 0.1, NUM_STATE_VARIABLES, m_num_members);
+
+		// Calculate difference (B x D . D x E = B x E)
+		Matrix_Subtract_Matrix(observations, HX_matrix, sensorDiff, NUM_STATE_VARIABLES, m_num_members);
+		PRINT_MATRIX("observations - HX:\n", sensorDiff, NUM_STATE_VARIABLES, m_num_members);
+		Matrix_Multiply(CblasNoTrans,
+			m_num_states, m_num_members, NUM_STATE_VARIABLES, 1,
+			KalmanGain, NUM_STATE_VARIABLES,
+			sensorDiff, m_num_members, KalmanDiff, m_num_members);
+		PRINT_MATRIX("K diff:\n", KalmanDiff, m_num_states, m_num_members);
+
+		// the latent coefficients keep their spread, as in the square-root filter: all of them move by the mean
+		for (unsigned int b=NUM_ENSEMBLE_STATES; b < m_num_states; b++)
+		{
+			double mean = 0;
+			for (unsigned int e=0; e < m_num_members; e++)
+				mean += KalmanDiff[m_num_members * b + e];
+			mean /= m_num_members;
+			for (unsigned int e=0; e < m_num_members; e++)
+				KalmanDiff[m_num_members * b + e] = mean;
+		}
+
+		// Update ensemble (B x E += B x E)
+		Matrix_Add_Matrix(m_weights, KalmanDiff, m_weights, m_num_states, m_num_members);
+	}
+	else if (m_verbose)
+		printf("innovation %f: correction skipped\n", distance);
 
 	// apply weights to state
+	stages.start(STAGE_MEAN);
 	get_weighted_mean(predictedState);
+	stages.stop();
 
 	free(currMean);
 	free(ha);
@@ -331,6 +514,176 @@ void BIP::estimate_state(double sample, double *sensors, double *sensorNoise, do
 	free(observations);
 }
 
+/*
+	Ensemble transform Kalman filter (Bishop et al. 2001, symmetric square root form). Instead of correcting
+	each member towards its own noisy copy of the observation, the whole ensemble is moved by one deterministic
+	transform in ensemble space:
+
+	Y = R^-1/2 . HA													(D x E, scaled predicted deviations)
+	Pa = ((E-1) I + Y'Y)^-1										(E x E)
+	X' = mean + A . (Pa . Y' . R^-1/2 (y - mean(HX)) . 1' + sqrt((E-1) Pa))
+
+	Y'Y has rank D at most, so both terms are written with the eigen decomposition of the D x D matrix Y.Y'
+	(Y.Y' = U L U', and V = Y' U L^-1/2 are the matching ensemble space directions). Only a 3 x 3
+	eigen problem is solved per update, and everything else is O(B x E x D).
+	The observation noise R is diagonal. Because nothing is drawn at random, the same inputs always give the
+	same ensemble.
+*/
+void BIP::estimate_state_etkf(double sample, double *sensors, double *predictedState)
+{
+	const double noise_var = ETKF_OBSERVATION_STD * ETKF_OBSERVATION_STD;
+	const double n = m_num_members - 1;
+	real_t *HX = m_scratch;											// D x E
+	real_t *Y = m_scratch + NUM_STATE_VARIABLES * m_num_members;	// D x E
+	real_t *V = m_scratch + 2 * NUM_STATE_VARIABLES * m_num_members;	// one row per eigen direction
+	double G[NUM_STATE_VARIABLES * NUM_STATE_VARIABLES];
+	double lambda[NUM_STATE_VARIABLES];
+	double innovation[NUM_STATE_VARIABLES];
+	double observed[NUM_STATE_VARIABLES];
+	double mean[MAX_ENSEMBLE_STATES];
+	double shift[MAX_ENSEMBLE_STATES];	// correction of the ensemble mean
+	double AV[NUM_STATE_VARIABLES * MAX_ENSEMBLE_STATES];	// A . v for each direction, scaled by (g-1)
+	double *w = m_scratch_w;
+	CStageCounter stages;
+
+	stages.start(STAGE_PROPAGATE);
+	propagate_ensemble(sample);
+	get_ensemble_mean(mean, m_weights);
+
+	// no perturbation of the predictions either: the spread of the ensemble is all there is
+	stages.start(STAGE_HX);
+	hx(HX, 0);
+	stages.start(STAGE_HA);
+	get_ha_matrix(HX, Y);
+	memcpy(observed, sensors, sizeof(observed));
+	if (m_latent)
+		ignore_robot(HX, Y, observed);
+
+	// innovation of the mean prediction, and the deviations, in units of the observation noise
+	for (unsigned int d=0; d < NUM_STATE_VARIABLES; d++)
+	{
+		double predicted = HX[m_num_members * d] - Y[m_num_members * d];
+		innovation[d] = (observed[d] - predicted) / sqrt(noise_var);
+		for (unsigned int e=0; e < m_num_members; e++)
+			Y[m_num_members * d + e] /= sqrt(noise_var);
+	}
+
+	// G = Y . Y' (D x E . E x D = D x D), summed in double whatever the storage type.
+	stages.start(STAGE_GAIN);
+	// Then G = U L U' (U is returned in the columns of G).
+	for (unsigned int i=0; i < NUM_STATE_VARIABLES; i++)
+	{
+		for (unsigned int j=0; j < NUM_STATE_VARIABLES; j++)
+		{
+			double s = 0;
+			for (unsigned int e=0; e < m_num_members; e++)
+				s += (double)Y[m_num_members * i + e] * Y[m_num_members * j + e];
+			G[NUM_STATE_VARIABLES * i + j] = s;
+		}
+	}
+	if (LAPACKE_dsyev(LAPACK_ROW_MAJOR, 'V', 'U', NUM_STATE_VARIABLES, G, NUM_STATE_VARIABLES, lambda) != 0)
+	{
+		printf("ETKF: eigen decomposition failed, ensemble not corrected\n");
+		correction_failed();
+		stages.start(STAGE_MEAN);
+		get_weighted_mean(predictedState);
+		return;
+	}
+
+	// Mahalanobis distance of the innovation: in noise units S = Y.Y' + I = U (L + I) U'
+	double distance = 0;
+	for (unsigned int k=0; k < NUM_STATE_VARIABLES; k++)
+	{
+		double proj = 0;
+		for (unsigned int d=0; d < NUM_STATE_VARIABLES; d++)
+			proj += G[NUM_STATE_VARIABLES * d + k] * innovation[d];
+		distance += proj * proj / (std::max(lambda[k], 0.0) + 1);
+	}
+	distance = sqrt(distance);
+	if (skip_correction(distance))
+	{
+		if (m_verbose)
+			printf("innovation %f: correction skipped\n", distance);
+		stages.start(STAGE_MEAN);
+		get_weighted_mean(predictedState);
+		return;
+	}
+
+	for (unsigned int e=0; e < m_num_members; e++)
+		w[e] = 0;
+	for (unsigned int b=0; b < m_num_states; b++)
+		shift[b] = 0;
+
+	for (unsigned int k=0; k < NUM_STATE_VARIABLES; k++)
+	{
+		real_t *v = V + m_num_members * k;
+		double *av = AV + m_num_states * k;
+
+		// directions the ensemble does not span are left alone
+		if (lambda[k] <= 1e-9)
+		{
+			for (unsigned int b=0; b < m_num_states; b++)
+				av[b] = 0;
+			for (unsigned int e=0; e < m_num_members; e++)
+				v[e] = 0;
+			continue;
+		}
+
+		double sigma = sqrt(lambda[k]);
+		double proj = 0; // u' . innovation
+		for (unsigned int d=0; d < NUM_STATE_VARIABLES; d++)
+			proj += G[NUM_STATE_VARIABLES * d + k] * innovation[d];
+
+		// v = Y' u / sigma, with unit length
+		for (unsigned int e=0; e < m_num_members; e++)
+		{
+			double s = 0;
+			for (unsigned int d=0; d < NUM_STATE_VARIABLES; d++)
+				s += Y[m_num_members * d + e] * G[NUM_STATE_VARIABLES * d + k];
+			v[e] = s / sigma;
+			w[e] += v[e] * sigma / (n + lambda[k]) * proj;
+		}
+
+		// The square root shrinks the spread along v by g = sqrt((E-1) / (E-1 + lambda)). Nothing ever adds
+		// spread to the latent coefficients again, and once it is gone the ensemble stops following the
+		// observations, so they keep the spread of the library: only their mean is corrected.
+		double g = sqrt(n / (n + lambda[k]));
+		for (unsigned int b=0; b < m_num_states; b++)
+		{
+			double s = 0;
+			for (unsigned int e=0; e < m_num_members && b < NUM_ENSEMBLE_STATES; e++)
+				s += (m_weights[m_num_members * b + e] - mean[b]) * v[e];
+			av[b] = s * (g - 1);
+		}
+	}
+
+	// A . w moves the mean
+	stages.start(STAGE_UPDATE);
+	for (unsigned int b=0; b < m_num_states; b++)
+	{
+		for (unsigned int e=0; e < m_num_members; e++)
+			shift[b] += (m_weights[m_num_members * b + e] - mean[b]) * w[e];
+	}
+
+	// X' = X + A.w + sum((g-1) A.v v'). As with the stochastic filter, the phase is not corrected.
+	for (unsigned int b=0; b < m_num_states; b++)
+	{
+		if (b == ENSEMBLE_STATE_PHASE)
+			continue;
+
+		for (unsigned int e=0; e < m_num_members; e++)
+		{
+			double s = shift[b];
+			for (unsigned int k=0; k < NUM_STATE_VARIABLES; k++)
+				s += AV[m_num_states * k + b] * V[m_num_members * k + e];
+			m_weights[m_num_members * b + e] += s;
+		}
+	}
+
+	stages.start(STAGE_MEAN);
+	get_weighted_mean(predictedState);
+}
+
 /*
 	state ensemble B x E
 	mean Vector of dimension B
@@ -343,27 +696,29 @@ void BIP::get_ensemble_mean(double *mean, double *ensemble)
 	if (!ensemble)
 		printf("No ensemble\n");
 
-	for (unsigned int vars = 0; vars < NUM_ENSEMBLE_STATES; vars++)
+	for (unsigned int vars = 0; vars < m_num_states; vars++)
 		mean[vars] = 0;
 
-	for (vars = 0; vars < NUM_ENSEMBLE_STATES; vars++)
+	for (vars = 0; vars < m_num_states; vars++)
 	{
-		for (index=0; index < NUM_ENSEMBLE_MEMBERS; index++)
+		for (index=0; index < m_num_members; index++)
 		{
-			mean[vars] += ensemble[NUM_ENSEMBLE_MEMBERS * vars + index];
+			mean[vars] += ensemble[m_num_members * vars + index];
 		}
-		mean[vars] /= NUM_ENSEMBLE_MEMBERS;
+		mean[vars] /= m_num_members;
 	}
 }
 
-void BIP::generate_noise(double *matrix, double range, int n, int m)
+// the observation noise matrix (n x m)
+void BIP::generate_noise(real_t *matrix, double range, int n, int m)
 {
+	CRandom random(RNG_BLOCK_OBSERVATION_NOISE, m_trial, m_tick);
 	int row, col;
 	for (row = 0; row < n; row++)
 	{
 		for (col=0; col < m; col++)
 		{
-			matrix[row * m + col] = ((double)rand()/(double)RAND_MAX) * range - range/(double)2;
+			matrix[row * m + col] = random.noise(range);
 		}
 	}
 }
@@ -371,37 +726,42 @@ void BIP::generate_noise(double *matrix, double range, int n, int m)
 /* update the phase based on phase velocity */
 void BIP::propagate_ensemble(double sample)
 {
-	printf("Propagating at phase: ");
+	if (m_verbose)
+		printf("Propagating at phase: ");
 	unsigned int i;
-	for (i=0; i < NUM_ENSEMBLE_MEMBERS; i++)
+	for (i=0; i < m_num_members; i++)
 	{
-		double phase = sample * m_weights[i + NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_PHASE_VEL];
-		//printf("%f ", phase * m_weights[i + NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_PHASE_VEL]);
-		printf("%f ", phase);
+		double phase = sample * m_weights[i + m_num_members * ENSEMBLE_STATE_PHASE_VEL];
+		//printf("%f ", phase * m_weights[i + m_num_members * ENSEMBLE_STATE_PHASE_VEL]);
+		if (m_verbose)
+			printf("%f ", phase);
 
-		//m_weights[i + NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_PHASE] += 
-		//	(m_weights[i + NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_PHASE_VEL] * phase);
-		m_weights[i + NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_PHASE] = phase; 
+		//m_weights[i + m_num_members * ENSEMBLE_STATE_PHASE] += 
+		//	(m_weights[i + m_num_members * ENSEMBLE_STATE_PHASE_VEL] * phase);
+		m_weights[i + m_num_members * ENSEMBLE_STATE_PHASE] = phase; 
 
 		// make sure the phase does not exceed the limits
-		if (m_weights[i + NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_PHASE] < 0)
-			m_weights[i + NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_PHASE] = 0;
+		if (m_weights[i + m_num_members * ENSEMBLE_STATE_PHASE] < 0)
+			m_weights[i + m_num_members * ENSEMBLE_STATE_PHASE] = 0;
 
-		if (m_weights[i + NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_PHASE] > 1)
-			m_weights[i + NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_PHASE] = 1;
+		if (m_weights[i + m_num_members * ENSEMBLE_STATE_PHASE] > 1)
+			m_weights[i + m_num_members * ENSEMBLE_STATE_PHASE] = 1;
 	}
 	
-	putc('\n', stdout);
+	if (m_verbose)
+		putc('\n', stdout);
 }
 
-void BIP::add_sensor_noise(double *sensors, double *obs, double range, int m, int n)
+// one perturbed copy of the sensor readings (m) per ensemble member (n), each from the member's own stream
+void BIP::add_sensor_noise(double *sensors, real_t *obs, double range, int m, int n)
 {
-	unsigned int row, col;
-	for (row=0; row < m; row++)
+	int row, col;
+	for (col=0; col < n; col++)
 	{
-		for (col=0; col < n; col++)
+		CRandom random(RNG_BLOCK_OBSERVATION, m_trial, m_tick, col);
+		for (row=0; row < m; row++)
 		{
-			obs[row * n + col] = sensors[row] + ((double)rand()/(double)RAND_MAX) * range - range/(double)2;
+			obs[row * n + col] = sensors[row] + random.noise(range);
 		}
 	}
 }
@@ -416,9 +776,9 @@ void BIP::get_weighted_mean(double *matrix)
 		matrix[state] = 0;
 
 	// look up the sample at this phase directly from the demonstrations
-	for (interaction_list::iterator i = m_interactions.begin(); i != m_interactions.end(); i++)
+	for (demonstration = 0; demonstration < m_num_members; demonstration++)
 	{
-		(*i)->get_sample(m_weights[ENSEMBLE_STATE_PHASE], sample);
+		member_sample(demonstration, m_weights[ENSEMBLE_STATE_PHASE], sample);
 		//printf("Got sample from demonstration %i:\n", demonstration);
 		//print_matrix_double(sample, 1, NUM_STATE_VARIABLES);
 
@@ -426,7 +786,6 @@ void BIP::get_weighted_mean(double *matrix)
 		matrix[STATE_VAR_BALL_X] += sample[STATE_VAR_BALL_X];
 		matrix[STATE_VAR_BALL_Y] += sample[STATE_VAR_BALL_Y];
 		matrix[STATE_VAR_ROBOT_X] += sample[STATE_VAR_ROBOT_X];
-		demonstration++;
 	}
 
 	for (state=0; state < NUM_STATE_VARIABLES; state++)
@@ -435,7 +794,7 @@ void BIP::get_weighted_mean(double *matrix)
 
 void BIP::apply_weights(int member, double *sample)
 {
-	sample[STATE_VAR_BALL_X] *= m_weights[NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_WEIGHT + member];
-	sample[STATE_VAR_BALL_Y] *= m_weights[NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_WEIGHT + member];
-	sample[STATE_VAR_ROBOT_X] *= m_weights[NUM_ENSEMBLE_MEMBERS * ENSEMBLE_STATE_WEIGHT + member];
+	sample[STATE_VAR_BALL_X] *= m_weights[m_num_members * ENSEMBLE_STATE_WEIGHT + member];
+	sample[STATE_VAR_BALL_Y] *= m_weights[m_num_members * ENSEMBLE_STATE_WEIGHT + member];
+	sample[STATE_VAR_ROBOT_X] *= m_weights[m_num_members * ENSEMBLE_STATE_WEIGHT + member];
 }
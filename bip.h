@@ -3,15 +3,19 @@
 
 #include <list>
 #include "interaction.h"
+#include "library.h"
+#include "estimator.h"
 
 enum
 {
 	ENSEMBLE_STATE_PHASE,
 	ENSEMBLE_STATE_PHASE_VEL,
 	ENSEMBLE_STATE_WEIGHT,
-	NUM_ENSEMBLE_STATES
+	NUM_ENSEMBLE_STATES		// in the latent space, the coefficients of the latent model follow (see latent.h)
 };
 
+#define MAX_ENSEMBLE_STATES	(NUM_ENSEMBLE_STATES + MAX_LATENT_FUNCTIONS)
+
 enum
 {
 	SENSOR_PLAYER,
@@ -20,36 +24,53 @@ enum
 	MAX_SENSORS
 };
 
-typedef std::list<CInteraction*> interaction_list;
-
 class EnsembleKalmanFilter;
 
-class BIP
+// the gain of the stochastic filter, from the partial gain (states x D) and the inverse innovation covariance
+void kalman_gain(const real_t *partial, const real_t *S_inv, real_t *gain, unsigned int states);
+
+class BIP : public CEstimator
 {
 public:
-	BIP();
+	// with a latent rank, the members are trajectories of the library's latent model rather than demonstrations
+	BIP(CDemoLibrary *library, unsigned int members = NUM_ENSEMBLE_MEMBERS, unsigned int latent_rank = 0);
 	~BIP();
-	void add_demonstration(CInteraction *interaction);
 	void get_phase_stats(double *phase_velocity_mean, double *phase_velocity_var);
 	void get_mean_trajectory(double range_start, double range_end, unsigned int num_samples, double *trajectory);
 
 	void get_ensemble_mean(double *mean, double *ensemble);
 	void create_initial_ensemble();
-	void estimate_state(double phase, double *sensors, double *sensorNoise, double *predictedState);
+	bool retrieve_members(const double *features);
+	void set_filter(unsigned int filter) { m_filter = filter; } // FILTER_ENKF or FILTER_ETKF
+	void estimate_state(double sample, double *sensors, double *predictedState);
+	size_t memory_usage();
+	unsigned int num_members() { return m_num_members; }
 	void get_weighted_mean(double *matrix);
 	
 
 protected:
-	void generate_noise(double *matrix, double range, int n, int m);
-	void hx(double *matrix);
-	void get_ha_matrix(double *hx, double *ha);
+	void generate_noise(real_t *matrix, double range, int n, int m);
+	void estimate_state_etkf(double sample, double *sensors, double *predictedState);
+	void hx(real_t *matrix, double range);
+	void get_ha_matrix(real_t *hx, real_t *ha);
 	void propagate_ensemble(double sample);
-	void add_sensor_noise(double *sensors, double *obs, double range, int m, int n);
+	void add_sensor_noise(double *sensors, real_t *obs, double range, int m, int n);
 	void apply_weights(int member, double *sample);
+	void member_sample(unsigned int member, double phase, double sample[]);
+	void set_coefficients(unsigned int member);
+	void ignore_robot(real_t *hx, real_t *ha, double *observed);
 
 private:
-	interaction_list m_interactions;
-	double m_weights[NUM_ENSEMBLE_STATES * NUM_ENSEMBLE_MEMBERS]; // weights representing each ensemble member - rename as m_ensemble (B x E)
+	unsigned int m_filter; // FILTER_ENKF or FILTER_ETKF
+	unsigned int m_num_members; // E
+	CDemoLibrary *m_library; // shared demonstrations (holds a reference)
+	interaction_list &m_interactions;
+	CInteraction **m_members; // demonstration behind each ensemble member (this trial)
+	const CLatentModel *m_latent; // NULL: every member follows its demonstration
+	unsigned int m_num_states; // B: NUM_ENSEMBLE_STATES, plus the rank of the latent model
+	double *m_weights; // weights representing each ensemble member - rename as m_ensemble (B x E)
+	real_t *m_scratch; // square-root filter: HX, Y and V (3 x D x E)
+	double *m_scratch_w; // square-root filter: w (E)
 };
 
 #endif // _BIP__H
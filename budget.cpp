@@ -0,0 +1,106 @@
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <cblas.h>
+#include <vector>
+#include <algorithm>
+#include "budget.h"
+
+static std::vector<int> cores;		// the cores the budget hands out, from the affinity of the process
+static bool pinning;
+static unsigned int workers;			// in the current parallel region (0: none)
+static unsigned int peak_workers;	// largest region so far
+static struct timespec started;
+
+void budget_init(unsigned int count, bool pin)
+{
+	cpu_set_t set;
+
+	cores.clear();
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+	{
+		for (int c=0; c < CPU_SETSIZE; c++)
+			if (CPU_ISSET(c, &set))
+				cores.push_back(c);
+	}
+	if (cores.empty())
+		cores.push_back(0);
+	if (count && count < cores.size())
+		cores.resize(count);
+
+	pinning = pin;
+	workers = 0;
+	peak_workers = 1;
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	openblas_set_num_threads(budget_threads(BUDGET_BLAS));
+}
+
+unsigned int budget_cores()
+{
+	return std::max<size_t>(1, cores.size());
+}
+
+unsigned int budget_threads(unsigned int kind)
+{
+	unsigned int n = budget_cores();
+
+	switch (kind)
+	{
+	case BUDGET_WORKERS:
+		return workers ? workers : 1;
+	case BUDGET_BLAS:
+		return workers ? 1 : std::min(n, (unsigned int)BUDGET_BLAS_THREADS);
+	case BUDGET_LOADERS:
+		return workers ? 1 : std::min(n, (unsigned int)BUDGET_LOADER_THREADS);
+	}
+	return 1;
+}
+
+unsigned int budget_parallel(unsigned int requested)
+{
+	workers = std::max(1u, std::min(requested, budget_cores()));
+	peak_workers = std::max(peak_workers, workers);
+	openblas_set_num_threads(budget_threads(BUDGET_BLAS));
+	return workers;
+}
+
+void budget_serial()
+{
+	workers = 0;
+	openblas_set_num_threads(budget_threads(BUDGET_BLAS));
+}
+
+// slot s gets the s-th share of the cores (with fewer workers than cores, a share is several of them)
+void budget_worker(unsigned int slot)
+{
+	cpu_set_t set;
+
+	if (!pinning || !workers)
+		return;
+
+	unsigned int share = budget_cores() / workers;
+	CPU_ZERO(&set);
+	for (unsigned int i=0; i < share; i++)
+		CPU_SET(cores[(slot % workers) * share + i], &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0)
+		perror("Can't pin a worker");
+}
+
+void budget_report(FILE *f)
+{
+	struct rusage self, children;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+
+	double wall = (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9;
+	double cpu = self.ru_utime.tv_sec + self.ru_utime.tv_usec / 1e6 + self.ru_stime.tv_sec + self.ru_stime.tv_usec / 1e6 +
+		children.ru_utime.tv_sec + children.ru_utime.tv_usec / 1e6 + children.ru_stime.tv_sec + children.ru_stime.tv_usec / 1e6;
+
+	fprintf(f, "Thread budget: %u cores; %u workers%s x 1 BLAS thread in parallel, otherwise %u BLAS and %u loader threads\n",
+		budget_cores(), peak_workers, pinning ? " (pinned)" : "", std::min(budget_cores(), (unsigned int)BUDGET_BLAS_THREADS),
+		std::min(budget_cores(), (unsigned int)BUDGET_LOADER_THREADS));
+	fprintf(f, "Effective parallelism: %.2f (%.2f s CPU in %.2f s)\n", wall > 0 ? cpu / wall : 0, cpu, wall);
+}
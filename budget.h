@@ -0,0 +1,39 @@
+#ifndef _BUDGET__H
+#define _BUDGET__H
+
+#include <stdio.h>
+
+#define BUDGET_BLAS_THREADS		2	// most OpenBLAS threads: the ensemble matrices are small (D x E)
+#define BUDGET_LOADER_THREADS		8	// most threads reading traces: past that the disk is the limit
+
+// the kinds of threads the budget hands out cores to
+enum
+{
+	BUDGET_WORKERS,	// trials or replays run in parallel (the processes of a sweep, the threads of compare)
+	BUDGET_BLAS,		// OpenBLAS threads, per worker: the estimator runs on its worker plus these
+	BUDGET_LOADERS,	// threads reading the traces of a library
+	MAX_BUDGETS
+};
+
+/*
+	Thread budget: one place that decides how many of the machine's cores each kind of thread gets, so the
+	parallel workers don't end up competing with an OpenBLAS thread pool of the same size in each of them.
+
+	Outside a parallel region, the process has all the cores to itself: the library is loaded by up to
+	BUDGET_LOADER_THREADS threads, and OpenBLAS may use BUDGET_BLAS_THREADS. A parallel region (budget_parallel)
+	gives each worker an equal share of the cores, and keeps OpenBLAS (and loading) single threaded until it ends.
+	Every worker calls budget_worker when it starts, which pins it to its share of the cores if pinning was
+	asked for. The setting of OpenBLAS is process wide, and forked workers inherit it.
+
+	The effective parallelism reported is the CPU time of the process and of the workers it has waited for,
+	divided by the wall time since budget_init.
+*/
+void budget_init(unsigned int cores, bool pin); // 0 cores: every core this process may run on
+unsigned int budget_cores();
+unsigned int budget_threads(unsigned int kind); // how many threads of this kind to run now
+unsigned int budget_parallel(unsigned int workers); // start of a parallel region: returns the workers granted
+void budget_serial(); // end of the parallel region
+void budget_worker(unsigned int slot); // in each worker of a region (slot < workers granted)
+void budget_report(FILE *f);
+
+#endif // _BUDGET__H
@@ -0,0 +1,626 @@
+/*
+	Compares the state estimators on recorded traces, without the physics or the UI.
+
+	Every test trace (written in training mode) is replayed through each estimator: the ball position is read
+	from the trace, and a simulated robot is steered towards the estimated robot position, the same way the
+	simulation does it. A trace counts as caught if the robot ends up under the ball where the ball lands
+	(the last sample of the trace). For each estimator we report the catch rate, the latency of estimate_state
+	and the memory it needs per trial, the throughput, and how far the estimated robot position is from the
+	landing point over the course of a trace.
+
+	The traces are replayed as fast as possible, spread over all cores. Each trace is a separate trial with
+	its own random numbers (see random.h) and the results are combined in trace order, so the output does not
+	depend on the number of threads. With -L, the traces replayed are the demonstrations themselves, each one
+	against a library of all the others (leave-one-out).
+
+	With -g, the ensemble filters are replayed a second time with the innovation gate (see estimator.h), and
+	the corrections skipped are reported next to what that did to the robot error and the catch rate. With -k,
+	they are replayed once more in the latent space of the library (see latent.h).
+
+	The estimates can also be written to a file (-w) and checked against such a file (-c), which is how the
+	single precision build is validated against the double precision one (make validate).
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "estimator.h"
+#include "library.h"
+#include "metrics.h"
+#include "mysim.h"
+#include "random.h"
+#include "budget.h"
+#include "counters.h"
+
+#define REPLAY_SCALE			10.0	// same as CSimulation
+#define REPLAY_ROBOT_STEP	(ROBOT_VELOCITY * REPLAY_SCALE / SENSOR_FREQUENCY) // robot movement per sensor period
+#define REPLAY_CATCH_DISTANCE	35		// half of the robot width + half of the ball
+#define PRECISION_TOLERANCE		0.5	// largest acceptable mean difference (pixels) from the reference estimates
+#define PROGRESS_BINS			10		// the robot error is reported for each tenth of a trace
+
+static struct option options[] =
+{
+	{"check", required_argument, 0, 'c'},
+	{"counters", no_argument, 0, 'C'},
+	{"seed", required_argument, 0, 'e'},
+	{"filter", required_argument, 0, 'f'},
+	{"gate", required_argument, 0, 'g'},
+	{"help", no_argument, 0, 'h'},
+	{"threads", required_argument, 0, 'j'},
+	{"latent-rank", required_argument, 0, 'k'},
+	{"leave-one-out", no_argument, 0, 'L'},
+	{"library-size", required_argument, 0, 'n'},
+	{"tracepath", required_argument, 0, 'p'},
+	{"pin", no_argument, 0, 'P'},
+	{"testpath", required_argument, 0, 'T'},
+	{"write", required_argument, 0, 'w'},
+	{0, no_argument, 0, 0}
+};
+
+// the outcome of replaying one trace
+struct trace_result
+{
+	bool caught;
+	double robot_error;	// sum over all ticks of |estimated robot position - landing position|
+	double progress_error[PROGRESS_BINS]; // the same, split by how far into the trace the tick is
+	unsigned int progress_ticks[PROGRESS_BINS];
+	std::vector<double> estimates; // D per tick
+	gate_stats gate;
+};
+
+// one estimator over all of the traces
+struct replay_result
+{
+	unsigned int traces;
+	unsigned int catches;
+	double robot_error;
+	uint64_t ticks;
+	gate_stats gate;
+	size_t memory;
+	double elapsed;		// wall time (s)
+	double progress_error[PROGRESS_BINS];
+	unsigned int progress_ticks[PROGRESS_BINS];
+	CHistogram latency;
+	counter_totals counters;	// per stage of the ensemble filters, with -C
+	FILE *record;			// write every estimate here (or NULL)
+	FILE *reference;		// compare every estimate with this file (or NULL)
+	double max_difference;	// largest difference from the reference
+	double sum_difference;	// sum over all ticks of the largest difference in any state variable
+	bool reference_short;	// the reference ran out of estimates
+};
+
+static void usage(void)
+{
+	printf("Estimator comparison v%u\n", VERSION);
+	printf("usage:\n");
+	printf("compare [options]\n\n");
+	printf("c <string>: Compare the estimates with a file written by -w, and fail if they differ by more than %.1f pixels on average\n", PRECISION_TOLERANCE);
+	printf("C: Count cycles, instructions, cache and branch misses in each stage of the ensemble filters\n");
+	printf("e <int>: Seed for all random numbers (default 1)\n");
+	printf("f <string>: Run this estimator (can be repeated, default: all of them)\n");
+	printf("g <float>[:<int>]: Also replay with the innovation gate: skip the correction below this Mahalanobis distance,\n");
+	printf("   for up to this many updates in a row (default %u)\n", GATE_MAX_STALE);
+	printf("h: Help - this screen\n");
+	printf("j <int>: Number of threads (default: one per core)\n");
+	printf("k <int>: Also replay the ensemble filters in a latent space of this many principal components (1-%u)\n",
+		MAX_LATENT_FUNCTIONS);
+	printf("L: Leave-one-out: replay every demonstration against a library of all the others\n");
+	printf("n <int>: Number of demonstrations to draw from the trace directory (default %u)\n", NUM_ENSEMBLE_MEMBERS);
+	printf("p <string>: Path to directory containing the demonstrations\n");
+	printf("P: Pin each thread to its share of the cores\n");
+	printf("T <string>: Path to directory containing the traces to replay (default: the demonstrations)\n");
+	printf("w <string>: Write every estimate to this file\n");
+}
+
+// one line per estimate: filter, tick, and the estimated state
+static void check_estimate(replay_result *result, const char *filter, unsigned long tick, const double *estimate)
+{
+	if (result->record)
+		fprintf(result->record, "%s %lu %.9g %.9g %.9g\n", filter, tick,
+			estimate[STATE_VAR_BALL_X], estimate[STATE_VAR_BALL_Y], estimate[STATE_VAR_ROBOT_X]);
+
+	if (result->reference && !result->reference_short)
+	{
+		char name[32];
+		unsigned long ref_tick;
+		double ref[NUM_STATE_VARIABLES];
+		if (fscanf(result->reference, "%31s %lu %lf %lf %lf", name, &ref_tick,
+			&ref[STATE_VAR_BALL_X], &ref[STATE_VAR_BALL_Y], &ref[STATE_VAR_ROBOT_X]) != 5 ||
+			strcmp(name, filter) != 0 || ref_tick != tick)
+		{
+			result->reference_short = true;
+			return;
+		}
+
+		double diff = 0;
+		for (unsigned int d=0; d < NUM_STATE_VARIABLES; d++)
+		{
+			double e = fabs(estimate[d] - ref[d]);
+			diff = std::max(diff, isnan(e) ? HUGE_VAL : e);
+		}
+		result->sum_difference += diff;
+		result->max_difference = std::max(result->max_difference, diff);
+	}
+}
+
+static void replay(CEstimator *estimator, CInteraction *trace, trace_result *result, CHistogram *latency)
+{
+	const measurement *samples = trace->samples();
+	unsigned long length = trace->length();
+	double sensors[NUM_STATE_VARIABLES];
+	double estimate[NUM_STATE_VARIABLES];
+
+	result->caught = false;
+	result->robot_error = 0;
+	for (unsigned int p=0; p < PROGRESS_BINS; p++)
+	{
+		result->progress_error[p] = 0;
+		result->progress_ticks[p] = 0;
+	}
+	if (!length)
+		return;
+
+	gate_stats before = estimator->gate_statistics();
+	double landing_x = samples[length - 1].ball.x;
+	double robot_x = samples[0].robot.x;
+	result->estimates.resize(length * NUM_STATE_VARIABLES);
+
+	estimator->create_initial_ensemble();
+	for (unsigned long i=0; i < length; i++)
+	{
+		double sample = ((double)samples[i].timestamp / 1000000000) * (double)SENSOR_FREQUENCY;
+		sensors[STATE_VAR_BALL_X] = samples[i].ball.x;
+		sensors[STATE_VAR_BALL_Y] = samples[i].ball.y;
+		sensors[STATE_VAR_ROBOT_X] = robot_x;
+
+		uint64_t start = metrics_now_ns();
+		estimator->estimate_state(sample, sensors, estimate);
+		latency->record(metrics_now_ns() - start);
+		for (unsigned int d=0; d < NUM_STATE_VARIABLES; d++)
+			result->estimates[i * NUM_STATE_VARIABLES + d] = estimate[d];
+
+		if (estimate[STATE_VAR_ROBOT_X] > robot_x)
+			robot_x += std::min(REPLAY_ROBOT_STEP, estimate[STATE_VAR_ROBOT_X] - robot_x);
+		else
+			robot_x -= std::min(REPLAY_ROBOT_STEP, robot_x - estimate[STATE_VAR_ROBOT_X]);
+
+		double error = fabs(estimate[STATE_VAR_ROBOT_X] - landing_x);
+		unsigned int bin = i * PROGRESS_BINS / length;
+		result->robot_error += error;
+		result->progress_error[bin] += error;
+		result->progress_ticks[bin]++;
+	}
+
+	result->caught = (fabs(robot_x - landing_x) < REPLAY_CATCH_DISTANCE);
+	result->gate.updates = estimator->gate_statistics().updates - before.updates;
+	result->gate.skipped = estimator->gate_statistics().skipped - before.skipped;
+	result->gate.forced = estimator->gate_statistics().forced - before.forced;
+}
+
+/*
+	Replay every trace through one kind of estimator. The traces are handed out to the threads one at a time;
+	every thread has its own estimator (or one per trace, when leaving one out) and its own latency histogram.
+	A gate threshold of 0 always corrects, and a latent rank of 0 follows the demonstrations.
+*/
+static void replay_all(unsigned int filter, CDemoLibrary *library, std::vector<CInteraction*> &traces,
+	bool leave_one_out, unsigned int num_threads, double gate, unsigned int max_stale, unsigned int latent_rank,
+	replay_result *result, std::vector<trace_result> &per_trace)
+{
+	std::atomic<unsigned int> next(0);
+	std::vector<CHistogram*> latency(num_threads);
+	std::vector<std::thread> threads;
+
+	per_trace.assign(traces.size(), trace_result());
+
+	// The first trial that uses a library stores the shared initial ensemble (and the latent model) in it, so
+	// do that before the threads start. This also measures the memory of one estimator.
+	CEstimator *first = CreateEstimator(filter, library, NUM_ENSEMBLE_MEMBERS, latent_rank);
+	first->set_verbose(false);
+	first->set_trial(0);
+	first->create_initial_ensemble();
+	result->memory = first->memory_usage();
+	delete first;
+
+	uint64_t start = metrics_now_ns();
+	for (unsigned int t=0; t < num_threads; t++)
+	{
+		latency[t] = new CHistogram();
+		threads.push_back(std::thread([&, t]()
+		{
+			CEstimator *estimator = NULL;
+			unsigned int i;
+
+			budget_worker(t);
+
+			while ((i = next++) < traces.size())
+			{
+				if (leave_one_out || !estimator)
+				{
+					delete estimator;
+					CDemoLibrary *others = leave_one_out ? library->Without(traces[i]) : library;
+					estimator = CreateEstimator(filter, others, NUM_ENSEMBLE_MEMBERS, latent_rank);
+					estimator->set_verbose(false);
+					estimator->set_gate(gate, max_stale);
+					if (leave_one_out)
+						others->Release(); // the estimator holds its own reference
+				}
+
+				estimator->set_trial(i);
+				replay(estimator, traces[i], &per_trace[i], latency[t]);
+			}
+			delete estimator;
+		}));
+	}
+	for (unsigned int t=0; t < num_threads; t++)
+	{
+		threads[t].join();
+		result->latency.merge(*latency[t]);
+		delete latency[t];
+	}
+	result->elapsed = (double)(metrics_now_ns() - start) / 1000000000;
+	if (counters_enabled)
+		counters_snapshot(&result->counters, true);
+
+	// combined in trace order, so the sums don't depend on which thread replayed what
+	for (unsigned int i=0; i < traces.size(); i++)
+	{
+		const trace_result &r = per_trace[i];
+		result->traces++;
+		result->catches += r.caught;
+		result->robot_error += r.robot_error;
+		result->ticks += r.estimates.size() / NUM_STATE_VARIABLES;
+		result->gate.updates += r.gate.updates;
+		result->gate.skipped += r.gate.skipped;
+		result->gate.forced += r.gate.forced;
+		for (unsigned int p=0; p < PROGRESS_BINS; p++)
+		{
+			result->progress_error[p] += r.progress_error[p];
+			result->progress_ticks[p] += r.progress_ticks[p];
+		}
+	}
+}
+
+static void print_result(const char *name, const replay_result *result)
+{
+	printf("%-10s %8u %8u %7.1f%% %10.1f %10.1f %10.1f %10.1f %12.1f %10.0f\n", name,
+		result->traces, result->catches, result->traces ? result->catches * 100.0 / result->traces : 0,
+		result->latency.mean() / 1000.0, result->latency.percentile(50) / 1000.0,
+		result->latency.percentile(99) / 1000.0, result->memory / 1024.0,
+		result->ticks ? result->robot_error / result->ticks : 0,
+		result->elapsed > 0 ? result->traces / result->elapsed : 0);
+}
+
+static void print_progress(const char *name, const replay_result *result)
+{
+	printf("%-10s", name);
+	for (unsigned int p=0; p < PROGRESS_BINS; p++)
+		printf(" %7.1f", result->progress_ticks[p] ? result->progress_error[p] / result->progress_ticks[p] : 0);
+	printf("\n");
+}
+
+static int load_traces(const char *path, std::vector<CInteraction*> &traces)
+{
+	CTraceIndex index;
+	if (index.Build(path, INDEX_MAX_ENTRIES) < 0)
+		return -1;
+
+	for (unsigned int i=0; i < index.size(); i++)
+	{
+		char *filename = NULL;
+		if (asprintf(&filename, "%s/%s", path, index.entry(i).name) < 0)
+			return -1;
+
+		FILE *f = fopen(filename, "r");
+		if (!f)
+		{
+			printf("Error opening %s\n", filename);
+			free(filename);
+			continue;
+		}
+
+		CInteraction *trace = new CInteraction(REPLAY_SCALE);
+		if (!trace->Load(f))
+		{
+			printf("Skipping malformed trace %s\n", filename);
+			delete trace;
+			trace = NULL;
+		}
+		fclose(f);
+		free(filename);
+		if (trace)
+			traces.push_back(trace);
+	}
+
+	return traces.size();
+}
+
+int main(int argc, char* argv[])
+{
+	const char *tracepath = ".";
+	const char *testpath = NULL;
+	unsigned int library_size = NUM_ENSEMBLE_MEMBERS;
+	unsigned int filters = 0; // bit mask of the estimators to run
+	unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+	bool leave_one_out = false;
+	uint64_t seed = 1;
+	double gate = 0;
+	unsigned int max_stale = GATE_MAX_STALE;
+	unsigned int latent_rank = 0;
+	FILE *record = NULL;
+	FILE *reference = NULL;
+	bool failed = false;
+	bool pin = false;
+	bool counters = false;
+	std::vector<CInteraction*> traces;
+
+	int c;
+	while ((c = getopt_long(argc, argv, "c:Ce:f:g:hj:k:Ln:p:PT:w:", options, 0)) != -1)
+	{
+		unsigned int filter;
+
+		switch (c)
+		{
+		case 'c':
+			reference = fopen(optarg, "r");
+			if (!reference)
+			{
+				printf("Can't open reference file '%s'\n", optarg);
+				return -1;
+			}
+			break;
+		case 'C':
+			counters = true;
+			break;
+		case 'e':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'f':
+			for (filter = 0; filter < MAX_FILTERS; filter++)
+				if (strcmp(optarg, filter_name(filter)) == 0)
+					break;
+			if (filter == MAX_FILTERS)
+			{
+				printf("Unknown filter '%s'\n", optarg);
+				return -1;
+			}
+			filters |= 1 << filter;
+			break;
+		case 'g':
+			if (sscanf(optarg, "%lf:%u", &gate, &max_stale) < 1 || gate <= 0)
+			{
+				printf("Bad gate '%s' (expected threshold[:max_stale])\n", optarg);
+				return -1;
+			}
+			break;
+		case 'h':
+			usage();
+			return 0;
+		case 'j':
+			num_threads = std::max(1, atoi(optarg));
+			break;
+		case 'k':
+			latent_rank = atoi(optarg);
+			if (latent_rank < 1 || latent_rank > MAX_LATENT_FUNCTIONS)
+			{
+				printf("Bad latent rank '%s' (expected 1-%u)\n", optarg, MAX_LATENT_FUNCTIONS);
+				return -1;
+			}
+			break;
+		case 'L':
+			leave_one_out = true;
+			break;
+		case 'n':
+			library_size = atoi(optarg);
+			break;
+		case 'p':
+			tracepath = optarg;
+			break;
+		case 'P':
+			pin = true;
+			break;
+		case 'T':
+			testpath = optarg;
+			break;
+		case 'w':
+			record = fopen(optarg, "w");
+			if (!record)
+			{
+				printf("Can't open '%s' for writing\n", optarg);
+				return -1;
+			}
+			break;
+		}
+	}
+
+	if (!filters)
+		filters = (1 << MAX_FILTERS) - 1;
+	random_seed(seed);
+	budget_init(0, pin);
+	if (counters)
+		counters_enable();
+
+	CDemoLibrary *library = CDemoLibrary::Acquire(tracepath, REPLAY_SCALE, library_size, SELECT_UNIFORM);
+	if (!library->size())
+	{
+		printf("ERROR: no demonstrations in %s\n", tracepath);
+		return -2;
+	}
+
+	if (leave_one_out)
+	{
+		if (testpath)
+			printf("WARNING: leaving one out, so the traces in %s are not used\n", testpath);
+		traces.assign(library->interactions().begin(), library->interactions().end());
+	}
+	else
+	{
+		if (!testpath)
+		{
+			printf("WARNING: replaying the demonstrations themselves, the results will be optimistic\n");
+			testpath = tracepath;
+		}
+		if (load_traces(testpath, traces) <= 0)
+		{
+			printf("ERROR: no traces to replay in %s\n", testpath);
+			return -2;
+		}
+	}
+	printf("%u demonstrations, %lu traces to replay%s\n", library->size(), traces.size(),
+		leave_one_out ? " (leave-one-out)" : "");
+
+	// the threads replay the traces in parallel, so OpenBLAS gets one thread in each
+	num_threads = budget_parallel(num_threads);
+	printf("%s precision, %u threads\n", sizeof(real_t) == sizeof(float) ? "single" : "double", num_threads);
+
+	std::vector<replay_result*> results(MAX_FILTERS);
+	std::vector<replay_result*> gated(MAX_FILTERS);
+	std::vector<replay_result*> latent(MAX_FILTERS);
+	std::vector<trace_result> per_trace;
+
+	printf("%-10s %8s %8s %8s %10s %10s %10s %10s %12s %10s\n", "filter", "traces", "caught", "rate",
+		"mean (us)", "p50 (us)", "p99 (us)", "mem (KB)", "robot err", "traces/s");
+	for (unsigned int filter=0; filter < MAX_FILTERS; filter++)
+	{
+		if (!(filters & (1 << filter)))
+			continue;
+
+		replay_result *result = new replay_result();
+		result->record = record;
+		result->reference = reference;
+		results[filter] = result;
+
+		// every estimator sees the same random numbers: the streams are keyed by the trace (see random.h)
+		replay_all(filter, library, traces, leave_one_out, num_threads, 0, 0, 0, result, per_trace);
+		print_result(filter_name(filter), result);
+
+		// the estimates are written (or checked) in trace order, whichever thread replayed them
+		if (record || reference)
+		{
+			unsigned long tick = 0;
+			for (unsigned int i=0; i < per_trace.size(); i++)
+				for (unsigned int j=0; j < per_trace[i].estimates.size(); j += NUM_STATE_VARIABLES)
+					check_estimate(result, filter_name(filter), tick++, &per_trace[i].estimates[j]);
+		}
+
+		if (reference)
+		{
+			// a demonstration sample picked one index later can be amplified by the filter for a few ticks,
+			// so single ticks may differ by more than the tolerance
+			double mean = result->ticks ? result->sum_difference / result->ticks : 0;
+			bool ok = !result->reference_short && mean <= PRECISION_TOLERANCE;
+			printf("%-10s difference from the reference: mean %g, largest %g pixels%s: %s\n", filter_name(filter),
+				mean, result->max_difference, result->reference_short ? " (reference does not match)" : "",
+				ok ? "OK" : "FAILED");
+			failed |= !ok;
+		}
+
+		// the same again with the innovation gate (only the ensemble filters have one)
+		if (gate > 0 && (filter == FILTER_ENKF || filter == FILTER_ETKF))
+		{
+			char name[32];
+			snprintf(name, sizeof(name), "%s+gate", filter_name(filter));
+			gated[filter] = new replay_result();
+			replay_all(filter, library, traces, leave_one_out, num_threads, gate, max_stale, 0, gated[filter], per_trace);
+			print_result(name, gated[filter]);
+		}
+
+		// and in the latent space
+		if (latent_rank && (filter == FILTER_ENKF || filter == FILTER_ETKF))
+		{
+			char name[32];
+			snprintf(name, sizeof(name), "%s+pca", filter_name(filter));
+			latent[filter] = new replay_result();
+			replay_all(filter, library, traces, leave_one_out, num_threads, 0, 0, latent_rank, latent[filter],
+				per_trace);
+			print_result(name, latent[filter]);
+		}
+	}
+
+	if (gate > 0)
+	{
+		printf("\ninnovation gate %g (at most %u updates in a row without a correction):\n", gate, max_stale);
+		printf("%-10s %10s %10s %10s %12s %12s %10s %10s\n", "filter", "updates", "skipped", "forced",
+			"robot err", "gated err", "caught", "gated");
+		for (unsigned int filter=0; filter < MAX_FILTERS; filter++)
+		{
+			const replay_result *r = results[filter];
+			const replay_result *g = gated[filter];
+			if (!r || !g)
+				continue;
+
+			printf("%-10s %10lu %9.1f%% %9.1f%% %12.1f %12.1f %10u %10u\n", filter_name(filter), g->gate.updates,
+				g->gate.updates ? g->gate.skipped * 100.0 / g->gate.updates : 0,
+				g->gate.updates ? g->gate.forced * 100.0 / g->gate.updates : 0,
+				r->ticks ? r->robot_error / r->ticks : 0, g->ticks ? g->robot_error / g->ticks : 0,
+				r->catches, g->catches);
+		}
+	}
+
+	// only the ensemble filters are divided into stages
+	for (unsigned int filter=0; filter < MAX_FILTERS && counters_enabled; filter++)
+	{
+		const char *suffix[] = { "", "+gate", "+pca" };
+		const replay_result *runs[] = { results[filter], gated[filter], latent[filter] };
+		for (unsigned int i=0; i < 3; i++)
+		{
+			if (!runs[i] || !runs[i]->counters.calls[STAGE_PROPAGATE])
+				continue;
+
+			char name[32];
+			snprintf(name, sizeof(name), "%s%s", filter_name(filter), suffix[i]);
+			printf("\n");
+			counters_print(stdout, name, runs[i]->counters);
+		}
+	}
+
+	printf("\nrobot error (pixels) by progress through the trace:\n%-10s", "filter");
+	for (unsigned int p=0; p < PROGRESS_BINS; p++)
+		printf(" %6u%%", (p + 1) * 100 / PROGRESS_BINS);
+	printf("\n");
+	for (unsigned int filter=0; filter < MAX_FILTERS; filter++)
+	{
+		replay_result *result = results[filter];
+		if (!result)
+			continue;
+
+		print_progress(filter_name(filter), result);
+		if (gated[filter])
+		{
+			char name[32];
+			snprintf(name, sizeof(name), "%s+gate", filter_name(filter));
+			print_progress(name, gated[filter]);
+		}
+		if (latent[filter])
+		{
+			char name[32];
+			snprintf(name, sizeof(name), "%s+pca", filter_name(filter));
+			print_progress(name, latent[filter]);
+		}
+		delete result;
+		delete gated[filter];
+		delete latent[filter];
+	}
+
+	if (record)
+		fclose(record);
+	if (reference)
+		fclose(reference);
+
+	if (!leave_one_out)
+	{
+		for (unsigned int i=0; i < traces.size(); i++)
+			delete traces[i];
+	}
+	library->Release();
+	CDemoLibrary::Flush();
+
+	budget_serial();
+	budget_report(stdout);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,210 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <mutex>
+#include <vector>
+#include "counters.h"
+
+bool counters_enabled = false;
+
+// the raw counts of one thread: scaled only when they are summed
+struct counter_block
+{
+	uint64_t calls[MAX_STAGES];
+	uint64_t values[MAX_STAGES][MAX_COUNTERS];
+	uint64_t enabled[MAX_STAGES];
+	uint64_t running[MAX_STAGES];
+};
+
+// the counters of one thread, closed when it exits (its counts stay)
+struct counter_thread
+{
+	counter_thread() : opened(false), block(NULL) {}
+	~counter_thread();
+	bool open();
+
+	bool opened;
+	int fd[MAX_COUNTERS];		// -1 for the events this machine doesn't have
+	unsigned int slot[MAX_COUNTERS]; // where each one is in a read of the group
+	unsigned int count;			// events in the group
+	counter_block *block;
+};
+
+static const char *stage_names[MAX_STAGES] =
+{
+	"propagate",
+	"hx",
+	"ha",
+	"gain",
+	"update",
+	"mean",
+};
+
+static const char *counter_names[MAX_COUNTERS] =
+{
+	"cycles",
+	"instructions",
+	"cache misses",
+	"branch misses",
+};
+
+static const uint64_t events[MAX_COUNTERS] =
+{
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static std::mutex blocks_lock; // only taken when a thread opens its counters, or when taking a snapshot
+static std::vector<counter_block*> blocks;
+static thread_local counter_thread local;
+
+static int perf_open(uint64_t event, int group)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = event;
+	attr.disabled = (group < 0);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+// the cycles lead the group: without them nothing is counted, the other events are optional
+bool counter_thread::open()
+{
+	opened = true;
+	count = 0;
+	for (unsigned int c=0; c < MAX_COUNTERS; c++)
+	{
+		fd[c] = perf_open(events[c], c ? fd[COUNTER_CYCLES] : -1);
+		if (fd[c] >= 0)
+			slot[c] = count++;
+		else if (!c)
+			return false;
+	}
+	ioctl(fd[COUNTER_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+	block = new counter_block;
+	memset(block, 0, sizeof(counter_block));
+	std::lock_guard<std::mutex> guard(blocks_lock);
+	blocks.push_back(block);
+	return true;
+}
+
+counter_thread::~counter_thread()
+{
+	if (!block)
+		return;
+	for (unsigned int c=0; c < MAX_COUNTERS; c++)
+		if (fd[c] >= 0)
+			close(fd[c]);
+}
+
+// the counters in the order of the enum, then the time enabled and running
+static bool read_counters(uint64_t *out)
+{
+	uint64_t buf[3 + MAX_COUNTERS];
+
+	if (!local.opened)
+		local.open();
+	if (!local.block)
+		return false;
+
+	if (read(local.fd[COUNTER_CYCLES], buf, sizeof(uint64_t) * (3 + local.count)) <= 0)
+		return false;
+	for (unsigned int c=0; c < MAX_COUNTERS; c++)
+		out[c] = local.fd[c] >= 0 ? buf[3 + local.slot[c]] : 0;
+	out[MAX_COUNTERS] = buf[1];
+	out[MAX_COUNTERS + 1] = buf[2];
+	return true;
+}
+
+void CStageCounter::next(int stage)
+{
+	uint64_t now[MAX_COUNTERS + 2];
+
+	if (!read_counters(now))
+	{
+		m_stage = -1;
+		return;
+	}
+
+	if (m_stage >= 0)
+	{
+		counter_block *b = local.block;
+		b->calls[m_stage]++;
+		for (unsigned int c=0; c < MAX_COUNTERS; c++)
+			b->values[m_stage][c] += now[c] - m_start[c];
+		b->enabled[m_stage] += now[MAX_COUNTERS] - m_start[MAX_COUNTERS];
+		b->running[m_stage] += now[MAX_COUNTERS + 1] - m_start[MAX_COUNTERS + 1];
+	}
+	memcpy(m_start, now, sizeof(m_start));
+	m_stage = stage;
+}
+
+bool counters_enable()
+{
+	if (!local.opened && !local.open())
+	{
+		printf("Hardware counters are not available (%s), not counting\n", strerror(errno));
+		return false;
+	}
+	if (!local.block)
+		return false;
+
+	for (unsigned int c=0; c < MAX_COUNTERS; c++)
+		if (local.fd[c] < 0)
+			printf("No %s counter on this machine\n", counter_names[c]);
+	counters_enabled = true;
+	return true;
+}
+
+void counters_snapshot(counter_totals *out, bool reset)
+{
+	memset(out, 0, sizeof(counter_totals));
+
+	std::lock_guard<std::mutex> guard(blocks_lock);
+	for (unsigned int i=0; i < blocks.size(); i++)
+	{
+		counter_block *b = blocks[i];
+		for (unsigned int s=0; s < MAX_STAGES; s++)
+		{
+			double scale = b->running[s] ? (double)b->enabled[s] / b->running[s] : 0;
+			out->calls[s] += b->calls[s];
+			for (unsigned int c=0; c < MAX_COUNTERS; c++)
+				out->values[s][c] += b->values[s][c] * scale;
+		}
+		if (reset)
+			memset(b, 0, sizeof(counter_block));
+	}
+}
+
+void counters_print(FILE *f, const char *title, const counter_totals &totals)
+{
+	double cycles = 0;
+	for (unsigned int s=0; s < MAX_STAGES; s++)
+		cycles += totals.values[s][COUNTER_CYCLES];
+
+	fprintf(f, "%s: hardware counters per call\n", title);
+	fprintf(f, "%-12s %10s %12s %12s %6s %12s %12s %8s\n", "stage", "calls", "cycles", "instructions", "IPC",
+		"cache miss", "branch miss", "cycles");
+	for (unsigned int s=0; s < MAX_STAGES; s++)
+	{
+		const double *v = totals.values[s];
+		double n = totals.calls[s] ? (double)totals.calls[s] : 1;
+		fprintf(f, "%-12s %10lu %12.0f %12.0f %6.2f %12.1f %12.1f %7.1f%%\n", stage_names[s], totals.calls[s],
+			v[COUNTER_CYCLES] / n, v[COUNTER_INSTRUCTIONS] / n,
+			v[COUNTER_CYCLES] ? v[COUNTER_INSTRUCTIONS] / v[COUNTER_CYCLES] : 0,
+			v[COUNTER_CACHE_MISSES] / n, v[COUNTER_BRANCH_MISSES] / n,
+			cycles ? v[COUNTER_CYCLES] * 100 / cycles : 0);
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef _COUNTERS__H
+#define _COUNTERS__H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// the stages of one update of the ensemble filters (BIP::estimate_state)
+enum
+{
+	STAGE_PROPAGATE,	// propagate_ensemble
+	STAGE_HX,			// hx: the predicted readings of every member
+	STAGE_HA,			// get_ha_matrix: their deviations from the mean
+	STAGE_GAIN,			// innovation covariance and its inverse (EnKF) or eigen decomposition (ETKF), and the gain
+	STAGE_UPDATE,		// applying the correction to the ensemble
+	STAGE_MEAN,			// get_weighted_mean
+	MAX_STAGES
+};
+
+// the hardware events counted in each stage
+enum
+{
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_CACHE_MISSES,		// last level cache
+	COUNTER_BRANCH_MISSES,
+	MAX_COUNTERS
+};
+
+/*
+	Hardware performance counters (perf_event_open) per stage of the ensemble filters, to tell whether an update
+	is bound by memory, by branches or by the overhead of the BLAS calls. Every thread that counts opens its
+	own group of counters the first time (user space only, so perf_event_paranoid up to 2 is fine), and they
+	are read once at each boundary between stages. A read is a system call, so this is a profile rather than
+	something to leave on: the latency histograms (metrics.h) include its cost.
+
+	The counters are off unless counters_enable is called, and then cost one test of a flag per stage. When
+	the kernel has more events than the PMU has counters, it takes turns, and the counts are scaled up by the
+	fraction of the time they were running.
+*/
+struct counter_totals
+{
+	uint64_t calls[MAX_STAGES];
+	double values[MAX_STAGES][MAX_COUNTERS];
+};
+
+extern bool counters_enabled;
+
+bool counters_enable(); // false (and stays off) if the counters can't be opened
+void counters_snapshot(counter_totals *out, bool reset); // summed over the threads; reset only when none is counting
+void counters_print(FILE *f, const char *title, const counter_totals &totals);
+
+// counts a sequence of stages: each start ends the stage before it, and the last one ends with the object
+class CStageCounter
+{
+public:
+	CStageCounter() : m_stage(-1) {}
+	~CStageCounter() { if (m_stage >= 0) stop(); }
+	void start(unsigned int stage) { if (counters_enabled) next(stage); }
+	void stop() { if (counters_enabled) next(-1); }
+
+private:
+	void next(int stage);
+
+	int m_stage;
+	uint64_t m_start[MAX_COUNTERS + 2]; // the counters, then the time enabled and the time running
+};
+
+#endif // _COUNTERS__H
@@ -0,0 +1,63 @@
+#include "estimator.h"
+#include "bip.h"
+#include "particle.h"
+#include "nearest.h"
+
+static const char *filter_names[MAX_FILTERS] =
+{
+	"enkf",
+	"etkf",
+	"particle",
+	"nearest",
+};
+
+const char* filter_name(unsigned int filter)
+{
+	if (filter >= MAX_FILTERS)
+		return "unknown";
+	return filter_names[filter];
+}
+
+bool CEstimator::skip_correction(double distance)
+{
+	m_gate_stats.updates++;
+	if (m_gate_threshold > 0 && distance < m_gate_threshold)
+	{
+		if (m_stale < m_gate_max_stale)
+		{
+			m_stale++;
+			m_gate_stats.skipped++;
+			return true;
+		}
+		m_gate_stats.forced++;
+	}
+	m_stale = 0;
+	return false;
+}
+
+// the correction couldn't be computed: as far as the statistics go, it was skipped
+void CEstimator::correction_failed()
+{
+	m_gate_stats.updates++;
+	m_gate_stats.skipped++;
+	m_stale++;
+}
+
+CEstimator* CreateEstimator(unsigned int filter, CDemoLibrary *library, unsigned int members, unsigned int latent_rank)
+{
+	switch (filter)
+	{
+	case FILTER_ENKF:
+	case FILTER_ETKF:
+	{
+		BIP *bip = new BIP(library, members, latent_rank);
+		bip->set_filter(filter);
+		return bip;
+	}
+	case FILTER_PARTICLE:
+		return new CParticleFilter(library, members);
+	case FILTER_NEAREST:
+		return new CNearestDemonstration(library);
+	}
+	return NULL;
+}
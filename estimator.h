@@ -0,0 +1,79 @@
+#ifndef _ESTIMATOR__H
+#define _ESTIMATOR__H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "library.h"
+
+// the available state estimators (selected with --filter)
+enum
+{
+	FILTER_ENKF,		// stochastic EnKF: every member is corrected towards its own perturbed copy of the observation
+	FILTER_ETKF,		// deterministic square-root filter (ensemble transform): no perturbed observations
+	FILTER_PARTICLE,	// particle filter over the demonstrations, with systematic resampling
+	FILTER_NEAREST,	// follows the single demonstration that has been closest to the observations so far
+	MAX_FILTERS
+};
+
+const char* filter_name(unsigned int filter);
+
+#define GATE_THRESHOLD		0	// innovation (Mahalanobis distance) below which the correction is skipped; 0: never
+#define GATE_MAX_STALE		10	// most updates in a row without a correction
+
+// how often the innovation gate skipped the correction (see CEstimator::set_gate)
+struct gate_stats
+{
+	uint64_t updates;		// calls to estimate_state
+	uint64_t skipped;		// corrections skipped because the innovation was small
+	uint64_t forced;		// corrections made only because the estimate had gone stale
+};
+
+/*
+	What the simulation needs from a state estimator: given the sample number (time since the start of the
+	trial, in sensor periods) and the current sensor readings, estimate the current state (NUM_STATE_VARIABLES).
+	All estimators work from the demonstrations in a shared library.
+
+	Random numbers are drawn from streams keyed by the trial and the number of updates since the start of the
+	trial (see random.h), so set_trial must be called before create_initial_ensemble.
+
+	The ensemble filters can skip the correction step while the observations agree with the prediction: every
+	update still propagates the ensemble and predicts the observations, but the ensemble is only corrected when
+	the Mahalanobis distance of the innovation reaches the gate threshold, or after max_stale updates without a
+	correction. The other estimators always use the observations, and ignore the gate.
+*/
+class CEstimator
+{
+public:
+	CEstimator() : m_verbose(true), m_trial(0), m_tick(0), m_gate_threshold(GATE_THRESHOLD),
+		m_gate_max_stale(GATE_MAX_STALE), m_stale(0), m_gate_stats() {}
+	virtual ~CEstimator() {}
+
+	virtual void create_initial_ensemble() = 0;	// start of a trial
+	virtual bool retrieve_members(const double * /* features */) { return false; } // see knn.h
+	virtual void estimate_state(double sample, double *sensors, double *predictedState) = 0;
+	virtual size_t memory_usage() = 0;	// bytes of per-trial state and scratch space (the library is not counted)
+
+	void set_verbose(bool verbose) { m_verbose = verbose; } // print the intermediate results of every update
+	void set_trial(uint64_t trial) { m_trial = trial; m_tick = 0; m_stale = 0; }
+	void set_gate(double threshold, unsigned int max_stale) { m_gate_threshold = threshold; m_gate_max_stale = max_stale; }
+	const gate_stats& gate_statistics() const { return m_gate_stats; } // since the estimator was created
+
+protected:
+	bool skip_correction(double distance); // counts the update, and decides whether to skip its correction
+	void correction_failed(); // counts the update, as skipped
+
+	bool m_verbose;
+	uint64_t m_trial;
+	uint64_t m_tick;	// updates (estimate_state) so far in this trial
+	double m_gate_threshold;
+	unsigned int m_gate_max_stale;
+	unsigned int m_stale;	// updates since the last correction
+	gate_stats m_gate_stats;
+};
+
+// 'members' is the size of the ensemble (or the number of particles); the nearest demonstration has none.
+// With a latent rank, the ensemble filters work in the latent space of the library (see latent.h).
+CEstimator* CreateEstimator(unsigned int filter, CDemoLibrary *library, unsigned int members = NUM_ENSEMBLE_MEMBERS,
+	unsigned int latent_rank = 0);
+
+#endif // _ESTIMATOR__H
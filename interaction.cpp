@@ -1,123 +1,331 @@
 #include "interaction.h"
+#include "tracecodec.h"
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <climits>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <charconv>
+#include <algorithm>
 
-#define LINE_LENGTH 1023
+#define TRACE_FIELDS		7			// timestamp, then x,y of the player, the robot and the ball
+#define READ_BLOCK		(1 << 16)	// traces that can't be mapped (e.g. pipes) are read in blocks this big
+#define ERROR_CONTEXT	60				// how much of a malformed line is printed
+#define BASIS_SMOOTHING	1e-4			// weight of the penalty on neighbouring basis weights, per sample
 
-CInteraction::CInteraction(double scale) : m_scale(scale), m_length(0)
+CInteraction::CInteraction(double scale) : m_scale(scale), m_length(0), m_samples(NULL)
 {
+	Fit();
+}
+
+CInteraction::CInteraction(double scale, const measurement *samples, unsigned long length) :
+		m_scale(scale), m_length(length), m_samples(samples)
+{
+	Fit();
 }
 
 CInteraction::~CInteraction()
 {
 }
 
-bool CInteraction::Load(FILE *f)
+// the estimators only evaluate the fitted weights: the samples can go once nothing else reads them
+void CInteraction::DropSamples()
 {
-	char line[LINE_LENGTH+1];
-	bool comment = false;
-	int idx=0;
-	char *ptr = NULL;
-	unsigned long timestamp, prev_timestamp;
-	unsigned long x, y, prev_x, prev_y;
-	measurement *meas;
+	std::vector<measurement>().swap(m_storage);
+	m_samples = NULL;
+}
 
-	rewind(f);
-	int c = fgetc(f);
-	prev_x = 0;
-	prev_y = 0;
-	memset(line, 0, LINE_LENGTH+1);
+// skips blanks around a field
+static const char* skip_blanks(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	return p;
+}
+
+/*
+	Parses the text of a whole trace. There is one sample per line at most, so one pass of memchr (which is
+	vectorized) reserves the storage, and the fields are converted by from_chars and appended as they are
+	read: the samples are never moved or reallocated. Lines starting with '#' and empty lines are skipped;
+	any other line must be TRACE_FIELDS integers separated by commas, or the trace is rejected.
+*/
+bool CInteraction::Parse(const char *text, size_t size)
+{
+	const char *end = text + size;
+	unsigned long lines = 0;
+	unsigned long line_number = 0;
+
+	for (const char *p = text; p < end && (p = (const char*)memchr(p, '\n', end - p)) != NULL; p++)
+		lines++;
+	m_storage.reserve(lines + 1); // the last line may not end with a newline
 
-	while (c != EOF)
+	const char *line = text;
+	while (line < end)
 	{
-		if (c == '\n')
+		const char *nl = (const char*)memchr(line, '\n', end - line);
+		const char *stop = nl ? nl : end;
+		const char *next = nl ? nl + 1 : end;
+		line_number++;
+
+		// traces written on Windows
+		if (stop > line && stop[-1] == '\r')
+			stop--;
+		if (stop == line || *line == '#')
 		{
-			line[idx++] = 0;
-			
-			if (!comment)
+			line = next;
+			continue;
+		}
+
+		uint64_t timestamp = 0;
+		long long value[TRACE_FIELDS];
+		const char *p = line;
+		const char *error = NULL;
+		unsigned int field;
+		for (field=0; field < TRACE_FIELDS && !error; field++)
+		{
+			p = skip_blanks(p, stop);
+			std::from_chars_result r = field ? std::from_chars(p, stop, value[field]) : std::from_chars(p, stop, timestamp);
+			if (r.ec == std::errc::result_out_of_range)
+				error = "is out of range";
+			else if (r.ec != std::errc())
+				error = (p == stop) ? "is missing" : "is not a number";
+			else
 			{
-				meas = new measurement;
-				memset(meas, 0, sizeof(measurement));
-
-				// process previous line
-				ptr = line;
-				timestamp = strtol(ptr, &ptr, 10);
-				meas->timestamp = timestamp;
-				ptr++;
-				if (ptr)
-				{
-					x = strtol(ptr, &ptr, 10);
-					meas->player.x = x;
-					ptr++;
-				}
-				if (ptr)
-				{
-					y = strtol(ptr, &ptr, 10);
-					meas->player.y = y;
-					ptr++;
-				}
-				if (ptr)
-				{
-					x = strtol(ptr, &ptr, 10);
-					meas->robot.x = x;
-					ptr++;
-				}
-				if (ptr)
-				{
-					y = strtol(ptr, &ptr, 10);
-					meas->robot.y = y;
-					ptr++;
-				}
-				if (ptr)
+				p = skip_blanks(r.ptr, stop);
+				if (field < TRACE_FIELDS - 1)
 				{
-					x = strtol(ptr, &ptr, 10);
-					meas->ball.x = x;
-					ptr++;
+					// at the end of the line, the next field is reported as missing
+					if (p < stop && *p == ',')
+						p++;
+					else if (p < stop)
+						error = "is not followed by a comma";
 				}
-				if (ptr)
-				{
-					y = strtol(ptr, &ptr, 10);
-					meas->ball.y = y;
-					ptr++;
-				}
-
-				//printf("Adding meas: timestamp=%lu p.x=%f p.y=%f r.x=%f r.y=%f b.x=%f b.y=%f\n",
-				//	meas->timestamp, meas->player.x, meas->player.y, meas->robot.x, meas->robot.y, meas->ball.x, meas->ball.y);
-				m_measurements.push_back(meas);
+				else if (p != stop)
+					error = "is followed by more text";
 			}
-			idx = 0;
-			comment = false;
 		}
-		else if (c == '#')
+
+		if (error)
 		{
-			comment = true;
+			int shown = std::min<long>(stop - line, ERROR_CONTEXT);
+			printf("Trace line %lu: field %u %s (expected %u comma separated integers): '%.*s%s'\n", line_number,
+				field, error, TRACE_FIELDS, shown, line, shown < stop - line ? "..." : "");
+			m_storage.clear();
+			m_samples = NULL;
+			m_length = 0;
+			return false;
 		}
 
-		if (!comment)
+		// written once, into memory that is already reserved
+		measurement meas;
+		meas.timestamp = timestamp;
+		meas.player.x = value[1];
+		meas.player.y = value[2];
+		meas.robot.x = value[3];
+		meas.robot.y = value[4];
+		meas.ball.x = value[5];
+		meas.ball.y = value[6];
+		m_storage.push_back(meas);
+		line = next;
+	}
+
+	m_samples = m_storage.data();
+	m_length = m_storage.size(); // number of samples
+	return true;
+}
+
+bool CInteraction::Load(FILE *f)
+{
+	struct stat st;
+	int fd = fileno(f);
+
+	m_storage.clear();
+	m_samples = NULL;
+	m_length = 0;
+
+	// the whole file is parsed in place, whatever has been read from the stream already
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping != MAP_FAILED)
 		{
-			if (idx == LINE_LENGTH)
-			{
-				printf("line too long!\n");
-				continue;
-			}
-			line[idx++] = c;
+			madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+			bool ok = Decode((const char*)mapping, st.st_size);
+			munmap(mapping, st.st_size);
+			return ok;
 		}
-		c = fgetc(f);
 	}
 
-	// interactions always start at 0, even if the first measurement isn't exactly at 0
-	//m_length = timestamp/1000000; // in milliseconds
-	m_length = m_measurements.size(); // number of samples
+	// not a regular file (or it couldn't be mapped): read all of it first
+	std::vector<char> text;
+	size_t n;
+	rewind(f);
+	do
+	{
+		size_t used = text.size();
+		text.resize(used + READ_BLOCK);
+		n = fread(&text[used], 1, READ_BLOCK, f);
+		text.resize(used + n);
+	} while (n > 0);
 
-	return true;
+	return Decode(text.data(), text.size());
+}
+
+// either format: packed traces start with their magic, anything else is text
+bool CInteraction::Decode(const char *data, size_t size)
+{
+	bool ok;
+
+	if (!trace_is_packed(data, size))
+		ok = Parse(data, size);
+	else if (!trace_unpack(data, size, m_storage))
+	{
+		printf("Packed trace is truncated or corrupt\n");
+		ok = false;
+	}
+	else
+	{
+		m_samples = m_storage.data();
+		m_length = m_storage.size();
+		ok = true;
+	}
+
+	Fit();
+	return ok;
+}
+
+void CInteraction::set_samples(const measurement *samples, unsigned long length)
+{
+	m_storage.assign(samples, samples + length);
+	m_samples = m_storage.data();
+	m_length = m_storage.size();
+	Fit();
+}
+
+// the simulator's text format (see CMySimulation::Initialize), or the packed one
+bool CInteraction::Save(FILE *f, bool packed)
+{
+	if (packed)
+	{
+		std::vector<uint8_t> data;
+		if (!trace_pack(m_samples, m_length, data))
+			return false;
+		return fwrite(data.data(), 1, data.size(), f) == data.size();
+	}
+
+	fprintf(f, "# version %u\n", VERSION);
+	fprintf(f, "# timestamp,player,robot,ball\n");
+	for (unsigned long i=0; i < m_length; i++)
+	{
+		const measurement &m = m_samples[i];
+		fprintf(f, "%010lu,%lld,%lld,%lld,%lld,%lld,%lld\n", m.timestamp, (long long)m.player.x, (long long)m.player.y,
+			(long long)m.robot.x, (long long)m.robot.y, (long long)m.ball.x, (long long)m.ball.y);
+	}
+	return !ferror(f);
+}
+
+/*
+	The basis functions are cubic B-splines: bell shaped like gaussians, but zero beyond two knots from their
+	centre, and they sum to 1 at every phase without being normalized. Their centres are evenly spaced, with the
+	first and the last one just outside the phase range, so BASIS_SUPPORT of them cover any phase. Stores those
+	in 'phi' and returns the index of the first one; no exp(), and no search.
+*/
+unsigned int CInteraction::basis_functions(double phase, double phi[BASIS_SUPPORT])
+{
+	const unsigned int segments = NUM_BASIS_FUNCTIONS - BASIS_SUPPORT + 1;
+	double x = phase * segments;
+	unsigned int first = (x < segments) ? (unsigned int)x : segments - 1;
+	double u = x - first;
+	double u2 = u * u;
+	double u3 = u2 * u;
+
+	phi[0] = (1 - u) * (1 - u) * (1 - u) / 6;
+	phi[1] = (3 * u3 - 6 * u2 + 4) / 6;
+	phi[2] = (-3 * u3 + 3 * u2 + 3 * u + 1) / 6;
+	phi[3] = u3 / 6;
+	return first;
+}
+
+/*
+	Fits the basis space weights of every state variable to the samples, by least squares: sample i stands for
+	the phases from i/length to (i+1)/length (see get_sample), and is fitted at the middle of them. A small
+	penalty on the difference between neighbouring weights keeps the system well posed when the trace has
+	fewer samples than there are basis functions, and pulls the weights of a basis function that no sample
+	reaches towards its neighbours rather than towards zero.
+*/
+void CInteraction::Fit()
+{
+	const unsigned int B = NUM_BASIS_FUNCTIONS;
+	double A[B][B];
+	double phi[BASIS_SUPPORT];
+
+	memset(A, 0, sizeof(A));
+	memset(m_basis_weights, 0, sizeof(m_basis_weights));
+	if (!m_length)
+		return;
+
+	for (unsigned long i=0; i < m_length; i++)
+	{
+		const measurement &m = m_samples[i];
+		unsigned int first = basis_functions((i + 0.5) / m_length, phi);
+		for (unsigned int j=0; j < BASIS_SUPPORT; j++)
+		{
+			for (unsigned int k=j; k < BASIS_SUPPORT; k++)
+				A[first + j][first + k] += phi[j] * phi[k];
+			m_basis_weights[STATE_VAR_BALL_X][first + j] += phi[j] * m.ball.x;
+			m_basis_weights[STATE_VAR_BALL_Y][first + j] += phi[j] * m.ball.y;
+			m_basis_weights[STATE_VAR_ROBOT_X][first + j] += phi[j] * m.robot.x;
+		}
+	}
+
+	double smoothing = BASIS_SMOOTHING * m_length;
+	for (unsigned int k=0; k + 1 < B; k++)
+	{
+		A[k][k] += smoothing;
+		A[k + 1][k + 1] += smoothing;
+		A[k][k + 1] -= smoothing;
+	}
+
+	// Cholesky factorization A = L L^T, in the lower triangle (the upper one holds A)
+	for (unsigned int j=0; j < B; j++)
+	{
+		double d = A[j][j];
+		for (unsigned int k=0; k < j; k++)
+			d -= A[j][k] * A[j][k];
+		A[j][j] = sqrt(d);
+		for (unsigned int i=j+1; i < B; i++)
+		{
+			double v = A[j][i];
+			for (unsigned int k=0; k < j; k++)
+				v -= A[i][k] * A[j][k];
+			A[i][j] = v / A[j][j];
+		}
+	}
+
+	// the right hand sides are replaced by the weights
+	for (unsigned int v=0; v < NUM_STATE_VARIABLES; v++)
+	{
+		double *w = m_basis_weights[v];
+		for (unsigned int i=0; i < B; i++)
+		{
+			for (unsigned int k=0; k < i; k++)
+				w[i] -= A[i][k] * w[k];
+			w[i] /= A[i][i];
+		}
+		for (int i=B-1; i >= 0; i--)
+		{
+			for (unsigned int k=i+1; k < B; k++)
+				w[i] -= A[k][i] * w[k];
+			w[i] /= A[i][i];
+		}
+	}
 }
 
 void CInteraction::get_sample(double phase, double sample[])
 {
-	//uint64_t elapsed_time_ns = phase * m_length * 1000000;
-	//printf("Elapsed time: %lu out of %lu\n", elapsed_time_ns, m_length);
-	uint64_t sample_index;
+	double phi[BASIS_SUPPORT];
 
 	if (phase < 0)
 	{
@@ -129,25 +337,12 @@ void CInteraction::get_sample(double phase, double sample[])
 		printf("%s: phase too large\n", __func__);
 		phase = 1;
 	}
-	
-	sample_index = phase * m_length;
 
-	// look up data at that timestamp - linear search for now, can be improved
-	measurement *current_sample = NULL;
-	for (measurement_list::iterator i=m_measurements.begin(); i != m_measurements.end(); i++)
+	// an empty trace has no weights, and gives zeros
+	unsigned int first = basis_functions(phase, phi);
+	for (unsigned int v=0; v < NUM_STATE_VARIABLES; v++)
 	{
-		current_sample = *i;
-		//printf("Looking at timestamp %lu\n", current_sample->timestamp);
-		//if (current_sample->timestamp >= elapsed_time_ns)
-		//	break; 
-		if (!sample_index--)
-			break;
+		const double *w = &m_basis_weights[v][first];
+		sample[v] = w[0] * phi[0] + w[1] * phi[1] + w[2] * phi[2] + w[3] * phi[3];
 	}
-
-	//sample[STATE_VAR_PHASE] = phase;//(double)current_sample->timestamp / (double)m_length / (double)1000000;
-	//sample[STATE_VAR_PHASE_VEL] = 0.01;
-	sample[STATE_VAR_BALL_X] = current_sample->ball.x;
-	sample[STATE_VAR_BALL_Y] = current_sample->ball.y;
-	sample[STATE_VAR_ROBOT_X] = current_sample->robot.x;
 }
-
@@ -3,10 +3,14 @@
 
 #include <stdio.h>
 #include <list>
+#include <vector>
 #include "simulation.h"
 
-#define NUM_ENSEMBLE_MEMBERS		100
-#define MAX_LATENT_FUNCTIONS		1
+#define NUM_ENSEMBLE_MEMBERS		100 // default size of the ensemble (see scenario.h)
+#define MAX_LATENT_FUNCTIONS		16 // most principal components of the latent model (see latent.h)
+#define LATENT_RANK					0	// default components the ensemble filters track (0: none, see scenario.h)
+#define NUM_BASIS_FUNCTIONS		16 // basis space weights per state variable (see CInteraction::Fit)
+#define BASIS_SUPPORT				4	// basis functions that are nonzero at any phase
 
 enum
 {
@@ -17,21 +21,36 @@ enum
 };
 
 
-typedef std::list<measurement*> measurement_list;
-
 class CInteraction
 {
 public:
 	CInteraction(double scale);
+	CInteraction(double scale, const measurement *samples, unsigned long length); // borrows the samples (e.g. from a mapped snapshot)
 	~CInteraction();
-	bool Load(FILE *f);
-	void get_sample(double phase, double sample[]);
-	unsigned long length() { return m_length; } // in milliseconds
+	bool Load(FILE *f); // text or packed (see tracecodec.h); false (and no samples) if any line is malformed
+	bool Save(FILE *f, bool packed); // false if the trace can't be packed, or on write errors
+	void set_samples(const measurement *samples, unsigned long length); // copies them
+	void get_sample(double phase, double sample[]); // evaluates the basis space weights
+	unsigned long length() { return m_length; } // in samples
+	const measurement* samples() { return m_samples; } // NULL once they are dropped
+	void DropSamples(); // keeps the fitted weights and the length only
+	const double* basis_weights() const { return m_basis_weights[0]; } // NUM_STATE_VARIABLES x NUM_BASIS_FUNCTIONS
+
+	// the BASIS_SUPPORT basis functions that are nonzero at 'phase' (0..1); returns the index of the first one
+	static unsigned int basis_functions(double phase, double phi[BASIS_SUPPORT]);
 
 private:
+	bool Decode(const char *data, size_t size);
+	bool Parse(const char *text, size_t size);
+	void Fit();
+
 	double m_scale;
 	unsigned long m_length;
-	measurement_list m_measurements;
+	const measurement *m_samples; // m_length contiguous samples, either m_storage or borrowed memory
+	std::vector<measurement> m_storage;
+	double m_basis_weights[NUM_STATE_VARIABLES][NUM_BASIS_FUNCTIONS];
 };
 
+typedef std::list<CInteraction*> interaction_list;
+
 #endif // _INTERACTION__H
@@ -0,0 +1,124 @@
+#include <math.h>
+#include <algorithm>
+#include "knn.h"
+
+bool launch_features(const measurement *samples, unsigned long count, double *features)
+{
+	unsigned long launch;
+
+	if (count < 2)
+		return false;
+
+	// the ball sits still in the player's hand until it is thrown
+	for (launch = 1; launch < count; launch++)
+	{
+		if (samples[launch].ball.x != samples[0].ball.x || samples[launch].ball.y != samples[0].ball.y)
+			break;
+	}
+
+	// measure from the last reading before the launch
+	launch--;
+	if (launch + FEATURE_WINDOW >= count)
+		return false;
+
+	const point &start = samples[launch].ball;
+	const point &end = samples[launch + FEATURE_WINDOW].ball;
+	features[FEATURE_VEL_X] = (end.x - start.x) / FEATURE_WINDOW;
+	features[FEATURE_VEL_Y] = (end.y - start.y) / FEATURE_WINDOW;
+	// y grows downwards on the screen
+	features[FEATURE_ANGLE] = atan2(-features[FEATURE_VEL_Y], features[FEATURE_VEL_X]);
+	return true;
+}
+
+void CSimilarityIndex::Build(interaction_list &interactions)
+{
+	double features[NUM_FEATURES];
+	double sum[NUM_FEATURES] = {0};
+	double sum_sq[NUM_FEATURES] = {0};
+
+	m_interactions.clear();
+	for (unsigned int f=0; f < NUM_FEATURES; f++)
+		m_features[f].clear();
+
+	for (interaction_list::iterator i = interactions.begin(); i != interactions.end(); i++)
+	{
+		if (!launch_features((*i)->samples(), (*i)->length(), features))
+			continue;
+
+		m_interactions.push_back(*i);
+		for (unsigned int f=0; f < NUM_FEATURES; f++)
+		{
+			m_features[f].push_back(features[f]);
+			sum[f] += features[f];
+			sum_sq[f] += features[f] * features[f];
+		}
+	}
+
+	// store the features pre-scaled, so a query only has to scale itself
+	unsigned int n = m_interactions.size();
+	for (unsigned int f=0; f < NUM_FEATURES; f++)
+	{
+		double mean = n ? sum[f] / n : 0;
+		double var = n ? sum_sq[f] / n - mean * mean : 0;
+		m_scale[f] = (var > 1e-12) ? 1.0 / sqrt(var) : 1.0;
+		for (unsigned int i=0; i < n; i++)
+			m_features[f][i] *= m_scale[f];
+	}
+
+	m_distance.resize(n);
+	m_order.resize(n);
+}
+
+void CSimilarityIndex::Add(CInteraction *interaction)
+{
+	double features[NUM_FEATURES];
+
+	if (!launch_features(interaction->samples(), interaction->length(), features))
+		return;
+
+	m_interactions.push_back(interaction);
+	for (unsigned int f=0; f < NUM_FEATURES; f++)
+		m_features[f].push_back(features[f] * m_scale[f]);
+
+	m_distance.resize(m_interactions.size());
+	m_order.resize(m_interactions.size());
+}
+
+// Writes the (up to) k demonstrations closest to 'features' into 'out', nearest first. Returns how many.
+unsigned int CSimilarityIndex::Query(const double *features, unsigned int k, CInteraction **out)
+{
+	unsigned int n = m_interactions.size();
+	float *distance = m_distance.data();
+
+	if (k > n)
+		k = n;
+	if (!k)
+		return 0;
+
+	for (unsigned int i=0; i < n; i++)
+		distance[i] = 0;
+
+	for (unsigned int f=0; f < NUM_FEATURES; f++)
+	{
+		const float q = features[f] * m_scale[f];
+		const float *column = m_features[f].data();
+		for (unsigned int i=0; i < n; i++)
+		{
+			float d = column[i] - q;
+			distance[i] += d * d;
+		}
+	}
+
+	for (unsigned int i=0; i < n; i++)
+		m_order[i] = i;
+
+	std::nth_element(m_order.begin(), m_order.begin() + (k - 1), m_order.end(),
+		[distance](unsigned int a, unsigned int b) { return distance[a] < distance[b]; });
+	std::sort(m_order.begin(), m_order.begin() + k,
+		[distance](unsigned int a, unsigned int b) { return distance[a] < distance[b]; });
+
+	for (unsigned int i=0; i < k; i++)
+		out[i] = m_interactions[m_order[i]];
+
+	return k;
+}
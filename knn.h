@@ -0,0 +1,45 @@
+#ifndef _KNN__H
+#define _KNN__H
+
+#include <vector>
+#include "interaction.h"
+
+#define FEATURE_WINDOW		3		// number of samples after the launch used to estimate the launch velocity
+
+// compact description of the start of a throw
+enum
+{
+	FEATURE_VEL_X,		// pixels per sample
+	FEATURE_VEL_Y,
+	FEATURE_ANGLE,		// launch angle (radians above the horizon)
+	NUM_FEATURES
+};
+
+// Find the moment the ball starts moving in a sequence of readings, and describe the throw from the
+// FEATURE_WINDOW readings that follow. Returns false if the ball hasn't flown long enough yet.
+bool launch_features(const measurement *samples, unsigned long count, double *features);
+
+/*
+	Nearest-neighbour index over the launch features of the demonstrations. The features are stored as one
+	contiguous float array per feature, and a query is a brute-force scan over those arrays (which the
+	compiler vectorizes) followed by a partial selection of the k smallest distances. Each feature is scaled
+	by its standard deviation over the library so they all count the same in the distance.
+*/
+class CSimilarityIndex
+{
+public:
+	CSimilarityIndex() { for (unsigned int f=0; f < NUM_FEATURES; f++) m_scale[f] = 1; }
+	void Build(interaction_list &interactions);
+	void Add(CInteraction *interaction); // scaled like the others: only Build recomputes the scales
+	unsigned int Query(const double *features, unsigned int k, CInteraction **out);
+	unsigned int size() { return m_interactions.size(); }
+
+private:
+	std::vector<CInteraction*> m_interactions; // only the demonstrations that have launch features
+	std::vector<float> m_features[NUM_FEATURES];
+	double m_scale[NUM_FEATURES]; // 1/stddev
+	std::vector<float> m_distance; // scratch space for queries
+	std::vector<unsigned int> m_order;
+};
+
+#endif // _KNN__H
@@ -0,0 +1,101 @@
+#include <string.h>
+#include <lapacke.h>
+#include <algorithm>
+#include "latent.h"
+
+bool CLatentModel::Build(interaction_list &interactions, unsigned int rank)
+{
+	const unsigned int P = LATENT_WEIGHTS;
+	const unsigned int N = interactions.size();
+	const unsigned int K = std::min(N, P); // singular values
+
+	m_rank = 0;
+	m_explained = 0;
+	if (N < 2 || !rank)
+		return false;
+
+	// N x P, one demonstration per row, centred on the mean weights
+	std::vector<double> X(N * P);
+	unsigned int row = 0;
+	memset(m_mean, 0, sizeof(m_mean));
+	for (interaction_list::iterator i = interactions.begin(); i != interactions.end(); i++, row++)
+	{
+		memcpy(&X[row * P], (*i)->basis_weights(), sizeof(double) * P);
+		for (unsigned int p=0; p < P; p++)
+			m_mean[p] += X[row * P + p];
+	}
+	for (unsigned int p=0; p < P; p++)
+		m_mean[p] /= N;
+	for (unsigned int n=0; n < N; n++)
+		for (unsigned int p=0; p < P; p++)
+			X[n * P + p] -= m_mean[p];
+
+	// only V' is needed: its rows are the principal components, by decreasing singular value
+	std::vector<double> s(K);
+	std::vector<double> Vt(K * P);
+	std::vector<double> superb(K);
+	if (LAPACKE_dgesvd(LAPACK_ROW_MAJOR, 'N', 'S', N, P, X.data(), P, s.data(), NULL, 1, Vt.data(), P,
+		superb.data()) != 0)
+	{
+		printf("Latent model: SVD failed\n");
+		return false;
+	}
+
+	// components that explain nothing (all the demonstrations alike) are dropped
+	double total = 0;
+	for (unsigned int k=0; k < K; k++)
+		total += s[k] * s[k];
+	rank = std::min(rank, K);
+	while (rank > 1 && s[rank - 1] <= s[0] * 1e-9)
+		rank--;
+
+	m_components.assign(P * rank, 0);
+	for (unsigned int k=0; k < rank; k++)
+	{
+		for (unsigned int p=0; p < P; p++)
+			m_components[p * rank + k] = Vt[k * P + p];
+		m_explained += total > 0 ? s[k] * s[k] / total : 1.0 / rank;
+	}
+	m_rank = rank;
+
+	printf("Latent model: %u of %u components keep %.1f%% of the variance of %u demonstrations\n", m_rank, P,
+		m_explained * 100, N);
+	return true;
+}
+
+void CLatentModel::project(const CInteraction *interaction, double *coefficients) const
+{
+	const double *w = interaction->basis_weights();
+
+	for (unsigned int k=0; k < m_rank; k++)
+		coefficients[k] = 0;
+	for (unsigned int p=0; p < LATENT_WEIGHTS; p++)
+	{
+		const double *c = &m_components[p * m_rank];
+		double d = w[p] - m_mean[p];
+		for (unsigned int k=0; k < m_rank; k++)
+			coefficients[k] += c[k] * d;
+	}
+}
+
+// like CInteraction::get_sample, but only the weights of the basis functions in use are reconstructed
+void CLatentModel::get_sample(const double *coefficients, double phase, double sample[]) const
+{
+	double phi[BASIS_SUPPORT];
+	unsigned int first = CInteraction::basis_functions(std::min(std::max(phase, 0.0), 1.0), phi);
+
+	for (unsigned int v=0; v < NUM_STATE_VARIABLES; v++)
+	{
+		double value = 0;
+		for (unsigned int j=0; j < BASIS_SUPPORT; j++)
+		{
+			unsigned int p = v * NUM_BASIS_FUNCTIONS + first + j;
+			const double *c = &m_components[p * m_rank];
+			double w = m_mean[p];
+			for (unsigned int k=0; k < m_rank; k++)
+				w += c[k] * coefficients[k];
+			value += w * phi[j];
+		}
+		sample[v] = value;
+	}
+}
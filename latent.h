@@ -0,0 +1,35 @@
+#ifndef _LATENT__H
+#define _LATENT__H
+
+#include <vector>
+#include "interaction.h"
+
+#define LATENT_WEIGHTS		(NUM_STATE_VARIABLES * NUM_BASIS_FUNCTIONS) // basis space weights of a demonstration
+
+/*
+	Low rank model of the demonstrations: the principal components of their basis space weights (see
+	CInteraction::Fit), from the SVD of the centred weights of the whole library. A trajectory is then the mean
+	weights plus a combination of 'rank' components, and the ensemble filters can track those few coefficients
+	instead of following the demonstrations themselves (see BIP). Evaluating a trajectory at a phase costs
+	BASIS_SUPPORT x rank multiply-adds per state variable, whatever the size of the library.
+*/
+class CLatentModel
+{
+public:
+	CLatentModel() : m_rank(0), m_explained(0) {}
+	bool Build(interaction_list &interactions, unsigned int rank); // false if there are too few demonstrations
+	void Clear() { m_rank = 0; }
+	unsigned int rank() const { return m_rank; }
+	double explained() const { return m_explained; } // fraction of the variance of the library kept
+
+	void project(const CInteraction *interaction, double *coefficients) const; // rank coefficients
+	void get_sample(const double *coefficients, double phase, double sample[]) const;
+
+private:
+	unsigned int m_rank;
+	double m_explained;
+	double m_mean[LATENT_WEIGHTS];
+	std::vector<double> m_components; // LATENT_WEIGHTS x rank: the components of each weight are contiguous
+};
+
+#endif // _LATENT__H
@@ -0,0 +1,304 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include "budget.h"
+#include "library.h"
+
+CDemoLibrary *CDemoLibrary::s_cached = NULL;
+
+void CPhaseStats::add(unsigned long length)
+{
+	double rate = 1.0 / length;
+
+	m_count++;
+	m_length_mean += (length - m_length_mean) / m_count;
+	double delta = rate - m_rate_mean;
+	m_rate_mean += delta / m_count;
+	m_rate_m2 += delta * (rate - m_rate_mean);
+}
+
+// mean((1/length - mean())^2), from the spread of 1/length around its own mean
+double CPhaseStats::variance() const
+{
+	if (!m_count)
+		return 0;
+	double offset = m_rate_mean - mean();
+	return m_rate_m2 / m_count + offset * offset;
+}
+
+CDemoLibrary::CDemoLibrary(const char *path, double scale, unsigned int size, unsigned int selection) :
+		m_refs(1), m_owner(NULL), m_path(strdup(path)), m_scale(scale), m_requested(size), m_selection(selection),
+		m_phase_velocity_mean(0), m_phase_velocity_var(0), m_mean_trajectory(NULL), m_mean_trajectory_samples(0),
+		m_initial_ensemble(NULL), m_initial_ensemble_count(0), m_latent_rank(0), m_samples_dropped(false), m_mapping(NULL), m_mapping_size(0)
+{
+}
+
+CDemoLibrary::~CDemoLibrary()
+{
+	if (m_owner)
+		m_owner->Release();
+	else
+	{
+		for (interaction_list::iterator i = m_interactions.begin(); i != m_interactions.end(); i++)
+			delete *i;
+	}
+
+	// the interactions may point into the mapping, so it has to outlive them
+	if (m_mapping)
+		munmap(m_mapping, m_mapping_size);
+
+	free(m_initial_ensemble);
+	free(m_mean_trajectory);
+	free(m_path);
+}
+
+// Returns the shared library for 'path' with a reference held for the caller. The traces are only read
+// the first time, or when a different directory is requested. If a valid snapshot is given, the traces
+// are not read at all.
+CDemoLibrary* CDemoLibrary::Acquire(const char *path, double scale, unsigned int size, unsigned int selection,
+	const char *snapshot)
+{
+	if (s_cached && (strcmp(s_cached->m_path, path) != 0 || s_cached->m_scale != scale ||
+		s_cached->m_requested != size || s_cached->m_selection != selection))
+		Flush();
+
+	if (!s_cached)
+	{
+		s_cached = new CDemoLibrary(path, scale, size, selection);
+		if (!snapshot || s_cached->LoadSnapshot(snapshot) < 0)
+			s_cached->Load();
+		s_cached->m_similarity.Build(s_cached->m_interactions);
+		for (interaction_list::iterator i = s_cached->m_interactions.begin(); i != s_cached->m_interactions.end(); i++)
+			s_cached->m_lengths.add((*i)->length());
+		printf("Similarity index over %u of %u demonstrations\n", s_cached->m_similarity.size(), s_cached->size());
+	}
+
+	s_cached->AddRef();
+	return s_cached;
+}
+
+void CDemoLibrary::Flush()
+{
+	if (s_cached)
+	{
+		s_cached->Release();
+		s_cached = NULL;
+	}
+}
+
+/*
+	A library of every demonstration in this one except 'excluded', with a reference held for the caller.
+	The demonstrations are not copied: they still belong to this library, which is kept alive until the new
+	one is released. Model data (phase statistics etc.) is not carried over, since it depends on the set.
+*/
+CDemoLibrary* CDemoLibrary::Without(CInteraction *excluded)
+{
+	CDemoLibrary *library = new CDemoLibrary(m_path, m_scale, m_requested, m_selection);
+
+	AddRef();
+	library->m_owner = this;
+	for (interaction_list::iterator i = m_interactions.begin(); i != m_interactions.end(); i++)
+		if (*i != excluded)
+		{
+			library->m_interactions.push_back(*i);
+			library->m_lengths.add((*i)->length());
+		}
+	library->m_similarity.Build(library->m_interactions);
+
+	return library;
+}
+
+/*
+	Free the raw samples, which only the similarity index (built by now) and SaveSnapshot read: the estimators
+	evaluate the fitted weights, so a demonstration is down to those (and its length). Demonstrations mapped
+	from a snapshot only lose the pointer. A leave-one-out library doesn't own its demonstrations, so it
+	leaves them alone.
+*/
+void CDemoLibrary::DropSamples()
+{
+	if (m_owner || m_samples_dropped)
+		return;
+
+	for (interaction_list::iterator i = m_interactions.begin(); i != m_interactions.end(); i++)
+		(*i)->DropSamples();
+	m_samples_dropped = true;
+}
+
+/*
+	Append a demonstration to the live library. The model data, once there is any, is extended to cover it:
+	the phase statistics from the running ones, and each sample of the mean trajectory as a running mean over
+	the demonstrations that have the ball at that phase (sampled as in BIP::get_mean_trajectory). Neither needs
+	the other demonstrations. A library made by Without doesn't own its demonstrations, so it can't take more.
+*/
+void CDemoLibrary::Add(CInteraction *interaction)
+{
+	double sample[NUM_STATE_VARIABLES];
+
+	if (m_owner)
+	{
+		printf("ERROR: can't add demonstrations to a leave-one-out library\n");
+		delete interaction;
+		return;
+	}
+
+	m_interactions.push_back(interaction);
+	m_similarity.Add(interaction);
+	if (m_samples_dropped)
+		interaction->DropSamples();
+	m_lengths.add(interaction->length());
+	m_latent.Clear();
+	m_latent_rank = 0;
+	if (!has_model())
+		return;
+
+	set_phase_stats(m_lengths.mean(), m_lengths.variance());
+
+	const unsigned int n = m_mean_trajectory_samples;
+	for (unsigned int s=0; s < n; s++)
+	{
+		interaction->get_sample((double)s / n, sample);
+		if (!sample[STATE_VAR_BALL_X] || !sample[STATE_VAR_BALL_Y])
+			continue;
+
+		// a sample no demonstration had the ball at yet is not a number
+		unsigned int count = ++m_mean_trajectory_count[s];
+		for (unsigned int d=0; d < NUM_STATE_VARIABLES; d++)
+		{
+			double &mean = m_mean_trajectory[s + n * d];
+			mean = (count == 1) ? sample[d] : mean + (sample[d] - mean) / count;
+		}
+	}
+}
+
+void CDemoLibrary::Release()
+{
+	if (--m_refs == 0)
+		delete this;
+}
+
+/*
+	Choose the demonstration behind each of 'count' ensemble members (or particles). The library can hold any
+	number of demonstrations: when it holds exactly 'count' they are all used in order, a larger library gives
+	a fresh random subset every call (without replacement), and a smaller one is sampled with replacement.
+*/
+void CDemoLibrary::DrawMembers(CInteraction **members, unsigned int count, CRandom &random)
+{
+	std::vector<CInteraction*> pool(m_interactions.begin(), m_interactions.end());
+	unsigned int size = pool.size();
+
+	for (unsigned int i=0; i < count; i++)
+	{
+		if (size == count)
+			members[i] = pool[i];
+		else if (size > count)
+		{
+			// partial Fisher-Yates
+			unsigned int j = i + random.below(size - i);
+			std::swap(pool[i], pool[j]);
+			members[i] = pool[i];
+		}
+		else
+			members[i] = pool[random.below(size)];
+	}
+}
+
+// 'demonstrations' is how many were averaged (at every sample), which weighs the mean against the ones added later
+void CDemoLibrary::set_mean_trajectory(const double *trajectory, unsigned int num_samples, unsigned int demonstrations)
+{
+	free(m_mean_trajectory);
+	m_mean_trajectory = (double*)malloc(sizeof(double) * NUM_STATE_VARIABLES * num_samples);
+	memcpy(m_mean_trajectory, trajectory, sizeof(double) * NUM_STATE_VARIABLES * num_samples);
+	m_mean_trajectory_samples = num_samples;
+	m_mean_trajectory_count.assign(num_samples, demonstrations);
+}
+
+// not thread safe either: the estimators are created before the threads that share a library start
+const CLatentModel* CDemoLibrary::latent(unsigned int rank)
+{
+	if (rank != m_latent_rank)
+	{
+		m_latent.Build(m_interactions, rank);
+		m_latent_rank = rank;
+	}
+	return m_latent.rank() ? &m_latent : NULL;
+}
+
+void CDemoLibrary::set_initial_ensemble(const double *ensemble, unsigned int count)
+{
+	free(m_initial_ensemble);
+	m_initial_ensemble = (double*)malloc(sizeof(double) * count);
+	memcpy(m_initial_ensemble, ensemble, sizeof(double) * count);
+	m_initial_ensemble_count = count;
+}
+
+// NULL if the trace can't be read
+static CInteraction *load_trace(const char *path, const char *name, double scale)
+{
+	char *tmpname;
+	FILE *log;
+
+	if (asprintf(&tmpname, "%s/%s", path, name) < 0)
+		return NULL;
+
+	log = fopen(tmpname, "r");
+	if (!log)
+	{
+		printf("Error opening trace file %s\n", tmpname);
+		free(tmpname);
+		return NULL;
+	}
+
+	CInteraction *interaction = new CInteraction(scale);
+	if (!interaction->Load(log))
+	{
+		printf("Skipping malformed trace file %s\n", tmpname);
+		delete interaction;
+		interaction = NULL;
+	}
+	fclose(log);
+	free(tmpname);
+	return interaction;
+}
+
+/*
+	Index the directory, then load only the traces drawn from the index. The traces are read by as many threads
+	as the thread budget allows (see budget.h), each taking the next one in turn, and are added in the order they
+	were drawn in, whichever thread read them.
+*/
+int CDemoLibrary::Load()
+{
+	std::vector<const trace_summary*> selected;
+
+	printf("Loading from %s\n", m_path);
+	if (m_index.Build(m_path, INDEX_MAX_ENTRIES) < 0)
+		return -1;
+
+	m_index.Draw(m_requested, m_selection, selected);
+	std::vector<CInteraction*> loaded(selected.size(), NULL);
+	std::atomic<unsigned int> next(0);
+	auto loader = [&]()
+	{
+		for (unsigned int i; (i = next++) < selected.size(); )
+			loaded[i] = load_trace(m_path, selected[i]->name, m_scale);
+	};
+
+	unsigned int threads = std::max<size_t>(1, std::min<size_t>(budget_threads(BUDGET_LOADERS), selected.size()));
+	std::vector<std::thread> pool;
+	for (unsigned int t=1; t < threads; t++)
+		pool.push_back(std::thread(loader));
+	loader();
+	for (unsigned int t=0; t < pool.size(); t++)
+		pool[t].join();
+
+	for (unsigned int i=0; i < loaded.size(); i++)
+		if (loaded[i])
+			m_interactions.push_back(loaded[i]);
+
+	printf("Loaded %u demonstrations (%s selection, %u threads)\n", size(),
+		m_selection == SELECT_STRATIFIED ? "stratified" : "uniform", threads);
+	return 0;
+}
@@ -0,0 +1,114 @@
+#ifndef _LIBRARY__H
+#define _LIBRARY__H
+
+#include <atomic>
+#include <vector>
+#include "interaction.h"
+#include "traceindex.h"
+#include "knn.h"
+#include "latent.h"
+#include "random.h"
+
+/*
+	Running statistics of the demonstration lengths, for the phase velocity (phase per sample) of the model:
+	the mean is 1 / the mean length, and the variance is that of 1/length around it. Welford's update keeps
+	them exact and stable, at O(1) per demonstration.
+*/
+class CPhaseStats
+{
+public:
+	CPhaseStats() : m_count(0), m_length_mean(0), m_rate_mean(0), m_rate_m2(0) {}
+	void add(unsigned long length);
+	uint64_t count() const { return m_count; }
+	double mean() const { return m_count ? 1.0 / m_length_mean : 0; }
+	double variance() const;
+
+private:
+	uint64_t m_count;
+	double m_length_mean;
+	double m_rate_mean;		// of 1/length
+	double m_rate_m2;		// sum of the squared differences of 1/length from m_rate_mean
+};
+
+/*
+	The set of demonstrations loaded from the trace directory, plus the model data derived from them
+	(phase statistics and the mean trajectory). Only a subset of the directory is loaded: 'size' traces
+	drawn from a summary index of the directory (see traceindex.h). Loading is expensive, so the library is loaded once per
+	process and shared between trials. It is reference counted: the process-wide cache holds one reference
+	and every user (each BIP instance) holds another. The interactions are freed with the last reference.
+	References may be taken and released from several threads.
+
+	Demonstrations can be added while the library is in use (Add), for instance every trial that catches the
+	ball. The phase statistics, the similarity index and the mean trajectory are updated in place, without
+	going over the other demonstrations again; the latent model is rebuilt by the next estimator that uses it.
+	Adding is not thread safe: the simulator does it between trials.
+*/
+class CDemoLibrary
+{
+public:
+	static CDemoLibrary* Acquire(const char *path, double scale, unsigned int size, unsigned int selection,
+		const char *snapshot = NULL);
+	static void Flush(); // drop the cached library (call at exit)
+	CDemoLibrary* Without(CInteraction *excluded); // for leave-one-out evaluation (not cached)
+	void Add(CInteraction *interaction); // the library takes ownership
+	void DropSamples(); // once the similarity index and the snapshot are done with them (see CInteraction)
+
+	void AddRef() { m_refs++; }
+	void Release();
+
+	const char* path() { return m_path; }
+	interaction_list& interactions() { return m_interactions; }
+	unsigned int size() { return m_interactions.size(); }
+	const CPhaseStats& lengths() { return m_lengths; } // kept up to date as demonstrations are added
+	CTraceIndex& index() { return m_index; } // empty if the library came from a snapshot
+	CSimilarityIndex& similarity() { return m_similarity; } // launch features of the loaded demonstrations
+	void DrawMembers(CInteraction **members, unsigned int count, CRandom &random);
+
+	// model data, computed by the first trial that uses this library (or read from a snapshot)
+	bool has_model() { return m_mean_trajectory != NULL; }
+	bool from_snapshot() { return m_mapping != NULL; }
+	void set_phase_stats(double mean, double var) { m_phase_velocity_mean = mean; m_phase_velocity_var = var; }
+	void get_phase_stats(double *mean, double *var) { *mean = m_phase_velocity_mean; *var = m_phase_velocity_var; }
+	void set_mean_trajectory(const double *trajectory, unsigned int num_samples, unsigned int demonstrations);
+	double* mean_trajectory() { return m_mean_trajectory; }
+	unsigned int mean_trajectory_samples() { return m_mean_trajectory_samples; }
+	void set_initial_ensemble(const double *ensemble, unsigned int count);
+	const double* initial_ensemble(unsigned int count) { return count == m_initial_ensemble_count ? m_initial_ensemble : NULL; }
+	const CLatentModel* latent(unsigned int rank); // built for the first estimator that asks; NULL if it can't be
+
+	// see snapshot.h
+	bool SaveSnapshot(const char *filename);
+
+private:
+	CDemoLibrary(const char *path, double scale, unsigned int size, unsigned int selection);
+	~CDemoLibrary();
+	int Load();
+	int LoadSnapshot(const char *filename);
+
+	static CDemoLibrary *s_cached;
+
+	std::atomic<unsigned int> m_refs;
+	CDemoLibrary *m_owner; // the library the demonstrations belong to, if it's not this one
+	char *m_path;
+	double m_scale;
+	unsigned int m_requested; // how many traces to load
+	unsigned int m_selection; // how to pick them (SELECT_xxx)
+	CTraceIndex m_index;
+	CSimilarityIndex m_similarity;
+	interaction_list m_interactions;
+	CPhaseStats m_lengths; // of all of m_interactions
+	double m_phase_velocity_mean;
+	double m_phase_velocity_var;
+	double *m_mean_trajectory; // D x num_samples
+	unsigned int m_mean_trajectory_samples;
+	std::vector<unsigned int> m_mean_trajectory_count; // demonstrations averaged into each sample
+	double *m_initial_ensemble; // B x E
+	unsigned int m_initial_ensemble_count; // B x E (the ensemble size is a run time setting)
+	CLatentModel m_latent;
+	unsigned int m_latent_rank; // the rank m_latent was built for (0: not built)
+	bool m_samples_dropped; // only the fitted weights are left, also of the demonstrations added later
+	void *m_mapping; // snapshot the demonstrations point into (if any)
+	size_t m_mapping_size;
+};
+
+#endif // _LIBRARY__H
@@ -5,9 +5,22 @@
 #include <getopt.h>
 #include <dirent.h>
 #include <list>
+#include <vector>
+#include <thread>
 
 #include "simulation.h"
 #include "mysim.h"
+#include "metrics.h"
+#include "library.h"
+#include "traceindex.h"
+#include "estimator.h"
+#include "random.h"
+#include "scenario.h"
+#include "sweep.h"
+#include "budget.h"
+#include "counters.h"
+#include "timeline.h"
+#include "recorder.h"
 
 using namespace std;
 
@@ -21,20 +34,64 @@ using namespace std;
 
 #define TARGET_FRAMERATE 30
 
+// without a window there is no screen to size the scene by
+#define HEADLESS_WIDTH 1920
+#define HEADLESS_HEIGHT 1080
+
+// a ball that misses the ground falls forever, so a headless trial is given up after this long
+#define HEADLESS_TRIAL_LIMIT SECONDS_TO_NS(60)
+
+// the recording settings have no letter of their own
+enum
+{
+	OPTION_RECORD_FORMAT = 256,
+	OPTION_RECORD_SIZE,
+	OPTION_RECORD_FPS,
+	OPTION_RECORD_TRIALS,
+	OPTION_BRANCH_AT,
+};
+
 #ifndef VERSION
 #error You must define the program version in the 'VERSION' symbol. Try using -DVERSION=<x>
 #endif
 
 static struct option options[] =
 {
+	{"balls", required_argument, 0, 'b'},
+	{"branch", required_argument, 0, 'B'},
+	{"branch-at", required_argument, 0, OPTION_BRANCH_AT},
+	{"scenario", required_argument, 0, 'c'},
+	{"counters", no_argument, 0, 'C'},
+	{"seed", required_argument, 0, 'e'},
+	{"filter", required_argument, 0, 'f'},
 	{"help", no_argument, 0, 'h'},
+	{"headless", required_argument, 0, 'H'},
+	{"metrics", required_argument, 0, 'm'},
+	{"library-size", required_argument, 0, 'n'},
+	{"jobs", required_argument, 0, 'j'},
+	{"nearest", no_argument, 0, 'k'},
+	{"learn", no_argument, 0, 'l'},
+	{"results", required_argument, 0, 'o'},
 	{"tracepath", required_argument, 0, 'p'},
+	{"pin", no_argument, 0, 'P'},
 	{"rate", required_argument, 0, 'r'},
+	{"record", required_argument, 0, 'V'},
+	{"record-format", required_argument, 0, OPTION_RECORD_FORMAT},
+	{"record-size", required_argument, 0, OPTION_RECORD_SIZE},
+	{"record-fps", required_argument, 0, OPTION_RECORD_FPS},
+	{"record-trials", required_argument, 0, OPTION_RECORD_TRIALS},
+	{"random", required_argument, 0, 'R'},
+	{"snapshot", required_argument, 0, 's'},
+	{"stratified", no_argument, 0, 'S'},
 	{"training", no_argument, 0, 't'},
+	{"timeline", required_argument, 0, 'T'},
+	{"sweep", required_argument, 0, 'w'},
 	{0, no_argument, 0, 0}
 };
 
 program_state state;
+static unsigned int sweep_jobs; // configurations run at once
+static CRecorder *recorder; // with -V
 
 static void DispatchInput(CSimulation *sim)
 {
@@ -51,105 +108,74 @@ static void usage(void)
 	printf("2020 Joel Nider <joel@ece.ubc.ca>\n");
 	printf("usage:\n");
 	printf("sim [options]\n\n");
+	printf("b <int>: Number of balls thrown in each trial (default 1)\n");
+	printf("B <string>: Branch every trial at a checkpoint, and finish it once for each configuration of this design\n");
+	printf("   (as with -w, but only robot_velocity, sensor_frequency, catch_tolerance and the gate can vary).\n");
+	printf("   --branch-at <int>: ms after the throw to take the checkpoint (default 0)\n");
+	printf("c <string>: Scenario settings, as name=value[,name=value...] (default: ");
+	scenario().print(stdout);
+	printf(")\n");
+	printf("C: Count cycles, instructions, cache and branch misses in each stage of the ensemble filters\n");
+	printf("e <int>: Seed for all random numbers, to repeat a session exactly (default: the current time)\n");
+	printf("f <string>: State estimator: 'enkf' (stochastic ensemble filter, default), 'etkf' (deterministic square root),\n");
+	printf("   'particle' or 'nearest' (follow the closest demonstration)\n");
 	printf("h: Help - this screen\n");
+	printf("H <int>: Run this many trials without a window, as fast as possible, then quit\n");
+	printf("j <int>: With -w or -B, number of configurations to run at once (default: one per core)\n");
+	printf("k: Rebuild the ensemble from the demonstrations nearest to the observed throw, once it is launched\n");
+	printf("l: Learn: add every trial that catches the ball (with one ball) to the demonstrations, as it goes\n");
+	printf("m <string>: Periodically write latency metrics to this file (press 'm' to show them on-screen)\n");
+	printf("n <int>: Number of demonstrations to draw from the trace directory (default %u)\n", NUM_ENSEMBLE_MEMBERS);
+	printf("o <string>: With -w or -B, write the results table to this file (default: the standard output)\n");
 	printf("p <string>: Path to directory containing log files\n");
+	printf("P: Pin each sweep worker to its share of the cores\n");
 	printf("r <int>: 'realtime' mode, causes the simulation to progress independently from the wall clock. Update time is in ns.\n");
+	printf("R <int>: With -w, draw this many random configurations from the ranges instead of running the whole grid\n");
+	printf("s <string>: Start from this model snapshot, or create it if it is missing or out of date\n");
+	printf("S: Draw the demonstrations stratified by trace length instead of uniformly\n");
+	printf("V <string>: Record the trials to this directory, with or without the window:\n");
+	printf("   --record-format bmp|y4m (default y4m), --record-size <w>x<h> (default %ux%u),\n", RECORD_DEFAULT_WIDTH,
+		RECORD_DEFAULT_HEIGHT);
+	printf("   --record-fps <int> (default %u) and --record-trials all|misses|catches (default misses)\n",
+		RECORD_DEFAULT_FPS);
 	printf("t: Run simulator in training mode (user controls robot with the keyboard)\n");
+	printf("T <string>: Write a timeline of the simulation loop to this file at exit (Chrome trace JSON, for Perfetto)\n");
+	printf("w <string>: Sweep over scenario settings, as name=value, name=v1/v2/... or name=lo:hi:count, separated by\n");
+	printf("   commas. Every configuration runs the trials given with -H, and the catch rate and cost are tabulated.\n");
 }
 
-int main(int argc, char* argv[])
+// one step of a headless trial. False once the trial is over.
+static bool headless_step(CMySimulation &sim)
 {
-	SDL_Window* window = NULL;
-	SDL_Renderer* renderer = NULL;
-	SDL_Surface* surface = NULL;
-	SDL_DisplayMode mode;
-	double frame_delay = 0.003;
-	state.realtime = true;
-	state.update_rate = 80;
-	state.ui_visible = true;
-	state.trace_filename = NULL;
-	state.tracepath = NULL;
-	state.training = false;
-
-	int c;
-	while (1)
-	{
-		c = getopt_long (argc, argv, "hp:r:t", options, 0);
-		if (c == -1)
-		break;
-
-		switch (c)
-		{
-		case 'h':
-			usage();
-			return 0;
-		case 'p':
-			state.tracepath = strdup(optarg);
-			break;
-		case 'r':
-			state.realtime = false;
-			state.update_rate = atoll(optarg);
-			break;
-		case 't':
-			state.training = true;
-			break;
-		}
-	}
-
-	// initialize random number generator
-	srand(time(NULL));
-
-	// try to open the trace directory
-	DIR *d = opendir(state.tracepath);
-	if (!d)
-	{
-		printf("Can't open trace directory '%s'\n", state.tracepath);
-		return -2;
-	}
-	closedir(d);
-
-	//Initialize SDL
-	if( SDL_Init( SDL_INIT_VIDEO ) < 0 )
+	if (state.sim_running != SIM_STATE_RUNNING || state.total_time > HEADLESS_TRIAL_LIMIT)
 	{
-		printf( "SDL could not initialize! SDL_Error: %s\n", SDL_GetError() );
-		return -1;
+		state.sim_running = SIM_STATE_STOPPED;
+		return false;
 	}
 
-	if(TTF_Init()==-1)
-	{
-		printf("TTF_Init: %s\n", TTF_GetError());
-		exit(2);
-	}
-
-	// check current display mode on display 0
-	SDL_GetCurrentDisplayMode(0, &mode);
-
-	//Create window
-	window = SDL_CreateWindow("515 Simulator", SDL_WINDOWPOS_CENTERED,
-		SDL_WINDOWPOS_CENTERED, mode.w, mode.h, SDL_WINDOW_FULLSCREEN);
-	if(!window)
-	{
-		printf( "Window could not be created! SDL_Error: %s\n", SDL_GetError() );
-		return -2;
-	}
-
-	int w, h;
-	SDL_GetWindowSize(window, &w, &h);
-	printf("Your resolution is %ix%i\n", w, h);
-
-	//Get window surface
-	surface = SDL_GetWindowSurface(window);
-	renderer = SDL_CreateSoftwareRenderer(surface);
+	uint64_t elapsed = sim.NextEventTime(state.total_time);
+	state.total_time += elapsed;
+	CMetricTimer timer(METRIC_UPDATE_SIMULATION);
+	CTimelineSpan span("UpdateSimulation");
+	sim.UpdateSimulation(state.total_time, elapsed);
+	if (recorder)
+		recorder->Update(&sim, state.total_time);
+	return true;
+}
 
+// runs trials until the user quits (or max_trials are done)
+static void run_trials(SDL_Window *window, SDL_Renderer *renderer, int w, int h)
+{
+	double frame_delay = 0.003;
 	struct timespec prev, now, start, fr_start;
 	unsigned int frame_count;
-
-	// default to local directory to find trace files
-	if (!state.tracepath)
-		state.tracepath = strdup(".");
+	uint64_t last_frame_ns = 0;
+	uint64_t metrics_written_ns = metrics_now_ns();
 
 	while (!state.quit)
 	{
+		CTimelineSpan trial("trial");
+		uint64_t caught_before = state.catches;
 		frame_count = 0;
 		state.sim_running = SIM_STATE_RUNNING;
 		state.fps_target = 30;
@@ -158,19 +184,36 @@ int main(int argc, char* argv[])
 
 		// Initialize the objects to be simulated
 		CMySimulation sim1;
-		if (!sim1.Initialize(&state, w, h))
-			state.sim_running = SIM_STATE_STOPPED;
+		{
+			CTimelineSpan span("Initialize");
+			if (!sim1.Initialize(&state, w, h))
+				state.sim_running = SIM_STATE_STOPPED;
+		}
+		if (recorder)
+			recorder->BeginTrial(state.trials);
 
 		clock_gettime(CLOCK_MONOTONIC, &start);
 		fr_start = start;
 		now = start;
 		while (state.sim_running != SIM_STATE_STOPPED)
 		{
+			// without a window, there is nothing to wait for: jump straight to the next time anything can
+			// happen (a sensor reading, an event or a contact), as every object moves in closed form in between
+			if (!state.ui_visible)
+			{
+				if (!headless_step(sim1))
+					break;
+				continue;
+			}
+
 			prev = now;
 			clock_gettime(CLOCK_MONOTONIC, &now);
 
 			// check for input
-			DispatchInput(&sim1);
+			{
+				CTimelineSpan span("DispatchInput");
+				DispatchInput(&sim1);
+			}
 
 			// update the simulation
 			if (state.sim_running == SIM_STATE_RUNNING)
@@ -181,7 +224,11 @@ int main(int argc, char* argv[])
 				else
 					elapsed = TIME_ELAPSED_NS(prev, now);
 				state.total_time += elapsed;
+				CMetricTimer timer(METRIC_UPDATE_SIMULATION);
+				CTimelineSpan span("UpdateSimulation");
 				sim1.UpdateSimulation(state.total_time, elapsed);
+				if (recorder)
+					recorder->Update(&sim1, state.total_time);
 			}
 
 			// update the UI
@@ -189,8 +236,20 @@ int main(int argc, char* argv[])
 			{
 				frame_count++;
 
-				sim1.Draw(renderer);
-				SDL_UpdateWindowSurface(window);
+				{
+					CMetricTimer timer(METRIC_DRAW);
+					{
+						CTimelineSpan span("Draw");
+						sim1.Draw(renderer);
+					}
+					CTimelineSpan span("SDL_UpdateWindowSurface");
+					SDL_UpdateWindowSurface(window);
+				}
+
+				uint64_t frame_ns = metrics_now_ns();
+				if (last_frame_ns)
+					metrics_record(METRIC_FRAME, frame_ns - last_frame_ns);
+				last_frame_ns = frame_ns;
 
 				clock_gettime(CLOCK_MONOTONIC, &start);
 			}
@@ -208,17 +267,577 @@ int main(int argc, char* argv[])
 
 				//printf("[%lu]: ", state.total_time);
 			}
+
+			// publish the latency metrics
+			if (state.metrics_filename && metrics_now_ns() - metrics_written_ns > METRICS_WRITE_INTERVAL)
+			{
+				metrics_write_file(state.metrics_filename);
+				metrics_written_ns = metrics_now_ns();
+			}
+		}
+
+		if (recorder)
+			recorder->EndTrial(state.catches - caught_before == state.num_balls);
+
+		if (state.max_trials && state.trials >= state.max_trials)
+			state.quit = true;
+	}
+}
+
+// one configuration of a sweep (in a worker process of its own)
+static bool run_configuration(const scenario &config, sweep_result *result)
+{
+	struct timespec start, end;
+
+	state.config = config;
+	state.trials = 0;
+	state.catches = 0;
+	state.estimates = 0;
+	state.learned = 0;
+	state.skipped = 0;
+	state.quit = false;
+	state.metrics_filename = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	run_trials(NULL, NULL, HEADLESS_WIDTH, HEADLESS_HEIGHT);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	CHistogram *snapshot = new CHistogram[MAX_METRICS];
+	metrics_snapshot(snapshot);
+	result->trials = state.trials;
+	result->balls = state.trials * state.num_balls;
+	result->catches = state.catches;
+	result->estimates = state.estimates;
+	result->skipped = state.skipped;
+	result->steps = snapshot[METRIC_UPDATE_SIMULATION].count();
+	result->step_us = snapshot[METRIC_UPDATE_SIMULATION].mean() / 1000;
+	result->estimate_us = snapshot[METRIC_ESTIMATE_STATE].mean() / 1000;
+	result->estimate_samples = snapshot[METRIC_ESTIMATE_STATE].count();
+	result->seconds = TIME_DIFFERENCE(start, end);
+	delete[] snapshot;
+
+	// a trial that couldn't even be set up (e.g. no demonstrations) stops the run at once
+	return result->steps > 0;
+}
+
+static int run_sweep(const char *design, unsigned int random, const char *results_filename)
+{
+	std::vector<scenario> configs;
+	if (!sweep_design(design, state.config, random, configs))
+		return -1;
+
+	FILE *table = stdout;
+	if (results_filename && !(table = fopen(results_filename, "w")))
+	{
+		printf("Can't write the results to %s\n", results_filename);
+		return -1;
+	}
+
+	// Setting up one trial loads the demonstrations and computes the model, so the workers inherit both
+	// instead of each doing it again
+	{
+		CTimelineSpan span("Initialize");
+		CMySimulation warmup;
+		if (!warmup.Initialize(&state, HEADLESS_WIDTH, HEADLESS_HEIGHT))
+			return -1;
+	}
+
+	// the workers share the cores, and inherit the OpenBLAS setting of the region
+	unsigned int jobs = budget_parallel(sweep_jobs);
+	printf("Sweeping %zu configurations, %lu trials each, %u at a time\n", configs.size(), state.max_trials, jobs);
+	unsigned int failed = sweep_run(configs, run_configuration, jobs, table);
+	budget_serial();
+	if (table != stdout)
+		fclose(table);
+
+	CDemoLibrary::Flush();
+	timeline_write();
+	budget_report(stdout);
+	return failed ? -1 : 0;
+}
+
+static CMySimulation *checkpoint; // the trial that the branches go on with (see run_branches)
+
+// one branch of the checkpointed trial (in a worker process of its own, so in a copy of it)
+static bool run_branch(const scenario &config, sweep_result *result)
+{
+	struct timespec start, end;
+	CHistogram *before = new CHistogram[MAX_METRICS];
+	CHistogram *after = new CHistogram[MAX_METRICS];
+	uint64_t catches = state.catches, estimates = state.estimates, skipped = state.skipped;
+
+	metrics_snapshot(before);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	state.config = config;
+	checkpoint->Reconfigure();
+	while (headless_step(*checkpoint))
+		;
+	// the estimates of the trial are only added up when it is deleted
+	delete checkpoint;
+	checkpoint = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	metrics_snapshot(after);
+
+	uint64_t steps = after[METRIC_UPDATE_SIMULATION].count() - before[METRIC_UPDATE_SIMULATION].count();
+	double step_ns = after[METRIC_UPDATE_SIMULATION].sum() - before[METRIC_UPDATE_SIMULATION].sum();
+	uint64_t updates = after[METRIC_ESTIMATE_STATE].count() - before[METRIC_ESTIMATE_STATE].count();
+	double update_ns = after[METRIC_ESTIMATE_STATE].sum() - before[METRIC_ESTIMATE_STATE].sum();
+	result->trials = 1;
+	result->balls = state.num_balls;
+	result->catches = state.catches - catches;
+	result->estimates = state.estimates - estimates;
+	result->skipped = state.skipped - skipped;
+	result->steps = steps;
+	result->step_us = steps ? step_ns / steps / 1000 : 0;
+	result->estimate_us = updates ? update_ns / updates / 1000 : 0;
+	result->estimate_samples = updates;
+	result->seconds = TIME_DIFFERENCE(start, end);
+	delete[] before;
+	delete[] after;
+	return true;
+}
+
+// the mean of a and b, weighted by how many of each there were
+static double weighted_mean(double a, uint64_t na, double b, uint64_t nb)
+{
+	return (na + nb) ? (a * na + b * nb) / (na + nb) : 0;
+}
+
+/*
+	Every trial runs up to the checkpoint (branch_at ms after the first throw) once, then forks: each worker
+	is a copy-on-write copy of the whole simulation at that moment (the objects, the events, the ensemble and
+	the random streams, which are keyed by trial and tick), and finishes the trial with one configuration of
+	the design. So the configurations are compared on the very same throw, and the steps before the checkpoint
+	are run once instead of once per configuration.
+
+	Only the settings a trial still reads once it has started (CMySimulation::Reconfigurable) can differ from
+	the scenario of the trunk.
+*/
+static int run_branches(const char *design, uint64_t branch_at, const char *results_filename)
+{
+	std::vector<scenario> configs;
+	if (!sweep_design(design, state.config, 0, configs))
+		return -1;
+
+	for (unsigned int c=0; c < configs.size(); c++)
+	{
+		for (unsigned int p=0; p < MAX_PARAMS; p++)
+		{
+			if (configs[c].get(p) != state.config.get(p) && !CMySimulation::Reconfigurable(p))
+			{
+				printf("%s is fixed by the time of the checkpoint: it can't be branched\n", param_name(p));
+				return -1;
+			}
+		}
+	}
+
+	FILE *table = stdout;
+	if (results_filename && !(table = fopen(results_filename, "w")))
+	{
+		printf("Can't write the results to %s\n", results_filename);
+		return -1;
+	}
+
+	std::vector<sweep_result> totals(configs.size());
+	std::vector<bool> ok(configs.size(), true);
+	std::vector<uint64_t> timed_steps(configs.size(), 0); // the shared steps count in totals, but aren't timed
+	uint64_t shared = 0, branched = 0;
+	unsigned int failed = 0;
+	memset(totals.data(), 0, totals.size() * sizeof(sweep_result));
+
+	printf("Branching %zu configurations from every trial, %lu ms after the throw, %u at a time\n", configs.size(),
+		branch_at, std::min(sweep_jobs, (unsigned int)configs.size()));
+	while (state.trials < state.max_trials)
+	{
+		CTimelineSpan span("trial");
+		uint64_t steps = 0;
+		state.sim_running = SIM_STATE_RUNNING;
+		state.total_time = 0;
+		state.trials++;
+
+		checkpoint = new CMySimulation();
+		{
+			CTimelineSpan span("Initialize");
+			if (!checkpoint->Initialize(&state, HEADLESS_WIDTH, HEADLESS_HEIGHT))
+			{
+				delete checkpoint;
+				if (table != stdout)
+					fclose(table);
+				return -1;
+			}
+		}
+		while (state.total_time < TIME_BEFORE_BALL + MS_TO_NS(branch_at) && headless_step(*checkpoint))
+			steps++;
+
+		std::vector<sweep_result> results;
+		std::vector<bool> done;
+		failed += sweep_fork(configs, run_branch, budget_parallel(sweep_jobs), results, done, false);
+		budget_serial();
+		delete checkpoint;
+		checkpoint = NULL;
+
+		// every branch ran the shared steps too, as far as the table is concerned
+		uint64_t caught = 0;
+		for (unsigned int c=0; c < configs.size(); c++)
+		{
+			sweep_result &t = totals[c];
+			const sweep_result &r = results[c];
+			ok[c] = ok[c] && done[c];
+			if (!done[c])
+				continue;
+
+			// the means are weighted by the samples they were timed over
+			t.step_us = weighted_mean(t.step_us, timed_steps[c], r.step_us, r.steps);
+			t.estimate_us = weighted_mean(t.estimate_us, t.estimate_samples, r.estimate_us, r.estimate_samples);
+			timed_steps[c] += r.steps;
+			t.estimate_samples += r.estimate_samples;
+			t.trials += r.trials;
+			t.balls += r.balls;
+			t.catches += r.catches;
+			t.estimates += r.estimates;
+			t.skipped += r.skipped;
+			t.steps += r.steps + steps;
+			t.seconds += r.seconds;
+			caught += r.catches;
+			branched += r.steps;
+		}
+		shared += steps;
+		printf("[%lu/%lu] %lu steps to the checkpoint: %lu balls caught in %zu branches\n", state.trials,
+			state.max_trials, steps, caught, configs.size());
+	}
+
+	sweep_table(configs, totals, ok, table);
+	if (table != stdout)
+		fclose(table);
+
+	// without the checkpoint, every branch would have run the shared steps itself
+	uint64_t straight = shared * configs.size() + branched;
+	printf("%lu steps before the checkpoints, run once for %zu branches: %lu steps instead of %lu (%.1f%% fewer)\n",
+		shared, configs.size(), shared + branched, straight,
+		straight ? (straight - shared - branched) * 100.0 / straight : 0);
+
+	CDemoLibrary::Flush();
+	timeline_write();
+	budget_report(stdout);
+	return failed ? -1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+	SDL_Window* window = NULL;
+	SDL_Renderer* renderer = NULL;
+	SDL_Surface* surface = NULL;
+	SDL_DisplayMode mode;
+	state.realtime = true;
+	state.update_rate = 80;
+	state.ui_visible = true;
+	state.trace_filename = NULL;
+	state.tracepath = NULL;
+	state.training = false;
+	state.metrics_filename = NULL;
+	state.snapshot_filename = NULL;
+	state.library_size = NUM_ENSEMBLE_MEMBERS;
+	state.selection = SELECT_UNIFORM;
+	state.retrieval = false;
+	state.learn = false;
+	state.num_balls = 1;
+	state.filter = FILTER_ENKF;
+	uint64_t seed = time(NULL);
+	char *sweep = NULL;
+	char *branch = NULL;
+	uint64_t branch_at = 0;
+	char *results_filename = NULL;
+	unsigned int sweep_random = 0;
+	bool pin = false;
+	bool counters = false;
+	char *timeline_filename = NULL;
+	char *record_path = NULL;
+	int record_format = RECORD_Y4M;
+	unsigned int record_width = RECORD_DEFAULT_WIDTH, record_height = RECORD_DEFAULT_HEIGHT;
+	unsigned int record_fps = RECORD_DEFAULT_FPS;
+	int record_trials = RECORD_MISSES;
+	sweep_jobs = std::max(1u, std::thread::hardware_concurrency());
+
+	int c;
+	while (1)
+	{
+		c = getopt_long (argc, argv, "b:B:c:Ce:f:hH:j:klm:n:o:p:Pr:R:s:StT:V:w:", options, 0);
+		if (c == -1)
+		break;
+
+		switch (c)
+		{
+		case 'b':
+			state.num_balls = atoi(optarg);
+			if (state.num_balls < 1)
+				state.num_balls = 1;
+			break;
+		case 'B':
+			branch = optarg;
+			break;
+		case OPTION_BRANCH_AT:
+			branch_at = atoi(optarg);
+			break;
+		case 'c':
+			if (!state.config.parse(optarg))
+			{
+				usage();
+				return -1;
+			}
+			break;
+		case 'e':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'f':
+			for (state.filter = 0; state.filter < MAX_FILTERS; state.filter++)
+				if (strcmp(optarg, filter_name(state.filter)) == 0)
+					break;
+			if (state.filter == MAX_FILTERS)
+			{
+				printf("Unknown filter '%s'\n", optarg);
+				usage();
+				return -1;
+			}
+			break;
+		case 'h':
+			usage();
+			return 0;
+		case 'H':
+			state.ui_visible = false;
+			state.max_trials = strtoull(optarg, NULL, 0);
+			break;
+		case 'j':
+			sweep_jobs = std::max(1, atoi(optarg));
+			break;
+		case 'k':
+			state.retrieval = true;
+			break;
+		case 'l':
+			state.learn = true;
+			break;
+		case 'm':
+			state.metrics_filename = strdup(optarg);
+			break;
+		case 'n':
+			state.library_size = atoi(optarg);
+			break;
+		case 'o':
+			results_filename = optarg;
+			break;
+		case 'p':
+			state.tracepath = strdup(optarg);
+			break;
+		case 'P':
+			pin = true;
+			break;
+		case 'C':
+			counters = true;
+			break;
+		case 'T':
+			timeline_filename = optarg;
+			break;
+		case 'V':
+			record_path = optarg;
+			break;
+		case OPTION_RECORD_FORMAT:
+			record_format = CRecorder::find_format(optarg);
+			if (record_format < 0)
+			{
+				printf("Unknown recording format '%s'\n", optarg);
+				return -1;
+			}
+			break;
+		case OPTION_RECORD_SIZE:
+			if (sscanf(optarg, "%ux%u", &record_width, &record_height) != 2)
+			{
+				printf("Bad recording size '%s' (expected <width>x<height>)\n", optarg);
+				return -1;
+			}
+			break;
+		case OPTION_RECORD_FPS:
+			record_fps = atoi(optarg);
+			break;
+		case OPTION_RECORD_TRIALS:
+			record_trials = CRecorder::find_selection(optarg);
+			if (record_trials < 0)
+			{
+				printf("Unknown selection of trials to record '%s'\n", optarg);
+				return -1;
+			}
+			break;
+		case 'r':
+			state.realtime = false;
+			state.update_rate = atoll(optarg);
+			break;
+		case 'R':
+			sweep_random = atoi(optarg);
+			break;
+		case 's':
+			state.snapshot_filename = strdup(optarg);
+			break;
+		case 'S':
+			state.selection = SELECT_STRATIFIED;
+			break;
+		case 't':
+			state.training = true;
+			break;
+		case 'w':
+			sweep = optarg;
+			break;
 		}
 	}
 
+	if (state.training && !state.ui_visible)
+	{
+		printf("Training needs the window, to control the robot\n");
+		return -1;
+	}
+	if (sweep && (state.ui_visible || !state.max_trials))
+	{
+		printf("A sweep runs headless: give the number of trials per configuration with -H\n");
+		return -1;
+	}
+	if (sweep && record_path)
+	{
+		printf("The trials of a sweep can't be recorded: the configurations would write over each other\n");
+		return -1;
+	}
+
+	if (branch && (state.ui_visible || !state.max_trials))
+	{
+		printf("Branching runs headless: give the number of trials to branch with -H\n");
+		return -1;
+	}
+	if (branch && (sweep || record_path || state.learn))
+	{
+		printf("The branches of a trial can't be swept, recorded or learned from: -B goes without -w, -V and -l\n");
+		return -1;
+	}
+
+	// initialize random number generator
+	random_seed(seed);
+	printf("Random seed: %lu\n", seed);
+	printf("Scenario: ");
+	state.config.print(stdout);
+	printf("\n");
+
+	// try to open the trace directory
+	DIR *d = opendir(state.tracepath);
+	if (!d)
+	{
+		printf("Can't open trace directory '%s'\n", state.tracepath);
+		return -2;
+	}
+	closedir(d);
+
+	int w = HEADLESS_WIDTH, h = HEADLESS_HEIGHT;
+	if (state.ui_visible)
+	{
+		//Initialize SDL
+		if( SDL_Init( SDL_INIT_VIDEO ) < 0 )
+		{
+			printf( "SDL could not initialize! SDL_Error: %s\n", SDL_GetError() );
+			return -1;
+		}
+
+		if(TTF_Init()==-1)
+		{
+			printf("TTF_Init: %s\n", TTF_GetError());
+			exit(2);
+		}
+
+		// check current display mode on display 0
+		SDL_GetCurrentDisplayMode(0, &mode);
+
+		//Create window
+		window = SDL_CreateWindow("515 Simulator", SDL_WINDOWPOS_CENTERED,
+			SDL_WINDOWPOS_CENTERED, mode.w, mode.h, SDL_WINDOW_FULLSCREEN);
+		if(!window)
+		{
+			printf( "Window could not be created! SDL_Error: %s\n", SDL_GetError() );
+			return -2;
+		}
+
+		SDL_GetWindowSize(window, &w, &h);
+		printf("Your resolution is %ix%i\n", w, h);
+
+		//Get window surface
+		surface = SDL_GetWindowSurface(window);
+		renderer = SDL_CreateSoftwareRenderer(surface);
+	}
+
+	// default to local directory to find trace files
+	if (!state.tracepath)
+		state.tracepath = strdup(".");
+
+	budget_init(0, pin);
+	if (timeline_filename)
+		timeline_enable(timeline_filename);
+	if (counters && (sweep || branch))
+		printf("The sweep workers don't print anything, so the hardware counters are not used\n");
+	else if (counters)
+		counters_enable();
+	if (sweep)
+		return run_sweep(sweep, sweep_random, results_filename);
+	if (branch)
+		return run_branches(branch, branch_at, results_filename);
+
+	if (record_path)
+	{
+		recorder = new CRecorder();
+		if (!recorder->Start(record_path, record_format, record_width, record_height, record_fps, record_trials, w, h,
+			!state.ui_visible))
+			return -1;
+	}
+
+	run_trials(window, renderer, w, h);
+
+	// waits for the encoder to write what is still queued
+	delete recorder;
+	recorder = NULL;
+
+	CDemoLibrary::Flush();
+
+	// with the estimate_state latency below, enough to compare the filters
+	if (!state.training)
+	{
+		uint64_t thrown = state.trials * state.num_balls;
+		printf("filter %s: %lu trials, %lu of %lu balls caught (%.1f%%)\n", filter_name(state.filter), state.trials,
+			state.catches, thrown, thrown ? state.catches * 100.0 / thrown : 0);
+		if (state.learn)
+			printf("learned %lu demonstrations\n", state.learned);
+		if (state.config.get(PARAM_GATE_THRESHOLD) > 0)
+			printf("innovation gate: %lu of %lu corrections skipped (%.1f%%)\n", state.skipped, state.estimates,
+				state.estimates ? state.skipped * 100.0 / state.estimates : 0);
+	}
+	metrics_dump(stdout);
+	if (counters_enabled)
+	{
+		counter_totals totals;
+		counters_snapshot(&totals, false);
+		counters_print(stdout, filter_name(state.filter), totals);
+	}
+	timeline_write();
+	budget_report(stdout);
+	if (state.metrics_filename)
+	{
+		metrics_write_file(state.metrics_filename);
+		free(state.metrics_filename);
+	}
+
 	if (state.trace_filename)
 		free(state.trace_filename);
+	if (state.snapshot_filename)
+		free(state.snapshot_filename);
 
-	//Destroy window
-	SDL_DestroyWindow(window);
+	if (state.ui_visible)
+	{
+		//Destroy window
+		SDL_DestroyWindow(window);
 
-	//Quit SDL subsystems
-	SDL_Quit();
+		//Quit SDL subsystems
+		SDL_Quit();
+	}
 
 	return 0;
 }
@@ -0,0 +1,221 @@
+#include "metrics.h"
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <mutex>
+#include <vector>
+
+// one set of histograms per thread that has recorded something
+struct metric_block
+{
+	CHistogram hist[MAX_METRICS];
+};
+
+static const char *metric_names[MAX_METRICS] =
+{
+	"frame",
+	"update_simulation",
+	"estimate_state",
+	"collision",
+	"draw",
+	"retrieval",
+};
+
+static std::mutex blocks_lock; // only taken when a thread registers, or when taking a snapshot
+static std::vector<metric_block*> blocks;
+static thread_local metric_block *local_block = NULL;
+
+void CHistogram::reset()
+{
+	m_count.store(0, std::memory_order_relaxed);
+	m_sum.store(0, std::memory_order_relaxed);
+	m_min.store(UINT64_MAX, std::memory_order_relaxed);
+	m_max.store(0, std::memory_order_relaxed);
+	for (unsigned int i=0; i < HIST_BUCKETS; i++)
+		m_buckets[i].store(0, std::memory_order_relaxed);
+}
+
+unsigned int CHistogram::bucket_index(uint64_t value)
+{
+	if (value < HIST_SUB_BUCKETS)
+		return value;
+
+	unsigned int msb = 63 - __builtin_clzll(value);
+	unsigned int shift = msb - HIST_SUB_BUCKET_BITS + 1;
+	unsigned int sub = value >> shift; // in [HIST_HALF_BUCKETS, HIST_SUB_BUCKETS)
+	return HIST_SUB_BUCKETS + (shift - 1) * HIST_HALF_BUCKETS + (sub - HIST_HALF_BUCKETS);
+}
+
+// midpoint of the range of values counted by the bucket
+uint64_t CHistogram::bucket_value(unsigned int index)
+{
+	if (index < HIST_SUB_BUCKETS)
+		return index;
+
+	unsigned int shift = (index - HIST_SUB_BUCKETS) / HIST_HALF_BUCKETS + 1;
+	uint64_t sub = (index - HIST_SUB_BUCKETS) % HIST_HALF_BUCKETS + HIST_HALF_BUCKETS;
+	return (sub << shift) + ((1UL << shift) >> 1);
+}
+
+// single writer: plain load/store is enough, no locked instructions on the hot path
+void CHistogram::record(uint64_t value)
+{
+	std::atomic<uint64_t> &bucket = m_buckets[bucket_index(value)];
+	bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	m_count.store(m_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	m_sum.store(m_sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	if (value < m_min.load(std::memory_order_relaxed))
+		m_min.store(value, std::memory_order_relaxed);
+	if (value > m_max.load(std::memory_order_relaxed))
+		m_max.store(value, std::memory_order_relaxed);
+}
+
+void CHistogram::merge(const CHistogram &other)
+{
+	if (!other.count())
+		return;
+
+	for (unsigned int i=0; i < HIST_BUCKETS; i++)
+	{
+		uint64_t n = other.m_buckets[i].load(std::memory_order_relaxed);
+		if (n)
+			m_buckets[i].store(m_buckets[i].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	m_count.store(count() + other.count(), std::memory_order_relaxed);
+	m_sum.store(sum() + other.sum(), std::memory_order_relaxed);
+	if (other.min() < min())
+		m_min.store(other.min(), std::memory_order_relaxed);
+	if (other.max() > max())
+		m_max.store(other.max(), std::memory_order_relaxed);
+}
+
+// p is in the range [0, 100]
+uint64_t CHistogram::percentile(double p) const
+{
+	uint64_t total = count();
+	if (!total)
+		return 0;
+
+	uint64_t target = (uint64_t)(p / 100.0 * total + 0.5);
+	if (target < 1)
+		target = 1;
+
+	uint64_t seen = 0;
+	for (unsigned int i=0; i < HIST_BUCKETS; i++)
+	{
+		seen += m_buckets[i].load(std::memory_order_relaxed);
+		if (seen >= target)
+		{
+			// the bucket midpoint can fall outside of what was actually seen
+			uint64_t v = bucket_value(i);
+			if (v > max())
+				v = max();
+			if (v < min())
+				v = min();
+			return v;
+		}
+	}
+	return max();
+}
+
+const char* metrics_name(unsigned int metric)
+{
+	if (metric >= MAX_METRICS)
+		return "unknown";
+	return metric_names[metric];
+}
+
+uint64_t metrics_now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+void metrics_record(unsigned int metric, uint64_t ns)
+{
+	if (!local_block)
+	{
+		local_block = new metric_block;
+		std::lock_guard<std::mutex> guard(blocks_lock);
+		blocks.push_back(local_block);
+	}
+
+	local_block->hist[metric].record(ns);
+}
+
+void metrics_snapshot(CHistogram *out)
+{
+	for (unsigned int m=0; m < MAX_METRICS; m++)
+		out[m].reset();
+
+	std::lock_guard<std::mutex> guard(blocks_lock);
+	for (unsigned int b=0; b < blocks.size(); b++)
+	{
+		for (unsigned int m=0; m < MAX_METRICS; m++)
+			out[m].merge(blocks[b]->hist[m]);
+	}
+}
+
+void metrics_dump(FILE *f)
+{
+	CHistogram *snapshot = new CHistogram[MAX_METRICS];
+	metrics_snapshot(snapshot);
+
+	fprintf(f, "%-18s %10s %10s %10s %10s %10s %10s %10s\n", "metric (us)", "count", "mean", "min", "p50", "p99", "p99.9", "max");
+	for (unsigned int m=0; m < MAX_METRICS; m++)
+	{
+		CHistogram &h = snapshot[m];
+		if (!h.count())
+			continue;
+
+		fprintf(f, "%-18s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", metrics_name(m), h.count(),
+			h.mean() / 1000.0, h.min() / 1000.0, h.percentile(50) / 1000.0, h.percentile(99) / 1000.0,
+			h.percentile(99.9) / 1000.0, h.max() / 1000.0);
+	}
+
+	delete[] snapshot;
+}
+
+bool metrics_write_file(const char *filename)
+{
+	char *tmpname = NULL;
+	FILE *f;
+
+	if (asprintf(&tmpname, "%s.tmp", filename) < 0)
+		return false;
+
+	f = fopen(tmpname, "w");
+	if (!f)
+	{
+		printf("Error opening metrics file %s\n", tmpname);
+		free(tmpname);
+		return false;
+	}
+
+	CHistogram *snapshot = new CHistogram[MAX_METRICS];
+	metrics_snapshot(snapshot);
+
+	fprintf(f, "# TYPE sim_latency_ns summary\n");
+	for (unsigned int m=0; m < MAX_METRICS; m++)
+	{
+		CHistogram &h = snapshot[m];
+		const char *name = metrics_name(m);
+		fprintf(f, "sim_latency_ns{stage=\"%s\",quantile=\"0.5\"} %lu\n", name, h.percentile(50));
+		fprintf(f, "sim_latency_ns{stage=\"%s\",quantile=\"0.9\"} %lu\n", name, h.percentile(90));
+		fprintf(f, "sim_latency_ns{stage=\"%s\",quantile=\"0.99\"} %lu\n", name, h.percentile(99));
+		fprintf(f, "sim_latency_ns{stage=\"%s\",quantile=\"0.999\"} %lu\n", name, h.percentile(99.9));
+		fprintf(f, "sim_latency_ns_sum{stage=\"%s\"} %lu\n", name, h.sum());
+		fprintf(f, "sim_latency_ns_count{stage=\"%s\"} %lu\n", name, h.count());
+	}
+
+	delete[] snapshot;
+	fclose(f);
+
+	// rename is atomic, so a scraper never sees a half-written file
+	bool ok = (rename(tmpname, filename) == 0);
+	if (!ok)
+		printf("Error replacing metrics file %s\n", filename);
+	free(tmpname);
+	return ok;
+}
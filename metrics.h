@@ -0,0 +1,83 @@
+#ifndef _METRICS__H
+#define _METRICS__H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+
+#define METRICS_WRITE_INTERVAL		1000000000UL // how often (ns) the metrics file is rewritten
+#define METRICS_HUD_REFRESH		250000000UL // how often (ns) the on-screen overlay is regenerated
+
+// The histograms are HDR-style: values below HIST_SUB_BUCKETS are counted exactly, and above that each power of two
+// is split into HIST_SUB_BUCKETS/2 linear sub-buckets, so any recorded value is off by at most 1/(HIST_SUB_BUCKETS/2).
+#define HIST_SUB_BUCKET_BITS		6
+#define HIST_SUB_BUCKETS			(1 << HIST_SUB_BUCKET_BITS)
+#define HIST_HALF_BUCKETS			(HIST_SUB_BUCKETS / 2)
+#define HIST_BUCKETS					(HIST_SUB_BUCKETS + (64 - HIST_SUB_BUCKET_BITS) * HIST_HALF_BUCKETS)
+
+enum
+{
+	METRIC_FRAME,					// wall time between two presented frames
+	METRIC_UPDATE_SIMULATION,	// one call to UpdateSimulation
+	METRIC_ESTIMATE_STATE,		// one call to BIP::estimate_state
+	METRIC_COLLISION,				// one call to CheckForCollision
+	METRIC_DRAW,					// Draw + presenting the window surface
+	METRIC_RETRIEVAL,				// rebuilding the ensemble from the nearest demonstrations
+	MAX_METRICS
+};
+
+// Latency histogram in ns. Only the owning thread writes to it, but other threads may read it at any time
+// (for the metrics file or the HUD) so the counters are relaxed atomics.
+class CHistogram
+{
+public:
+	CHistogram() { reset(); }
+	void reset();
+	void record(uint64_t value);
+	void merge(const CHistogram &other);
+	uint64_t percentile(double p) const;
+	uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+	uint64_t sum() const { return m_sum.load(std::memory_order_relaxed); }
+	uint64_t min() const { return m_min.load(std::memory_order_relaxed); }
+	uint64_t max() const { return m_max.load(std::memory_order_relaxed); }
+	double mean() const { return count() ? (double)sum() / (double)count() : 0; }
+
+private:
+	static unsigned int bucket_index(uint64_t value);
+	static uint64_t bucket_value(unsigned int index);
+
+	std::atomic<uint64_t> m_count;
+	std::atomic<uint64_t> m_sum;
+	std::atomic<uint64_t> m_min;
+	std::atomic<uint64_t> m_max;
+	std::atomic<uint64_t> m_buckets[HIST_BUCKETS];
+};
+
+const char* metrics_name(unsigned int metric);
+uint64_t metrics_now_ns();
+
+// record a sample for the calling thread (each thread owns its own set of histograms)
+void metrics_record(unsigned int metric, uint64_t ns);
+
+// merge the histograms of all threads into 'out' (array of MAX_METRICS)
+void metrics_snapshot(CHistogram *out);
+
+// human readable table (used at exit)
+void metrics_dump(FILE *f);
+
+// text exposition format for scraping; the file is replaced atomically
+bool metrics_write_file(const char *filename);
+
+// measures the lifetime of the object and records it as a sample of the given metric
+class CMetricTimer
+{
+public:
+	CMetricTimer(unsigned int metric) : m_metric(metric), m_start(metrics_now_ns()) {}
+	~CMetricTimer() { metrics_record(m_metric, metrics_now_ns() - m_start); }
+
+private:
+	unsigned int m_metric;
+	uint64_t m_start;
+};
+
+#endif // _METRICS__H
@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "multitarget.h"
+
+#define D NUM_STATE_VARIABLES
+#define B NUM_ENSEMBLE_STATES
+
+// the innovation covariance is inverted in closed form
+static_assert(D == 3, "closed form inverse needs 3 state variables");
+
+// inverse of a 3x3 matrix via the adjugate. Returns false (and leaves 'inv' zeroed) if it is singular.
+static bool invert3(const double *m, double *inv)
+{
+	double c00 = m[4]*m[8] - m[5]*m[7];
+	double c01 = m[5]*m[6] - m[3]*m[8];
+	double c02 = m[3]*m[7] - m[4]*m[6];
+	double det = m[0]*c00 + m[1]*c01 + m[2]*c02;
+
+	if (det == 0)
+	{
+		memset(inv, 0, sizeof(double) * 9);
+		return false;
+	}
+
+	double r = 1.0 / det;
+	inv[0] = c00 * r;
+	inv[1] = (m[2]*m[7] - m[1]*m[8]) * r;
+	inv[2] = (m[1]*m[5] - m[2]*m[4]) * r;
+	inv[3] = c01 * r;
+	inv[4] = (m[0]*m[8] - m[2]*m[6]) * r;
+	inv[5] = (m[2]*m[3] - m[0]*m[5]) * r;
+	inv[6] = c02 * r;
+	inv[7] = (m[1]*m[6] - m[0]*m[7]) * r;
+	inv[8] = (m[0]*m[4] - m[1]*m[3]) * r;
+	return true;
+}
+
+CMultiTargetBIP::CMultiTargetBIP(CDemoLibrary *library, unsigned int num_targets, unsigned int members) : m_library(library),
+	m_num_targets(num_targets), m_num_members(members), m_trial(0), m_tick(0)
+{
+	const unsigned int E = m_num_members;
+	m_library->AddRef();
+	m_members = (CInteraction**)calloc(sizeof(CInteraction*), num_targets * E);
+	m_weights = (double*)calloc(sizeof(double), num_targets * B * E);
+	m_hx = (double*)calloc(sizeof(double), num_targets * D * E);
+	m_ha = (double*)calloc(sizeof(double), num_targets * D * E);
+	m_gain = (double*)calloc(sizeof(double), num_targets * B * D);
+}
+
+CMultiTargetBIP::~CMultiTargetBIP()
+{
+	free(m_members);
+	free(m_weights);
+	free(m_hx);
+	free(m_ha);
+	free(m_gain);
+	m_library->Release();
+}
+
+void CMultiTargetBIP::create_initial_ensemble()
+{
+	const unsigned int E = m_num_members;
+	for (unsigned int t=0; t < m_num_targets; t++)
+	{
+		double *w = weights(t);
+		CRandom members(RNG_BLOCK_MEMBERS, m_trial, 0, t);
+		m_library->DrawMembers(m_members + t * E, E, members);
+		for (unsigned int e=0; e < E; e++)
+		{
+			w[E * ENSEMBLE_STATE_PHASE + e] = 0;
+			w[E * ENSEMBLE_STATE_PHASE_VEL + e] = (double)1/(double)m_members[t * E + e]->length();
+			w[E * ENSEMBLE_STATE_WEIGHT + e] = 1;
+		}
+	}
+}
+
+void CMultiTargetBIP::propagate(const double *samples)
+{
+	const unsigned int E = m_num_members;
+	for (unsigned int t=0; t < m_num_targets; t++)
+	{
+		double *phase = weights(t) + E * ENSEMBLE_STATE_PHASE;
+		const double *phase_vel = weights(t) + E * ENSEMBLE_STATE_PHASE_VEL;
+		for (unsigned int e=0; e < E; e++)
+			phase[e] = std::min(1.0, std::max(0.0, samples[t] * phase_vel[e]));
+	}
+}
+
+// HX and HA for all targets. As in BIP::hx, every member is looked up at the phase of the first member.
+void CMultiTargetBIP::hx()
+{
+	const unsigned int E = m_num_members;
+	double sample[D];
+
+	for (unsigned int t=0; t < m_num_targets; t++)
+	{
+		const double *w = weights(t);
+		double *hx = m_hx + t * D * E;
+		double *ha = m_ha + t * D * E;
+		double mean[D] = {0};
+
+		for (unsigned int e=0; e < E; e++)
+		{
+			CRandom random(RNG_BLOCK_PREDICTION, m_trial, m_tick, t * E + e);
+			m_members[t * E + e]->get_sample(w[E * ENSEMBLE_STATE_PHASE], sample);
+			for (unsigned int d=0; d < D; d++)
+			{
+				hx[E * d + e] = sample[d] * w[E * ENSEMBLE_STATE_WEIGHT + e] + random.noise(0.1);
+				mean[d] += hx[E * d + e];
+			}
+		}
+
+		for (unsigned int d=0; d < D; d++)
+		{
+			mean[d] /= E;
+			for (unsigned int e=0; e < E; e++)
+				ha[E * d + e] = hx[E * d + e] - mean[d];
+		}
+	}
+}
+
+// Kalman gain for every target, as kalman_gain: K = (A.HA'/(E-1)) . inv(HA.HA'/(E-1) + R), with the phase row cleared
+void CMultiTargetBIP::gain()
+{
+	const unsigned int E = m_num_members;
+	const double scale = (double)1/(double)(E - 1);
+
+	for (unsigned int t=0; t < m_num_targets; t++)
+	{
+		const double *w = weights(t);
+		const double *ha = m_ha + t * D * E;
+		double *K = m_gain + t * B * D;
+		double S[D * D], Sinv[D * D], P[B * D];
+		double mean[B];
+		CRandom random(RNG_BLOCK_OBSERVATION_NOISE, m_trial, m_tick, t);
+
+		for (unsigned int b=0; b < B; b++)
+		{
+			mean[b] = 0;
+			for (unsigned int e=0; e < E; e++)
+				mean[b] += w[E * b + e];
+			mean[b] /= E;
+		}
+
+		// both products are tiny (D and B are 3), so they are written out rather than handed to BLAS
+		for (unsigned int i=0; i < D; i++)
+		{
+			for (unsigned int j=0; j < D; j++)
+			{
+				double s = 0;
+				for (unsigned int e=0; e < E; e++)
+					s += ha[E * i + e] * ha[E * j + e];
+				S[D * i + j] = s * scale + random.noise(0.1);
+			}
+		}
+
+		for (unsigned int b=0; b < B; b++)
+		{
+			for (unsigned int j=0; j < D; j++)
+			{
+				double s = 0;
+				for (unsigned int e=0; e < E; e++)
+					s += (w[E * b + e] - mean[b]) * ha[E * j + e];
+				P[D * b + j] = s * scale;
+			}
+		}
+
+		invert3(S, Sinv);
+
+		for (unsigned int b=0; b < B; b++)
+		{
+			for (unsigned int j=0; j < D; j++)
+			{
+				double s = 0;
+				for (unsigned int k=0; k < D; k++)
+					s += P[D * b + k] * Sinv[D * k + j];
+				K[D * b + j] = (b == ENSEMBLE_STATE_PHASE) ? 0 : s;
+			}
+		}
+	}
+}
+
+// perturbed observations, and the correction of every ensemble
+void CMultiTargetBIP::update(const double *sensors)
+{
+	const unsigned int E = m_num_members;
+	double diff[D];
+
+	for (unsigned int t=0; t < m_num_targets; t++)
+	{
+		double *w = weights(t);
+		const double *hx = m_hx + t * D * E;
+		const double *K = m_gain + t * B * D;
+
+		for (unsigned int e=0; e < E; e++)
+		{
+			CRandom random(RNG_BLOCK_OBSERVATION, m_trial, m_tick, t * E + e);
+			for (unsigned int d=0; d < D; d++)
+				diff[d] = sensors[t * D + d] + random.noise(0.1) - hx[E * d + e];
+
+			for (unsigned int b=0; b < B; b++)
+			{
+				double s = 0;
+				for (unsigned int d=0; d < D; d++)
+					s += K[D * b + d] * diff[d];
+				w[E * b + e] += s;
+			}
+		}
+	}
+}
+
+void CMultiTargetBIP::weighted_mean(double *predictedState)
+{
+	const unsigned int E = m_num_members;
+	double sample[D];
+
+	for (unsigned int t=0; t < m_num_targets; t++)
+	{
+		const double *w = weights(t);
+		double *out = predictedState + t * D;
+
+		for (unsigned int d=0; d < D; d++)
+			out[d] = 0;
+
+		for (unsigned int e=0; e < E; e++)
+		{
+			m_members[t * E + e]->get_sample(w[E * ENSEMBLE_STATE_PHASE], sample);
+			for (unsigned int d=0; d < D; d++)
+				out[d] += sample[d] * w[E * ENSEMBLE_STATE_WEIGHT + e];
+		}
+
+		for (unsigned int d=0; d < D; d++)
+			out[d] /= E;
+	}
+}
+
+void CMultiTargetBIP::estimate_state(const double *samples, const double *sensors, double *predictedState)
+{
+	m_tick++;
+	propagate(samples);
+	hx();
+	gain();
+	update(sensors);
+	weighted_mean(predictedState);
+}
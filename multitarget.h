@@ -0,0 +1,53 @@
+#ifndef _MULTITARGET__H
+#define _MULTITARGET__H
+
+#include "bip.h"
+
+/*
+	Tracks several objects at once, with one ensemble per target. It runs the same filter as
+	BIP::estimate_state, but all ensembles live in one batched layout:
+
+	weights		T x B x E
+	HX, HA		T x D x E
+	S, K			T x D x D, T x B x D
+
+	Every step of the update loops over the targets, and runs the small products of each one in turn: the
+	arithmetic grows linearly with the number of targets, as it would with one filter per target. What is
+	shared is the fixed cost. The small D x D solves are done in closed form instead of through LAPACK, no
+	BLAS call is made, and all scratch space is allocated once, so allocation and library call overhead are
+	paid once per update instead of once per target.
+*/
+class CMultiTargetBIP
+{
+public:
+	CMultiTargetBIP(CDemoLibrary *library, unsigned int num_targets, unsigned int members = NUM_ENSEMBLE_MEMBERS);
+	~CMultiTargetBIP();
+
+	unsigned int num_targets() { return m_num_targets; }
+	void set_trial(uint64_t trial) { m_trial = trial; m_tick = 0; } // see CEstimator
+	void create_initial_ensemble();
+
+	// samples: T, sensors: T x D, predictedState: T x D
+	void estimate_state(const double *samples, const double *sensors, double *predictedState);
+
+private:
+	double* weights(unsigned int target) { return m_weights + target * NUM_ENSEMBLE_STATES * m_num_members; }
+	void propagate(const double *samples);
+	void hx();
+	void gain();
+	void update(const double *sensors);
+	void weighted_mean(double *predictedState);
+
+	CDemoLibrary *m_library; // shared demonstrations (holds a reference)
+	unsigned int m_num_targets;
+	unsigned int m_num_members; // E
+	uint64_t m_trial;
+	uint64_t m_tick;
+	CInteraction **m_members;	// T x E
+	double *m_weights;			// T x B x E
+	double *m_hx;				// T x D x E
+	double *m_ha;				// T x D x E
+	double *m_gain;				// T x B x D
+};
+
+#endif // _MULTITARGET__H
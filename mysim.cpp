@@ -1,6 +1,7 @@
-#include <dirent.h>
+#include <algorithm>
 #include "mysim.h"
 #include "interaction.h"
+#include "timeline.h"
 
 #define NUM_SAMPLES_TRAJECTORY 100
 #define GROUND_HEIGHT 50
@@ -109,18 +110,21 @@ void print_matrix_double(double *A, int n, int m)
 	putc('\n', stdout);
 }
 
-CMySimulation::CMySimulation() : robot(NULL), bird(NULL), egg(NULL), player(NULL), ball(NULL), m_fontSans(NULL), m_num_sensors(0),
-		m_sensor_elapsed(0), m_sensor_delay(HZ_TO_NS(SENSOR_FREQUENCY)), m_collision(NULL), m_s_catchrate(NULL), m_catch(0),
-		m_tracefile(NULL), m_s_training(NULL), m_avg_trajectory(NULL), m_display_sensors(false)
+CMySimulation::CMySimulation() : ground(NULL), robot(NULL), bird(NULL), egg(NULL), player(NULL), ball(NULL), m_caught(false), m_num_landed(0),
+		m_fontSans(NULL), m_collision(NULL), m_num_sensors(0), m_sensor_elapsed(0), m_sensor_delay(HZ_TO_NS(SENSOR_FREQUENCY)),
+		m_sensor_reads(0), m_tracefile(NULL), m_retrieved(false), m_retrieval_tried(false), m_display_sensors(false),
+		m_display_metrics(false), m_metrics_refreshed(0), m_s_catchrate(NULL), m_s_training(NULL), m_library(NULL), m_primitive(NULL),
+		m_multi(NULL), m_avg_trajectory(NULL)
 {
-	// Initialize a BIP instance
-	m_primitive = new BIP();
 	for (int i=0; i < NUM_STATE_VARIABLES; i++)
 	{
 		m_est_state[i] = 0;
 		m_predicted_state[i] = 0;
 	}
-	m_avg_trajectory = (double*)calloc(sizeof(double), NUM_STATE_VARIABLES * NUM_SAMPLES_TRAJECTORY);
+	for (int i=0; i < MAX_METRICS; i++)
+		m_s_metrics[i] = NULL;
+	for (int i=0; i < MAX_SENSORS; i++)
+		m_s_sensors[i] = NULL;
 }
 
 CMySimulation::~CMySimulation()
@@ -128,11 +132,36 @@ CMySimulation::~CMySimulation()
 	if (m_tracefile)
 		fclose(m_tracefile);
 
-	delete robot;
-	delete bird;
-	delete ball;
+	for (obj_list::iterator i = sim_objects.begin(); i != sim_objects.end(); i++)
+		delete *i;
+	for (event_list::iterator i = sim_events.begin(); i != sim_events.end(); i++)
+		delete *i;
+	delete m_collision;
+
+	// the demonstrations stay loaded for the next trial
+	LearnTrial();
+	if (m_primitive && m_state)
+	{
+		m_state->estimates += m_primitive->gate_statistics().updates;
+		m_state->skipped += m_primitive->gate_statistics().skipped;
+	}
 	delete m_primitive;
-	free(m_avg_trajectory);
+	delete m_multi;
+	if (m_library)
+		m_library->Release();
+
+	for (int i=0; i < MAX_METRICS; i++)
+		if (m_s_metrics[i])
+			SDL_FreeSurface(m_s_metrics[i]);
+	for (int i=0; i < MAX_SENSORS; i++)
+		if (m_s_sensors[i])
+			SDL_FreeSurface(m_s_sensors[i]);
+	if (m_s_catchrate)
+		SDL_FreeSurface(m_s_catchrate);
+	if (m_s_training)
+		SDL_FreeSurface(m_s_training);
+	if (m_fontSans)
+		TTF_CloseFont(m_fontSans);
 }
 
 bool CMySimulation::Initialize(program_state *state, uint32_t w, uint32_t h)
@@ -142,14 +171,16 @@ bool CMySimulation::Initialize(program_state *state, uint32_t w, uint32_t h)
 	if (!CSimulation::Initialize(state, w, h))
 		return false;
 
-	// set number of threads
-	//openblas_set_num_threads(2);
+	m_sensor_delay = HZ_TO_NS((uint64_t)m_state->config.get(PARAM_SENSOR_FREQUENCY));
 
-	m_fontSans = TTF_OpenFont("/usr/share/fonts/truetype/open-sans/OpenSans-Regular.ttf", 24);
-	if (!m_fontSans)
+	if (m_state->ui_visible)
 	{
-		DEBUG_PRINT("Can't find font Sans\n");
-		return false;
+		m_fontSans = TTF_OpenFont("/usr/share/fonts/truetype/open-sans/OpenSans-Regular.ttf", 24);
+		if (!m_fontSans)
+		{
+			DEBUG_PRINT("Can't find font Sans\n");
+			return false;
+		}
 	}
 
 	ground = new sim_object(w/2, h-(GROUND_HEIGHT/2), m_scale);
@@ -169,14 +200,30 @@ bool CMySimulation::Initialize(program_state *state, uint32_t w, uint32_t h)
 	player->set_height(PLAYER_HEIGHT);
 	player->set_name("player");
 	sim_objects.push_back(player);
-	sim_events.push_back(new sim_event(TIME_BEFORE_BALL, EVENT_THROW_BALL, event_handler));
 
-	ball = new sim_object(player->x() + player->width()/2 + BALL_DIAMETER/2 + 5, robot->y() - robot->height()/2 - BALL_DIAMETER/2 - 10, m_scale);
-	ball->set_width(BALL_DIAMETER);
-	ball->set_height(BALL_DIAMETER);
-	ball->set_name("ball");
-	ball->set_tracer_length(40);
-	sim_objects.push_back(ball);
+	// the balls wait in the player's hand, and are thrown one after the other
+	for (unsigned int i=0; i < m_state->num_balls; i++)
+	{
+		char name[32];
+		uint64_t throw_time = TIME_BEFORE_BALL + i * TIME_BETWEEN_BALLS;
+		sim_events.push_back(new sim_event(throw_time, EVENT_ID(EVENT_THROW_BALL, i), event_handler));
+
+		sim_object *b = new sim_object(player->x() + player->width()/2 + BALL_DIAMETER/2 + 5, robot->y() - robot->height()/2 - BALL_DIAMETER/2 - 10, m_scale);
+		b->set_width(BALL_DIAMETER);
+		b->set_height(BALL_DIAMETER);
+		if (i)
+			snprintf(name, sizeof(name), "ball%u", i);
+		else
+			snprintf(name, sizeof(name), "ball");
+		b->set_name(name);
+		b->set_tracer_length(40);
+		b->set_collision_group(COLLISION_GROUP_BALLS);
+		sim_objects.push_back(b);
+		m_balls.push_back(b);
+		m_throw_time.push_back(throw_time);
+		m_landed.push_back(false);
+	}
+	ball = m_balls[0];
 
 	AddSensor(SENSOR_BALL, ball);
 /*
@@ -228,25 +275,59 @@ bool CMySimulation::Initialize(program_state *state, uint32_t w, uint32_t h)
 	}
 	else
 	{
-		// Load previous traces to create an ensemble
-		CreateInitialEnsemble();
-
-		// Compute the phase mean and phase velocities from the demonstrations.
-		double phase_velocity_mean;
-		double phase_velocity_var;
-		m_primitive->get_phase_stats(&phase_velocity_mean, &phase_velocity_var);
-		printf("Phase velocity mean: %f %%/sample  Variance: %f\n", phase_velocity_mean*100, phase_velocity_var);
+		// Load previous traces to create an ensemble (only the first trial reads them)
+		if (CreateInitialEnsemble() < 0)
+		{
+			m_state->quit = true;
+			return false;
+		}
 
+		m_primitive->set_trial(m_state->trials);
 		m_primitive->create_initial_ensemble();
 
-		m_primitive->get_mean_trajectory(0, 1, NUM_SAMPLES_TRAJECTORY, m_avg_trajectory);
+		// one batched estimator for all of the balls
+		if (m_balls.size() > 1)
+		{
+			m_multi = new CMultiTargetBIP(m_library, m_balls.size(), m_state->config.get(PARAM_ENSEMBLE_MEMBERS));
+			m_multi->set_trial(m_state->trials);
+			m_multi->create_initial_ensemble();
+			m_target_est.assign(m_balls.size() * NUM_STATE_VARIABLES, 0);
+		}
+
+		// The model data only depends on the demonstrations, so it is computed once per library
+		if (!m_library->has_model())
+		{
+			// the model is defined by the BIP, whichever estimator is in use
+			BIP model(m_library);
+			model.set_verbose(false);
+			model.create_initial_ensemble();
+
+			// Compute the phase mean and phase velocities from the demonstrations.
+			double phase_velocity_mean;
+			double phase_velocity_var;
+			model.get_phase_stats(&phase_velocity_mean, &phase_velocity_var);
+			m_library->set_phase_stats(phase_velocity_mean, phase_velocity_var);
+			printf("Phase velocity mean: %f %%/sample  Variance: %f\n", phase_velocity_mean*100, phase_velocity_var);
+
+			double *trajectory = (double*)calloc(sizeof(double), NUM_STATE_VARIABLES * NUM_SAMPLES_TRAJECTORY);
+			model.get_mean_trajectory(0, 1, NUM_SAMPLES_TRAJECTORY, trajectory);
+			m_library->set_mean_trajectory(trajectory, NUM_SAMPLES_TRAJECTORY, m_library->size());
+			free(trajectory);
+
+			// so the next run can skip all of the above
+			if (m_state->snapshot_filename)
+				m_library->SaveSnapshot(m_state->snapshot_filename);
+		}
+		// the estimators only need the fitted weights from now on
+		m_library->DropSamples();
+		m_avg_trajectory = m_library->mean_trajectory();
 		printf("Avg. trajectory:\n");
 		print_matrix_double(m_avg_trajectory, NUM_STATE_VARIABLES, NUM_SAMPLES_TRAJECTORY);
 	}
 
 	UpdateCatchrateUI();
 
-	if (m_state->training)
+	if (m_state->training && m_state->ui_visible)
 		m_s_training = TTF_RenderText_Solid(m_fontSans, "TRAINING", Red);
 
 	return true;
@@ -271,7 +352,7 @@ void CMySimulation::DropEgg()
 	sim_objects.push_back(egg);
 }
 
-void CMySimulation::ThrowBall()
+void CMySimulation::ThrowBall(unsigned int index)
 {
 /*
 	if (ball)
@@ -288,13 +369,21 @@ void CMySimulation::ThrowBall()
 	}
 
 	// calculate a random trajectory (separate x and y components)
-	uint64_t x = rand() % (MAX_BALL_VELOCITY - MIN_BALL_VELOCITY);
-	uint64_t y = rand() % (MAX_BALL_VELOCITY - MIN_BALL_VELOCITY);
+	double min_velocity = m_state->config.get(PARAM_MIN_BALL_VELOCITY);
+	double max_velocity = m_state->config.get(PARAM_MAX_BALL_VELOCITY);
+	uint64_t range = (max_velocity > min_velocity) ? (uint64_t)(max_velocity - min_velocity) : 0;
+	CRandom random(RNG_BLOCK_LAUNCH, m_state->trials, 0, index);
+	uint64_t x = range ? random.below(range) : 0;
+	uint64_t y = range ? random.below(range) : 0;
+
+	if (index >= m_balls.size())
+		return;
 
-	DEBUG_PRINT("Throwing ball x: %lu y: %lu\n", x, y);
-	ball->set_velocity_x(x + MIN_BALL_VELOCITY);
-	ball->set_velocity_y((0 - (double)y - MIN_BALL_VELOCITY));
-	ball->set_acceleration_y(GRAVITY);
+	sim_object *b = m_balls[index];
+	DEBUG_PRINT("Throwing %s x: %lu y: %lu\n", b->name(), x, y);
+	b->set_velocity_x(x + min_velocity);
+	b->set_velocity_y((0 - (double)y - min_velocity));
+	b->set_acceleration_y(GRAVITY);
 }
 
 bool CMySimulation::AddSensor(uint64_t index, sim_object *s)
@@ -312,20 +401,29 @@ bool CMySimulation::AddSensor(uint64_t index, sim_object *s)
 	return true;
 }
 
+uint64_t CMySimulation::NextEventTime(uint64_t abs_ns)
+{
+	uint64_t next = CSimulation::NextEventTime(abs_ns);
+
+	// the sensors are read on the first step that goes past the sensor delay
+	uint64_t sensor = (m_sensor_elapsed > m_sensor_delay) ? 0 : m_sensor_delay - m_sensor_elapsed + 1;
+	return std::min(next, sensor);
+}
+
 void CMySimulation::event_handler(CSimulation *s, uint64_t eventID, uint64_t timestamp)
 {
 	DEBUG_PRINT("%lu: %s\n", timestamp, __PRETTY_FUNCTION__);
 
 	CMySimulation *mysim = static_cast<CMySimulation*>(s);
 
-	switch(eventID)
+	switch(EVENT_TYPE(eventID))
 	{
 	case EVENT_DROP_EGG:
 		mysim->DropEgg();
 		break;
 
 	case EVENT_THROW_BALL:
-		mysim->ThrowBall();
+		mysim->ThrowBall(EVENT_INDEX(eventID));
 		break;
 	}
 }
@@ -358,9 +456,19 @@ uint64_t CMySimulation::UpdateSimulation(uint64_t abs_ns, uint64_t elapsed_ns)
 		if (m_state->training && m_tracefile)
 			fputs("\n", m_tracefile);
 
+		measurement reading;
+		reading.timestamp = abs_ns;
+		reading.player = point(m_sensors[SENSOR_PLAYER]->x(), m_sensors[SENSOR_PLAYER]->y());
+		reading.robot = point(m_sensors[SENSOR_ROBOT]->x(), m_sensors[SENSOR_ROBOT]->y());
+		reading.ball = point(m_sensors[SENSOR_BALL]->x(), m_sensors[SENSOR_BALL]->y());
+		m_history.push_back(reading);
+
 		// update the model
 		if (!m_state->training)
+		{
+			CTimelineSpan span("UpdateEnsemble");
 			UpdateEnsemble(abs_ns, elapsed_ns);
+		}
 
 		// movement
 		if (!m_state->training)
@@ -407,11 +515,11 @@ void CMySimulation::RobotMove(uint64_t direction)
 	switch (direction)
 	{
 	case DIR_RIGHT:
-		robot->set_velocity_x(ROBOT_VELOCITY);
+		robot->set_velocity_x(m_state->config.get(PARAM_ROBOT_VELOCITY));
 		break;
 
 	case DIR_LEFT:
-		robot->set_velocity_x(-ROBOT_VELOCITY);
+		robot->set_velocity_x(-m_state->config.get(PARAM_ROBOT_VELOCITY));
 		break;
 
 	case DIR_STOP:
@@ -420,6 +528,35 @@ void CMySimulation::RobotMove(uint64_t direction)
 	}
 }
 
+// the settings a trial still reads once it has started: the others are fixed by Initialize, or by the throw
+bool CMySimulation::Reconfigurable(unsigned int param)
+{
+	switch (param)
+	{
+	case PARAM_ROBOT_VELOCITY:
+	case PARAM_SENSOR_FREQUENCY:
+	case PARAM_CATCH_TOLERANCE:
+	case PARAM_GATE_THRESHOLD:
+	case PARAM_GATE_MAX_STALE:
+		return true;
+	}
+	return false;
+}
+
+// with the same scenario, nothing changes: the trial goes on exactly as it would have
+void CMySimulation::Reconfigure()
+{
+	m_sensor_delay = HZ_TO_NS((uint64_t)m_state->config.get(PARAM_SENSOR_FREQUENCY));
+	if (m_primitive)
+		m_primitive->set_gate(m_state->config.get(PARAM_GATE_THRESHOLD), m_state->config.get(PARAM_GATE_MAX_STALE));
+
+	// a robot on the move goes on at the new speed
+	if (robot->velocity_x() > 0)
+		RobotMove(DIR_RIGHT);
+	else if (robot->velocity_x() < 0)
+		RobotMove(DIR_LEFT);
+}
+
 void CMySimulation::Draw(SDL_Renderer* renderer)
 {
 	SDL_Rect Message_rect; //create a rect
@@ -446,6 +583,14 @@ void CMySimulation::Draw(SDL_Renderer* renderer)
 			m_predicted_state[STATE_VAR_BALL_X],
 			m_predicted_state[STATE_VAR_BALL_Y],
 			5, color);
+
+		for (unsigned int t=0; t < m_target_est.size() / NUM_STATE_VARIABLES; t++)
+		{
+			filledCircleColor(renderer,
+				m_target_est[t * NUM_STATE_VARIABLES + STATE_VAR_BALL_X],
+				m_target_est[t * NUM_STATE_VARIABLES + STATE_VAR_BALL_Y],
+				5, color);
+		}
 	}
 
 	if (m_display_sensors)
@@ -483,6 +628,28 @@ void CMySimulation::Draw(SDL_Renderer* renderer)
 		filledCircleColor(renderer, m_collision->x, m_collision->y, 5, 0xFF0F0FFF);
 	}
 
+	// latency overlay in the top left corner
+	if (m_display_metrics)
+	{
+		if (metrics_now_ns() - m_metrics_refreshed > METRICS_HUD_REFRESH)
+			UpdateMetricsUI();
+
+		Message_rect.x = 10;
+		Message_rect.y = 10;
+		Message_rect.w = 500;
+		Message_rect.h = 30;
+		for (unsigned int i=0; i < MAX_METRICS; i++)
+		{
+			if (m_s_metrics[i])
+			{
+				SDL_Texture* txt = SDL_CreateTextureFromSurface(renderer, m_s_metrics[i]);
+				SDL_RenderCopy(renderer, txt, NULL, &Message_rect);
+				SDL_DestroyTexture(txt);
+			}
+			Message_rect.y += Message_rect.h + 5;
+		}
+	}
+
 	if (m_state->training)
 	{
 		Message_rect.x = m_width / 2;  //controls the rect's x coordinate 
@@ -508,8 +675,9 @@ bool CMySimulation::sensor_read_pos(sim_object *obj, uint64_t *x, uint64_t *y)
 	if (MAX_SENSOR_NOISE)
 	{
 		// add some noise to the reading
-		x_noise = (rand() % (MAX_SENSOR_NOISE ? MAX_SENSOR_NOISE : 1)) - (MAX_SENSOR_NOISE >> 1);
-		y_noise = (rand() % (MAX_SENSOR_NOISE ? MAX_SENSOR_NOISE : 1)) - (MAX_SENSOR_NOISE >> 1);
+		CRandom random(RNG_BLOCK_SENSOR, m_state->trials, m_sensor_reads++);
+		x_noise = (int)random.below(MAX_SENSOR_NOISE ? MAX_SENSOR_NOISE : 1) - (MAX_SENSOR_NOISE >> 1);
+		y_noise = (int)random.below(MAX_SENSOR_NOISE ? MAX_SENSOR_NOISE : 1) - (MAX_SENSOR_NOISE >> 1);
 	}
 
 	*x = obj->x() + x_noise;
@@ -555,6 +723,12 @@ void CMySimulation::HandleEvent(SDL_Event *event)
 					m_display_sensors = true;
 				break;
 
+			case SDLK_m:
+				// toggle the latency overlay
+				m_display_metrics = !m_display_metrics;
+				m_metrics_refreshed = 0;
+				break;
+
 			case SDLK_r:
 				DEBUG_PRINT("Restart simulation\n");
 				m_state->sim_running = SIM_STATE_STOPPED;
@@ -580,6 +754,7 @@ void CMySimulation::HandleEvent(SDL_Event *event)
 void CMySimulation::OnCollision(uint64_t abs_ns, sim_object *a, sim_object *b)
 {
 	DEBUG_PRINT("Got collision\n");
+	delete m_collision;
 	m_collision = new sim_collision;
 	m_collision->a = a;
 	m_collision->b = b;
@@ -588,38 +763,60 @@ void CMySimulation::OnCollision(uint64_t abs_ns, sim_object *a, sim_object *b)
 	m_collision->timestamp = abs_ns;
 	m_collision->draw = true;
 
-	if (who_collided(m_collision, robot, ball))
+	for (unsigned int i=0; i < m_balls.size(); i++)
 	{
-		DEBUG_PRINT("robot & ball collided\n");
-		ball->set_velocity_x(0);
-		ball->set_velocity_y(0);
-		ball->set_acceleration_y(0);
+		sim_object *ball = m_balls[i];
 
-		// if the ball landed on top of the robot, call it a 'catch'
-		//DEBUG_PRINT("Bottom of ball: %f\n", ball->y() + ball->height());
-		//DEBUG_PRINT("Top of robot: %f\n", robot->y());
-		if (ball->y() + ball->height()/2 - robot->y()/2 < CATCH_TOLERANCE)
+		if (who_collided(m_collision, robot, ball))
+		{
+			DEBUG_PRINT("robot & %s collided\n", ball->name());
+			ball->set_velocity_x(0);
+			ball->set_velocity_y(0);
+			ball->set_acceleration_y(0);
+
+			// if the ball landed on top of the robot, call it a 'catch'
+			//DEBUG_PRINT("Bottom of ball: %f\n", ball->y() + ball->height());
+			//DEBUG_PRINT("Top of robot: %f\n", robot->y());
+			if (ball->y() + ball->height()/2 - robot->y()/2 < m_state->config.get(PARAM_CATCH_TOLERANCE))
+			{
+				DEBUG_PRINT("catch! %s (%f)\n", m_collision->a->name(), ball->y() + ball->height() - robot->y());
+				m_state->catches++;
+				m_caught = true;
+				UpdateCatchrateUI();
+			}
+		}
+		else if (who_collided(m_collision, ground, ball))
 		{
-			DEBUG_PRINT("catch! %s (%f)\n", m_collision->a->name(), ball->y() + ball->height() - robot->y());
-			m_catch++;
-			UpdateCatchrateUI();
+			ball->set_velocity_x(0);
+			ball->set_velocity_y(0);
+			ball->set_acceleration_y(0);
 		}
+		else
+			continue;
+
+		// a ball that has landed is out of play, and must not keep colliding
+		ball->set_collidable(false);
+		m_landed[i] = true;
+		m_num_landed++;
+		break;
 	}
-	else if (who_collided(m_collision, ground, ball))
-	{
-		ball->set_velocity_x(0);
-		ball->set_velocity_y(0);
-		ball->set_acceleration_y(0);
-	}
-	m_state->sim_running = SIM_STATE_PAUSED;
+
+	// the trial is over when the last ball lands
+	if (m_num_landed == m_balls.size())
+		m_state->sim_running = SIM_STATE_PAUSED;
 }
 
 void CMySimulation::UpdateCatchrateUI()
 {
 	char message[100];
+	if (!m_state->ui_visible)
+		return;
 	if (m_s_catchrate)
 		SDL_FreeSurface(m_s_catchrate);
-	snprintf(message, 100, "Trials:%lu Caught:%lu", m_state->trials, m_catch);
+	if (m_state->num_balls > 1)
+		snprintf(message, 100, "Trials:%lu Balls:%lu Caught:%lu", m_state->trials, m_state->trials * m_state->num_balls, m_state->catches);
+	else
+		snprintf(message, 100, "Trials:%lu Caught:%lu", m_state->trials, m_state->catches);
 	m_s_catchrate = TTF_RenderText_Solid(m_fontSans, message, White);
 }
 
@@ -639,53 +836,136 @@ void CMySimulation::UpdateSensorUI(uint32_t i, uint64_t x_pos, uint64_t y_pos)
 	}
 }
 
-int CMySimulation::CreateInitialEnsemble()
+void CMySimulation::UpdateMetricsUI()
 {
-	DIR *d;
-	struct dirent *entry;
-	char *tmpname;
-	FILE *log;
-	uint64_t num_traces = 0;
-	uint64_t avg_length = 0;
-
-	printf("%s\n", __func__);
+	char message[100];
+	CHistogram *snapshot = new CHistogram[MAX_METRICS];
 
-	// load traces from the given directory
-	printf("Loading from %s\n", m_state->tracepath);
-	d = opendir(m_state->tracepath);
-	if (d)
+	metrics_snapshot(snapshot);
+	for (unsigned int i=0; i < MAX_METRICS; i++)
 	{
-		while ((entry = readdir(d)) != NULL)
+		if (m_s_metrics[i])
 		{
-			if (strncmp(entry->d_name, "trace", 5) == 0)
-			{
-				if (!asprintf(&tmpname, "%s/%s", m_state->tracepath, entry->d_name))
-					break;
-				//printf("%s: ", tmpname);
-				log = fopen(tmpname, "r");
-				CInteraction *interaction = new CInteraction(m_scale);
-				interaction->Load(log);
-				fclose(log);
-				m_primitive->add_demonstration(interaction);
-				num_traces++;
-
-				// for now, stop reading after we have enough members. Later, update this to sample members at random
-				if (num_traces == NUM_ENSEMBLE_MEMBERS)
-					break;
-			}
+			SDL_FreeSurface(m_s_metrics[i]);
+			m_s_metrics[i] = NULL;
 		}
-		closedir(d);
+
+		snprintf(message, 100, "%s p50:%.0fus p99:%.0fus max:%.0fus", metrics_name(i),
+			snapshot[i].percentile(50) / 1000.0, snapshot[i].percentile(99) / 1000.0, snapshot[i].max() / 1000.0);
+		m_s_metrics[i] = TTF_RenderText_Solid(m_fontSans, message, White);
 	}
+	delete[] snapshot;
+
+	m_metrics_refreshed = metrics_now_ns();
+}
+
+int CMySimulation::CreateInitialEnsemble()
+{
+	printf("%s\n", __func__);
 
-	if (num_traces < NUM_ENSEMBLE_MEMBERS)
+	m_library = CDemoLibrary::Acquire(m_state->tracepath, m_scale, m_state->library_size, m_state->selection,
+		m_state->snapshot_filename);
+	if (!m_library->size())
 	{
-		printf("ERROR: not enough trials for %u ensemble members\n", NUM_ENSEMBLE_MEMBERS);
+		printf("ERROR: no demonstrations in %s\n", m_state->tracepath);
 		return -1;
 	}
+	unsigned int members = m_state->config.get(PARAM_ENSEMBLE_MEMBERS);
+	if (m_library->size() < members)
+		printf("WARNING: only %u demonstrations for %u ensemble members, some will be repeated\n", m_library->size(), members);
+
+	// the estimator only holds the per-trial state, so creating one is cheap
+	m_primitive = CreateEstimator(m_state->filter, m_library, members, m_state->config.get(PARAM_LATENT_RANK));
+	m_primitive->set_gate(m_state->config.get(PARAM_GATE_THRESHOLD), m_state->config.get(PARAM_GATE_MAX_STALE));
 
 	return 0;
 }
 
+/*
+	A trial that caught the ball becomes a demonstration for the following ones, from the same sensor readings
+	a training trace would have recorded (in whole pixels, like the trace files). Only single ball trials are
+	learned from: the readings follow the first ball.
+*/
+void CMySimulation::LearnTrial()
+{
+	if (!m_state || !m_state->learn || m_state->training || !m_caught || m_balls.size() != 1 || !m_library ||
+		m_history.empty())
+		return;
+
+	std::vector<measurement> samples(m_history);
+	for (unsigned int i=0; i < samples.size(); i++)
+	{
+		samples[i].player = point((int64_t)samples[i].player.x, (int64_t)samples[i].player.y);
+		samples[i].robot = point((int64_t)samples[i].robot.x, (int64_t)samples[i].robot.y);
+		samples[i].ball = point((int64_t)samples[i].ball.x, (int64_t)samples[i].ball.y);
+	}
+
+	CInteraction *demonstration = new CInteraction(m_scale);
+	demonstration->set_samples(samples.data(), samples.size());
+	m_library->Add(demonstration);
+	m_state->learned++;
+	printf("Learned from trial %lu: %u demonstrations\n", m_state->trials, m_library->size());
+}
+
+void CMySimulation::RetrieveEnsemble()
+{
+	double features[NUM_FEATURES];
+
+	if (!launch_features(m_history.data(), m_history.size(), features))
+		return;
+
+	CMetricTimer timer(METRIC_RETRIEVAL);
+	CTimelineSpan span("RetrieveEnsemble");
+	m_retrieval_tried = true;
+	m_retrieved = m_primitive->retrieve_members(features);
+	if (m_retrieved)
+		printf("Launch vx=%f vy=%f angle=%f: ensemble rebuilt from the nearest demonstrations\n",
+			features[FEATURE_VEL_X], features[FEATURE_VEL_Y], features[FEATURE_ANGLE]);
+	else
+		printf("Launch vx=%f vy=%f angle=%f: nothing retrieved, keeping the prior ensemble\n",
+			features[FEATURE_VEL_X], features[FEATURE_VEL_Y], features[FEATURE_ANGLE]);
+}
+
+// Update the estimates for all of the balls in one batch, and steer towards the oldest ball still in the air
+void CMySimulation::UpdateTargets(uint64_t abs_ns, double robot_x)
+{
+	unsigned int num_targets = m_balls.size();
+	std::vector<double> samples(num_targets);
+	std::vector<double> sensors(num_targets * NUM_STATE_VARIABLES);
+	uint64_t x_pos, y_pos;
+	unsigned int target = 0;
+
+	for (unsigned int t=0; t < num_targets; t++)
+	{
+		// line each ball up with the demonstrations, where the ball is thrown TIME_BEFORE_BALL into the trace
+		uint64_t offset = m_throw_time[t] - TIME_BEFORE_BALL;
+		samples[t] = (abs_ns > offset) ? ((double)(abs_ns - offset) / 1000000000) * (double)SENSOR_FREQUENCY : 0;
+
+		sensor_read_pos(m_balls[t], &x_pos, &y_pos);
+		sensors[t * NUM_STATE_VARIABLES + STATE_VAR_BALL_X] = x_pos;
+		sensors[t * NUM_STATE_VARIABLES + STATE_VAR_BALL_Y] = y_pos;
+		sensors[t * NUM_STATE_VARIABLES + STATE_VAR_ROBOT_X] = robot_x;
+	}
+
+	{
+		CMetricTimer timer(METRIC_ESTIMATE_STATE);
+		CTimelineSpan span("estimate_state");
+		m_multi->estimate_state(samples.data(), sensors.data(), m_target_est.data());
+	}
+
+	for (unsigned int t=0; t < num_targets; t++)
+	{
+		if (abs_ns >= m_throw_time[t] && !m_landed[t])
+		{
+			target = t;
+			break;
+		}
+	}
+
+	for (unsigned int i=0; i < NUM_STATE_VARIABLES; i++)
+		m_est_state[i] = m_target_est[target * NUM_STATE_VARIABLES + i];
+}
+
 // Motion update step
 // Rather than multiplying by the A matrix, just read the next set of values at this phase
 void CMySimulation::UpdateEnsemble(uint64_t abs_ns, uint64_t elapsed_ns)
@@ -717,6 +997,12 @@ void CMySimulation::UpdateEnsemble(uint64_t abs_ns, uint64_t elapsed_ns)
 	sensors[STATE_VAR_BALL_X] = x_pos;
 	sensors[STATE_VAR_BALL_Y] = y_pos;
 
+	if (m_multi)
+	{
+		UpdateTargets(abs_ns, sensors[STATE_VAR_ROBOT_X]);
+		return;
+	}
+
 	// set random noise
 /*
 	int i,j;
@@ -729,9 +1015,17 @@ void CMySimulation::UpdateEnsemble(uint64_t abs_ns, uint64_t elapsed_ns)
 		}
 	}
 */
+	// as soon as the launch can be measured, switch to the demonstrations of similar throws
+	if (m_state->retrieval && !m_retrieval_tried)
+		RetrieveEnsemble();
+
 	double sample = ((double)abs_ns / 1000000000) * (double)SENSOR_FREQUENCY;
 	printf("sample: %f\n", sample);
-	m_primitive->estimate_state(sample, sensors, NULL, m_est_state);
+	{
+		CMetricTimer timer(METRIC_ESTIMATE_STATE);
+		CTimelineSpan span("estimate_state");
+		m_primitive->estimate_state(sample, sensors, m_est_state);
+	}
 	//m_primitive->get_mean_trajectory(0, 1, NUM_SAMPLES_TRAJECTORY, m_avg_trajectory);
 
 
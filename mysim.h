@@ -4,11 +4,15 @@
 #include "simulation.h"
 #include "interaction.h"
 #include "bip.h"
+#include "metrics.h"
+#include "multitarget.h"
 
 #define HZ_TO_NS(_hz)				(1000000000UL/_hz)
 #define SECONDS_TO_NS(_n)			(1000000000UL * _n)
 #define MS_TO_NS(_n)			      (1000000UL * _n)
 
+// The defaults of the scenario (see scenario.h). The demonstrations are sampled at SENSOR_FREQUENCY whatever
+// rate the sensors are read at, so sample numbers (the time base of the estimators) always count its periods.
 #define GRAVITY 						9.81
 #define SENSOR_FREQUENCY			60
 #define MIN_BALL_VELOCITY			10
@@ -20,6 +24,14 @@
 #define TIME_COLLISIONS_VISIBLE	SECONDS_TO_NS(1)
 #define TIME_BEFORE_EGG				SECONDS_TO_NS(3)
 #define TIME_BEFORE_BALL			SECONDS_TO_NS(2)
+#define TIME_BETWEEN_BALLS			MS_TO_NS(400)
+
+// event ids carry the event type in the low byte, and the object it applies to above that
+#define EVENT_ID(_type, _index)	((_type) | ((uint64_t)(_index) << 8))
+#define EVENT_TYPE(_id)				((_id) & 0xFF)
+#define EVENT_INDEX(_id)			((_id) >> 8)
+
+#define COLLISION_GROUP_BALLS		1
 
 enum
 {
@@ -43,21 +55,28 @@ public:
 	bool Initialize(program_state *state, uint32_t w, uint32_t h);
 	void Draw(SDL_Renderer* renderer);
 	uint64_t UpdateSimulation(uint64_t abs_ns, uint64_t elapsed_ns);
+	uint64_t NextEventTime(uint64_t abs_ns);
 	void DropEgg();
-	void ThrowBall();
+	void ThrowBall(unsigned int index);
 	void RobotMove(uint64_t direction);
 	static void event_handler(CSimulation *s, uint64_t id, uint64_t timestamp);
 	bool sensor_read_pos(sim_object *obj, uint64_t *x, uint64_t *y);
 	void HandleEvent(SDL_Event *event);
 	void OnCollision(uint64_t abs_ns, sim_object *a, sim_object *b);
+	void Reconfigure(); // takes up the scenario again, in the middle of a trial
+	static bool Reconfigurable(unsigned int param);
 
 protected:
 	bool AddSensor(uint64_t index, sim_object *s);
 	void UpdateCatchrateUI();
 	void UpdateSensorUI(uint32_t i, uint64_t x_pos, uint64_t y_pos);
+	void UpdateMetricsUI();
 
 	int CreateInitialEnsemble();
 	void UpdateEnsemble(uint64_t abs_ns, uint64_t elapsed_ns);
+	void RetrieveEnsemble();
+	void UpdateTargets(uint64_t abs_ns, double robot_x);
+	void LearnTrial();
 
 private:
 	sim_object *ground;
@@ -65,27 +84,41 @@ private:
 	sim_object *bird;
 	sim_object *egg;
 	sim_object *player;
-	sim_object *ball;
+	sim_object *ball; // the first of m_balls
+	std::vector<sim_object*> m_balls;
+	std::vector<uint64_t> m_throw_time; // when each ball is thrown
+	std::vector<bool> m_landed; // has each ball hit the robot or the ground
+	bool m_caught; // has a ball been caught in this trial
+	unsigned int m_num_landed;
 	TTF_Font* m_fontSans;
 	sim_collision *m_collision;
 	sim_object *m_sensors[MAX_SENSORS]; // dynamic array of sensors to read
 	uint64_t m_num_sensors; // how many elements in the m_sensors array
 	uint64_t m_sensor_elapsed; // time elapsed since the last sensor reading
 	uint64_t m_sensor_delay; // how long to wait (ns) between sensor readings
-	uint64_t m_catch;
+	uint64_t m_sensor_reads; // sensor readings so far in this trial (numbers the sensor noise streams)
 	uint64_t m_trials;
 	FILE *m_tracefile; // log of sensor readings in CSV format
+	std::vector<measurement> m_history; // every sensor reading of this trial
+	bool m_retrieved; // has the ensemble been rebuilt from the nearest demonstrations yet
+	bool m_retrieval_tried; // once the launch is seen: a failed retrieval would fail again
 	bool m_display_sensors; // should we display the sensor readings on-screen
+	bool m_display_metrics; // should we display the latency overlay on-screen
+	uint64_t m_metrics_refreshed; // when (wall clock ns) the latency overlay was last regenerated
 
 	SDL_Surface* m_s_sensors[MAX_SENSORS]; // ui objects containing sensor text
 	SDL_Surface* m_s_catchrate;
 	SDL_Surface* m_s_training; // message if we are in training mode
+	SDL_Surface* m_s_metrics[MAX_METRICS]; // latency overlay, one line per metric
 
 	double m_sensorNoise[NUM_STATE_VARIABLES * NUM_STATE_VARIABLES];
 	double m_est_state[NUM_STATE_VARIABLES];
 	double m_predicted_state[NUM_STATE_VARIABLES];
-	BIP *m_primitive;
-	double *m_avg_trajectory;
+	CDemoLibrary *m_library; // shared between trials
+	CEstimator *m_primitive; // selected with --filter
+	CMultiTargetBIP *m_multi; // used instead of m_primitive when there is more than one ball
+	std::vector<double> m_target_est; // estimated state for each ball (T x D)
+	double *m_avg_trajectory; // owned by m_library
 };
 
 
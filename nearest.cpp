@@ -0,0 +1,56 @@
+#include <algorithm>
+#include "nearest.h"
+
+CNearestDemonstration::CNearestDemonstration(CDemoLibrary *library) : m_library(library),
+		m_demos(library->interactions().begin(), library->interactions().end())
+{
+	m_library->AddRef();
+	m_cost.assign(m_demos.size(), 0);
+}
+
+CNearestDemonstration::~CNearestDemonstration()
+{
+	m_library->Release();
+}
+
+void CNearestDemonstration::create_initial_ensemble()
+{
+	std::fill(m_cost.begin(), m_cost.end(), 0);
+}
+
+size_t CNearestDemonstration::memory_usage()
+{
+	return sizeof(*this) + m_demos.capacity() * sizeof(CInteraction*) + m_cost.capacity() * sizeof(double);
+}
+
+void CNearestDemonstration::estimate_state(double sample, double *sensors, double *predictedState)
+{
+	double values[NUM_STATE_VARIABLES];
+	unsigned int nearest = 0;
+
+	m_tick++;
+
+	for (unsigned int d=0; d < NUM_STATE_VARIABLES; d++)
+		predictedState[d] = 0;
+	if (m_demos.empty())
+		return;
+
+	// each demonstration is played back at its own speed
+	for (unsigned int i=0; i < m_demos.size(); i++)
+	{
+		double phase = std::min(1.0, sample / (double)m_demos[i]->length());
+		m_demos[i]->get_sample(phase, values);
+
+		double dx = sensors[STATE_VAR_BALL_X] - values[STATE_VAR_BALL_X];
+		double dy = sensors[STATE_VAR_BALL_Y] - values[STATE_VAR_BALL_Y];
+		m_cost[i] += dx * dx + dy * dy;
+		if (m_cost[i] < m_cost[nearest])
+			nearest = i;
+	}
+
+	double phase = std::min(1.0, sample / (double)m_demos[nearest]->length());
+	m_demos[nearest]->get_sample(phase, predictedState);
+
+	if (m_verbose)
+		printf("nearest demonstration: %u (cost %f)\n", nearest, m_cost[nearest]);
+}
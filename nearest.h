@@ -0,0 +1,29 @@
+#ifndef _NEAREST__H
+#define _NEAREST__H
+
+#include <vector>
+#include "estimator.h"
+
+/*
+	The simplest estimator: every demonstration in the library is replayed alongside the trial, and the state is
+	read from the one whose ball has been closest to the observed ball so far (least sum of squared distances
+	since the start of the trial). There is no ensemble and no correction, so an update is one lookup per
+	demonstration.
+*/
+class CNearestDemonstration : public CEstimator
+{
+public:
+	CNearestDemonstration(CDemoLibrary *library);
+	~CNearestDemonstration();
+
+	void create_initial_ensemble();
+	void estimate_state(double sample, double *sensors, double *predictedState);
+	size_t memory_usage();
+
+private:
+	CDemoLibrary *m_library; // shared demonstrations (holds a reference)
+	std::vector<CInteraction*> m_demos;
+	std::vector<double> m_cost; // accumulated squared distance, per demonstration
+};
+
+#endif // _NEAREST__H
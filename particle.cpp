@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include "particle.h"
+
+CParticleFilter::CParticleFilter(CDemoLibrary *library, unsigned int particles) : m_library(library), m_num_particles(particles),
+		m_demo(particles), m_phase_vel(particles), m_weight(particles), m_log_p(particles), m_p(particles),
+		m_predicted(NUM_STATE_VARIABLES * particles), m_copies(particles + 1),
+		m_next_demo(particles), m_next_phase_vel(particles), m_next_weight(particles)
+{
+	m_library->AddRef();
+}
+
+CParticleFilter::~CParticleFilter()
+{
+	m_library->Release();
+}
+
+size_t CParticleFilter::memory_usage()
+{
+	return sizeof(*this) + m_num_particles * (2 * sizeof(CInteraction*) + (6 + NUM_STATE_VARIABLES) * sizeof(double) + sizeof(int));
+}
+
+void CParticleFilter::create_initial_ensemble()
+{
+	const unsigned int N = m_num_particles;
+	CRandom members(RNG_BLOCK_MEMBERS, m_trial);
+	m_library->DrawMembers(m_demo.data(), N, members);
+	for (unsigned int i=0; i < N; i++)
+	{
+		m_phase_vel[i] = (double)1/(double)m_demo[i]->length();
+		m_weight[i] = 1;
+		m_log_p[i] = 0;
+	}
+}
+
+void CParticleFilter::estimate_state(double sample, double *sensors, double *predictedState)
+{
+	const unsigned int N = m_num_particles;
+	const double scale = -0.5 / (PARTICLE_OBSERVATION_STD * PARTICLE_OBSERVATION_STD);
+	double values[NUM_STATE_VARIABLES];
+	double highest = -DBL_MAX;
+	double total = 0;
+	double squares = 0;
+
+	m_tick++;
+
+	// where each particle puts the state now
+	for (unsigned int i=0; i < N; i++)
+	{
+		double phase = std::min(1.0, std::max(0.0, sample * m_phase_vel[i]));
+		m_demo[i]->get_sample(phase, values);
+		for (unsigned int d=0; d < NUM_STATE_VARIABLES; d++)
+			m_predicted[N * d + i] = values[d] * m_weight[i];
+	}
+
+	// weight by the likelihood of the observed ball position
+	for (unsigned int i=0; i < N; i++)
+	{
+		double dx = sensors[STATE_VAR_BALL_X] - m_predicted[N * STATE_VAR_BALL_X + i];
+		double dy = sensors[STATE_VAR_BALL_Y] - m_predicted[N * STATE_VAR_BALL_Y + i];
+		m_log_p[i] += (dx * dx + dy * dy) * scale;
+		highest = std::max(highest, m_log_p[i]);
+	}
+
+	// normalize (relative to the most likely particle, so exp() can't underflow for all of them)
+	for (unsigned int i=0; i < N; i++)
+	{
+		m_p[i] = exp(m_log_p[i] - highest);
+		total += m_p[i];
+	}
+	for (unsigned int i=0; i < N; i++)
+	{
+		m_p[i] /= total;
+		m_log_p[i] = log(m_p[i]);
+		squares += m_p[i] * m_p[i];
+	}
+
+	for (unsigned int d=0; d < NUM_STATE_VARIABLES; d++)
+	{
+		predictedState[d] = 0;
+		for (unsigned int i=0; i < N; i++)
+			predictedState[d] += m_p[i] * m_predicted[N * d + i];
+	}
+
+	// effective sample size
+	if (1.0 / squares < N / 2)
+		resample();
+
+	if (m_verbose)
+		printf("particles: effective size %.1f\n", 1.0 / squares);
+}
+
+/*
+	Systematic resampling: new particle j is a copy of the old particle whose cumulative probability range
+	contains (u + j) / N, for a single random u in [0, 1). Rather than walking both sequences together, the
+	number of new particles that fall before the end of each old particle's range is ceil(N * cdf - u), which
+	is computed independently for every particle.
+*/
+void CParticleFilter::resample()
+{
+	const unsigned int N = m_num_particles;
+	double u = CRandom(RNG_BLOCK_RESAMPLE, m_trial, m_tick).uniform();
+	double cdf = 0;
+
+	// m_p becomes the cumulative probability
+	for (unsigned int i=0; i < N; i++)
+	{
+		cdf += m_p[i];
+		m_p[i] = cdf;
+	}
+
+	m_copies[0] = 0;
+	for (unsigned int i=0; i < N; i++)
+		m_copies[i + 1] = std::min((int)N, std::max(0, (int)ceil(m_p[i] * N - u)));
+	m_copies[N] = N; // in case rounding left the total short
+
+	for (unsigned int i=0; i < N; i++)
+	{
+		for (int j=m_copies[i]; j < m_copies[i + 1]; j++)
+		{
+			m_next_demo[j] = m_demo[i];
+			m_next_phase_vel[j] = m_phase_vel[i];
+			m_next_weight[j] = m_weight[i];
+
+			// jitter the extra copies, so they can explore around the original
+			if (j > m_copies[i])
+			{
+				CRandom random(RNG_BLOCK_ROUGHENING, m_trial, m_tick, j);
+				m_next_phase_vel[j] *= 1 + random.noise(PARTICLE_ROUGHENING);
+				m_next_weight[j] *= 1 + random.noise(PARTICLE_ROUGHENING);
+			}
+		}
+	}
+
+	for (unsigned int i=0; i < N; i++)
+	{
+		m_demo[i] = m_next_demo[i];
+		m_phase_vel[i] = m_next_phase_vel[i];
+		m_weight[i] = m_next_weight[i];
+		m_log_p[i] = 0;
+	}
+}
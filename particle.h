@@ -0,0 +1,48 @@
+#ifndef _PARTICLE__H
+#define _PARTICLE__H
+
+#include <vector>
+#include "estimator.h"
+
+#define PARTICLE_OBSERVATION_STD	10.0	// pixels, how far the ball may be from a demonstration that explains it
+#define PARTICLE_ROUGHENING		0.02	// relative jitter of the copies made when resampling
+
+/*
+	Particle filter over the demonstrations. Each particle replays one demonstration, at its own phase
+	velocity and with its own weight (as an ensemble member does), and is weighted by how well it explains the
+	observed ball position. The robot position is not used for weighting, since it is what we control.
+
+	When the weights degenerate (effective sample size below half the particles), the particles are
+	resampled systematically. The particle arrays are kept as separate columns so the per-particle loops
+	(prediction, weighting, and counting the copies of each particle) have no dependency between iterations.
+*/
+class CParticleFilter : public CEstimator
+{
+public:
+	CParticleFilter(CDemoLibrary *library, unsigned int particles = NUM_ENSEMBLE_MEMBERS);
+	~CParticleFilter();
+
+	void create_initial_ensemble();
+	void estimate_state(double sample, double *sensors, double *predictedState);
+	size_t memory_usage();
+
+private:
+	void resample();
+
+	CDemoLibrary *m_library; // shared demonstrations (holds a reference)
+	unsigned int m_num_particles; // N
+	std::vector<CInteraction*> m_demo;
+	std::vector<double> m_phase_vel;
+	std::vector<double> m_weight;		// scale applied to the demonstration (as ENSEMBLE_STATE_WEIGHT)
+	std::vector<double> m_log_p;		// log of the (unnormalized) particle probability
+	std::vector<double> m_p;			// normalized probability
+	std::vector<double> m_predicted;	// D x N
+	std::vector<int> m_copies;			// resampling: how many of the new particles come before each old one (N + 1)
+
+	// resampling scratch
+	std::vector<CInteraction*> m_next_demo;
+	std::vector<double> m_next_phase_vel;
+	std::vector<double> m_next_weight;
+};
+
+#endif // _PARTICLE__H
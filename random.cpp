@@ -0,0 +1,13 @@
+#include "random.h"
+
+static uint64_t seed;
+
+void random_seed(uint64_t s)
+{
+	seed = s;
+}
+
+uint64_t random_get_seed()
+{
+	return seed;
+}
@@ -0,0 +1,61 @@
+#ifndef _RANDOM__H
+#define _RANDOM__H
+
+#include <stdint.h>
+
+/*
+	Counter-based random numbers. A stream is identified by (seed, block, trial, tick, member), and the n-th
+	number of a stream is a hash of that key and n, so there is no generator state shared between callers:
+	ensemble members, targets and trials can be computed in any order, or on any number of threads, and
+	still see exactly the same numbers. 'block' keeps the different uses of randomness apart, so that for
+	example the perturbed observations of a member don't reuse the numbers that perturbed its prediction.
+
+	The seed is set once per process (--seed) before any stream is created.
+*/
+enum
+{
+	RNG_BLOCK_ENSEMBLE,		// initial ensemble
+	RNG_BLOCK_MEMBERS,		// which demonstration is behind each member
+	RNG_BLOCK_PREDICTION,	// perturbation of each member's prediction (hx)
+	RNG_BLOCK_OBSERVATION,	// perturbed observations of each member (EnKF)
+	RNG_BLOCK_OBSERVATION_NOISE, // the observation noise matrix R
+	RNG_BLOCK_RESAMPLE,		// particle filter: the offset of the systematic resampling
+	RNG_BLOCK_ROUGHENING,	// particle filter: jitter of each copied particle
+	RNG_BLOCK_LAUNCH,			// initial velocity of each ball
+	RNG_BLOCK_SENSOR,			// sensor noise
+	RNG_BLOCK_INDEX,			// reservoir sampling of the trace directory
+	RNG_BLOCK_INDEX_DRAW,	// drawing traces from the index
+	RNG_BLOCK_SWEEP,			// configurations of a random sweep design
+};
+
+void random_seed(uint64_t seed);
+uint64_t random_get_seed();
+
+// SplitMix64 finalizer
+static inline uint64_t random_mix(uint64_t z)
+{
+	z += 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+class CRandom
+{
+public:
+	CRandom(unsigned int block, uint64_t trial=0, uint64_t tick=0, uint64_t member=0) : m_counter(0)
+	{
+		m_key = random_mix(random_mix(random_mix(random_mix(random_mix(random_get_seed()) ^ block) ^ trial) ^ tick) ^ member);
+	}
+
+	uint64_t next() { return random_mix(m_key + 0x9e3779b97f4a7c15ULL * m_counter++); }
+	double uniform() { return (double)(next() >> 11) * (1.0 / 9007199254740992.0); } // [0, 1)
+	double noise(double range) { return uniform() * range - range / 2; } // uniform in [-range/2, range/2)
+	uint64_t below(uint64_t n) { return next() % n; } // [0, n)
+
+private:
+	uint64_t m_key;
+	uint64_t m_counter; // numbers drawn from this stream so far
+};
+
+#endif // _RANDOM__H
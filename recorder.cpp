@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "recorder.h"
+
+static const char *format_names[MAX_RECORD_FORMATS] = { "bmp", "y4m" };
+static const char *selection_names[MAX_RECORD_SELECTIONS] = { "all", "misses", "catches" };
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+// 24 bits per pixel, bottom row first, every row padded to 4 bytes
+static bool write_bmp(const char *filename, const uint32_t *pixels, unsigned int width, unsigned int height)
+{
+	unsigned int stride = (width * 3 + 3) & ~3u;
+	uint8_t header[54];
+	std::vector<uint8_t> row(stride, 0);
+
+	FILE *f = fopen(filename, "wb");
+	if (!f)
+		return false;
+
+	memset(header, 0, sizeof(header));
+	header[0] = 'B';
+	header[1] = 'M';
+	put32(header + 2, sizeof(header) + stride * height);
+	put32(header + 10, sizeof(header));
+	put32(header + 14, 40);
+	put32(header + 18, width);
+	put32(header + 22, height);
+	put16(header + 26, 1);
+	put16(header + 28, 24);
+	put32(header + 34, stride * height);
+	fwrite(header, sizeof(header), 1, f);
+
+	for (int y=height-1; y >= 0; y--)
+	{
+		const uint32_t *p = pixels + y * width;
+		for (unsigned int x=0; x < width; x++)
+		{
+			row[x * 3] = p[x];
+			row[x * 3 + 1] = p[x] >> 8;
+			row[x * 3 + 2] = p[x] >> 16;
+		}
+		fwrite(row.data(), stride, 1, f);
+	}
+	return fclose(f) == 0;
+}
+
+/*
+	ARGB to planar YUV 4:2:0 with the full range coefficients of JPEG (BT.601), which is what C420jpeg means to
+	the readers of Y4M. The chroma of each 2 x 2 block is the chroma of its mean colour. Fixed point, 16 bits.
+*/
+static void argb_to_yuv420(const uint32_t *pixels, unsigned int width, unsigned int height, uint8_t *yuv)
+{
+	uint8_t *Y = yuv;
+	uint8_t *U = Y + width * height;
+	uint8_t *V = U + width * height / 4;
+
+	for (unsigned int y=0; y < height; y++)
+	{
+		const uint32_t *p = pixels + y * width;
+		for (unsigned int x=0; x < width; x++)
+		{
+			int r = (p[x] >> 16) & 0xFF, g = (p[x] >> 8) & 0xFF, b = p[x] & 0xFF;
+			Y[y * width + x] = (19595 * r + 38470 * g + 7471 * b + 32768) >> 16;
+		}
+	}
+
+	for (unsigned int y=0; y < height; y += 2)
+	{
+		const uint32_t *p = pixels + y * width;
+		for (unsigned int x=0; x < width; x += 2)
+		{
+			int r = 0, g = 0, b = 0;
+			const uint32_t block[4] = { p[x], p[x + 1], p[x + width], p[x + width + 1] };
+			for (unsigned int i=0; i < 4; i++)
+			{
+				r += (block[i] >> 16) & 0xFF;
+				g += (block[i] >> 8) & 0xFF;
+				b += block[i] & 0xFF;
+			}
+			// the sums are 4 x the mean: the shift takes 2 more bits
+			unsigned int c = (y / 2) * (width / 2) + x / 2;
+			U[c] = (-11059 * r - 21709 * g + 32768 * b + (128 << 18) + (1 << 17)) >> 18;
+			V[c] = (32768 * r - 27439 * g - 5329 * b + (128 << 18) + (1 << 17)) >> 18;
+		}
+	}
+}
+
+CRecorder::CRecorder() : m_path(NULL), m_surface(NULL), m_renderer(NULL), m_recording(false), m_dropped(0),
+	m_stop(false), m_file(NULL), m_part(NULL), m_final(NULL), m_frames(0)
+{
+}
+
+CRecorder::~CRecorder()
+{
+	// a trial cut short is only complete enough for a recording of all of them
+	if (m_recording)
+	{
+		record_item item = { ITEM_END, 0, 0, 0, m_selection == RECORD_ALL };
+		Submit(item);
+		m_recording = false;
+	}
+
+	if (m_encoder.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_stop = true;
+		}
+		m_ready.notify_one();
+		m_encoder.join();
+	}
+
+	if (m_renderer)
+		SDL_DestroyRenderer(m_renderer);
+	if (m_surface)
+		SDL_FreeSurface(m_surface);
+	free(m_path);
+}
+
+int CRecorder::find_format(const char *name)
+{
+	for (unsigned int f=0; f < MAX_RECORD_FORMATS; f++)
+		if (strcmp(name, format_names[f]) == 0)
+			return f;
+	return -1;
+}
+
+int CRecorder::find_selection(const char *name)
+{
+	for (unsigned int s=0; s < MAX_RECORD_SELECTIONS; s++)
+		if (strcmp(name, selection_names[s]) == 0)
+			return s;
+	return -1;
+}
+
+// the simulation is drawn in its own coordinates (w x h), and scaled to the recording
+bool CRecorder::Start(const char *path, unsigned int format, unsigned int width, unsigned int height,
+	unsigned int fps, unsigned int selection, unsigned int w, unsigned int h, bool wait_for_encoder)
+{
+	if (!width || !height || !fps || (width | height) & 1)
+	{
+		printf("Can't record %ux%u at %u frames per second: the size must be even\n", width, height, fps);
+		return false;
+	}
+	if (mkdir(path, 0755) != 0 && errno != EEXIST)
+	{
+		printf("Can't create the recording directory %s\n", path);
+		return false;
+	}
+
+	m_surface = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ARGB8888);
+	if (m_surface)
+		m_renderer = SDL_CreateSoftwareRenderer(m_surface);
+	if (!m_renderer)
+	{
+		printf("Can't create the offscreen surface: %s\n", SDL_GetError());
+		return false;
+	}
+	SDL_RenderSetLogicalSize(m_renderer, w, h);
+
+	m_path = strdup(path);
+	m_format = format;
+	m_width = width;
+	m_height = height;
+	m_period = 1000000000UL / fps;
+	m_selection = selection;
+	m_wait = wait_for_encoder;
+
+	m_pool.resize((size_t)RECORD_POOL_FRAMES * width * height);
+	for (unsigned int i=0; i < RECORD_POOL_FRAMES; i++)
+		m_free.push_back(i);
+	m_planes.resize(width * height * 3 / 2);
+	m_encoder = std::thread(&CRecorder::Encode, this);
+
+	printf("Recording %s trials to %s: %s, %ux%u at %u frames per second\n", selection_names[selection], path,
+		format_names[format], width, height, fps);
+	return true;
+}
+
+void CRecorder::Submit(const record_item &item)
+{
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_queue.push_back(item);
+	}
+	m_ready.notify_one();
+}
+
+void CRecorder::BeginTrial(uint64_t trial)
+{
+	if (!m_renderer)
+		return;
+
+	record_item item = { ITEM_BEGIN, 0, 0, trial, false };
+	Submit(item);
+	m_recording = true;
+	m_next_frame = 0;
+	m_dropped = 0;
+}
+
+void CRecorder::Update(CSimulation *sim, uint64_t abs_ns)
+{
+	unsigned int repeat = 0;
+	unsigned int frame;
+
+	if (!m_recording)
+		return;
+
+	while (m_next_frame <= abs_ns)
+	{
+		m_next_frame += m_period;
+		repeat++;
+	}
+	if (!repeat)
+		return;
+
+	// no buffer means the encoder is behind: don't even draw
+	{
+		std::unique_lock<std::mutex> guard(m_lock);
+		if (m_wait)
+			m_returned.wait(guard, [this]() { return !m_free.empty(); });
+		if (m_free.empty())
+		{
+			m_dropped += repeat;
+			return;
+		}
+		frame = m_free.back();
+		m_free.pop_back();
+	}
+
+	sim->Draw(m_renderer);
+	SDL_RenderPresent(m_renderer);
+
+	uint32_t *pixels = &m_pool[(size_t)frame * m_width * m_height];
+	SDL_LockSurface(m_surface);
+	for (unsigned int y=0; y < m_height; y++)
+		memcpy(pixels + y * m_width, (uint8_t*)m_surface->pixels + y * m_surface->pitch, m_width * sizeof(uint32_t));
+	SDL_UnlockSurface(m_surface);
+
+	record_item item = { ITEM_FRAME, frame, repeat, 0, false };
+	Submit(item);
+}
+
+void CRecorder::EndTrial(bool caught)
+{
+	if (!m_recording)
+		return;
+
+	bool keep = m_selection == RECORD_ALL || (m_selection == RECORD_MISSES && !caught) ||
+		(m_selection == RECORD_CATCHES && caught);
+	record_item item = { ITEM_END, 0, 0, 0, keep };
+	Submit(item);
+	m_recording = false;
+	if (m_dropped)
+		printf("Recording: %lu frames dropped (the encoder is behind)\n", m_dropped);
+}
+
+void CRecorder::Encode()
+{
+	std::unique_lock<std::mutex> guard(m_lock);
+	while (1)
+	{
+		m_ready.wait(guard, [this]() { return m_stop || !m_queue.empty(); });
+		if (m_queue.empty())
+			break;
+
+		record_item item = m_queue.front();
+		m_queue.pop_front();
+		guard.unlock();
+
+		switch (item.kind)
+		{
+		case ITEM_BEGIN:
+			OpenTrial(item.trial);
+			break;
+		case ITEM_FRAME:
+			WriteFrame(&m_pool[(size_t)item.frame * m_width * m_height], item.repeat);
+			break;
+		case ITEM_END:
+			CloseTrial(item.keep);
+			break;
+		}
+
+		guard.lock();
+		if (item.kind == ITEM_FRAME)
+		{
+			m_free.push_back(item.frame);
+			m_returned.notify_one();
+		}
+	}
+}
+
+void CRecorder::OpenTrial(uint64_t trial)
+{
+	const char *suffix = (m_format == RECORD_Y4M) ? ".y4m" : "";
+
+	m_frames = 0;
+	m_part = m_final = NULL;
+	if (asprintf(&m_final, "%s/trial%05lu%s", m_path, trial, suffix) < 0)
+	{
+		m_final = NULL;
+		return;
+	}
+	if (asprintf(&m_part, "%s.part", m_final) < 0)
+	{
+		m_part = NULL;
+		return;
+	}
+
+	if (m_format == RECORD_Y4M)
+	{
+		m_file = fopen(m_part, "wb");
+		if (m_file)
+			fprintf(m_file, "YUV4MPEG2 W%u H%u F%lu:1 Ip A1:1 C420jpeg\n", m_width, m_height, 1000000000UL / m_period);
+	}
+	if ((m_format == RECORD_Y4M && !m_file) || (m_format == RECORD_BMP && mkdir(m_part, 0755) != 0))
+	{
+		printf("Can't record to %s\n", m_part);
+		free(m_part);
+		m_part = NULL;
+	}
+}
+
+void CRecorder::WriteFrame(const uint32_t *pixels, unsigned int repeat)
+{
+	if (!m_part)
+		return;
+
+	if (m_format == RECORD_Y4M)
+	{
+		argb_to_yuv420(pixels, m_width, m_height, m_planes.data());
+		for (unsigned int i=0; i < repeat; i++, m_frames++)
+		{
+			fputs("FRAME\n", m_file);
+			fwrite(m_planes.data(), m_planes.size(), 1, m_file);
+		}
+		return;
+	}
+
+	for (unsigned int i=0; i < repeat; i++, m_frames++)
+	{
+		char *name;
+		if (asprintf(&name, "%s/frame%06u.bmp", m_part, m_frames) < 0)
+			return;
+		if (!write_bmp(name, pixels, m_width, m_height))
+			printf("Error writing %s\n", name);
+		free(name);
+	}
+}
+
+void CRecorder::CloseTrial(bool keep)
+{
+	if (m_part)
+	{
+		if (m_file)
+			fclose(m_file);
+		m_file = NULL;
+
+		if (keep && rename(m_part, m_final) == 0)
+			printf("Recorded %u frames to %s\n", m_frames, m_final);
+		else if (keep)
+			printf("Can't rename %s to %s\n", m_part, m_final);
+		else if (m_format == RECORD_Y4M)
+			unlink(m_part);
+		else
+		{
+			for (unsigned int i=0; i < m_frames; i++)
+			{
+				char *name;
+				if (asprintf(&name, "%s/frame%06u.bmp", m_part, i) >= 0)
+				{
+					unlink(name);
+					free(name);
+				}
+			}
+			rmdir(m_part);
+		}
+	}
+
+	free(m_part);
+	free(m_final);
+	m_part = m_final = NULL;
+}
@@ -0,0 +1,114 @@
+#ifndef _RECORDER__H
+#define _RECORDER__H
+
+#include <SDL2/SDL.h>
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include "simulation.h"
+
+#define RECORD_POOL_FRAMES		16		// frames waiting for the encoder at most: more than that are dropped
+#define RECORD_DEFAULT_WIDTH	640
+#define RECORD_DEFAULT_HEIGHT	360
+#define RECORD_DEFAULT_FPS		30
+
+// what is written
+enum
+{
+	RECORD_BMP,		// one directory of numbered BMP images per trial
+	RECORD_Y4M,		// one raw YUV 4:2:0 video per trial (ffmpeg and most players read it)
+	MAX_RECORD_FORMATS
+};
+
+// which trials are kept
+enum
+{
+	RECORD_ALL,
+	RECORD_MISSES,		// the trials that didn't catch every ball
+	RECORD_CATCHES,
+	MAX_RECORD_SELECTIONS
+};
+
+/*
+	Records trials to files, with or without a window. The simulation is drawn (CSimulation::Draw) to an
+	offscreen surface of its own, scaled to the size of the recording, at a fixed rate of simulated time:
+	after every step, the frames that fell inside it are all the same picture of the state at its end. So the
+	headless runs, which jump from one event to the next, are recorded at the same rate as the others, and
+	recording doesn't change a single step of the simulation.
+
+	Each frame is copied to a buffer from a pool and queued for the encoder thread, which does all the
+	conversion and writing. When the pool is empty the frame is dropped (and counted) instead: a simulation
+	that keeps up with the wall clock never waits for the disk. A headless run has no clock to keep up with,
+	and would otherwise drop most of its frames, so it waits for a buffer instead (wait_for_encoder): what
+	happens in a trial doesn't depend on how long its steps take.
+
+	A trial is written to a temporary name (.part) while it runs, since only its end tells whether it is one of
+	the selected trials. The encoder then renames it, or deletes it.
+*/
+class CRecorder
+{
+public:
+	CRecorder();
+	~CRecorder(); // finishes writing whatever is queued
+
+	bool Start(const char *path, unsigned int format, unsigned int width, unsigned int height, unsigned int fps,
+		unsigned int selection, unsigned int w, unsigned int h, bool wait_for_encoder); // w x h: the simulation
+	void BeginTrial(uint64_t trial);
+	void Update(CSimulation *sim, uint64_t abs_ns); // after every step: draws the frames that are due
+	void EndTrial(bool caught);
+
+	static int find_format(const char *name);
+	static int find_selection(const char *name);
+
+private:
+	enum { ITEM_BEGIN, ITEM_FRAME, ITEM_END };
+	struct record_item
+	{
+		unsigned int kind;
+		unsigned int frame;	// buffer in the pool
+		unsigned int repeat;	// times the frame is written
+		uint64_t trial;
+		bool keep;
+	};
+
+	void Encode();
+	void Submit(const record_item &item);
+	void OpenTrial(uint64_t trial);
+	void WriteFrame(const uint32_t *pixels, unsigned int repeat);
+	void CloseTrial(bool keep);
+
+	char *m_path;
+	unsigned int m_format;
+	unsigned int m_width;
+	unsigned int m_height;
+	uint64_t m_period;			// ns of simulated time per frame
+	unsigned int m_selection;
+
+	SDL_Surface *m_surface;		// ARGB8888, drawn by m_renderer
+	SDL_Renderer *m_renderer;
+	uint64_t m_next_frame;		// ns, simulated time of the next frame
+	bool m_recording;			// inside a trial
+	uint64_t m_dropped;			// frames of this trial, when the pool was empty
+	bool m_wait;					// for a buffer, rather than drop the frame
+
+	std::vector<uint32_t> m_pool;		// RECORD_POOL_FRAMES frames of m_width x m_height
+	std::vector<unsigned int> m_free;	// buffers the simulation can fill
+	std::deque<record_item> m_queue;	// for the encoder, in order
+	std::mutex m_lock;
+	std::condition_variable m_ready;		// something is queued
+	std::condition_variable m_returned;	// a buffer is free again
+	bool m_stop;
+	std::thread m_encoder;
+
+	// the encoder's own
+	FILE *m_file;				// the video, in Y4M
+	char *m_part;				// name of the trial while it is written
+	char *m_final;				// and once it is kept
+	unsigned int m_frames;
+	std::vector<uint8_t> m_planes;	// Y, U and V of one frame
+};
+
+#endif // _RECORDER__H
@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "scenario.h"
+#include "mysim.h"
+
+struct param_info
+{
+	const char *name;
+	double def;
+	double min;
+	double max;
+	bool integer;
+};
+
+// the EnKF divides by (members - 1), so an ensemble needs two members at least
+static const param_info params[MAX_PARAMS] =
+{
+	{"min_ball_velocity",	MIN_BALL_VELOCITY,		0,		1000,		false},
+	{"max_ball_velocity",	MAX_BALL_VELOCITY,		0,		1000,		false},
+	{"robot_velocity",		ROBOT_VELOCITY,			0,		1000,		false},
+	{"sensor_frequency",		SENSOR_FREQUENCY,			1,		10000,	true},
+	{"catch_tolerance",		CATCH_TOLERANCE,			-1000,	1000,		false},
+	{"ensemble_members",		NUM_ENSEMBLE_MEMBERS,	2,		100000,	true},
+	{"gate_threshold",		GATE_THRESHOLD,			0,		1000,		false},
+	{"gate_max_stale",		GATE_MAX_STALE,			0,		100000,	true},
+	{"latent_rank",			LATENT_RANK,				0,		MAX_LATENT_FUNCTIONS,	true},
+};
+
+const char* param_name(unsigned int param)
+{
+	if (param >= MAX_PARAMS)
+		return "unknown";
+	return params[param].name;
+}
+
+int param_find(const char *name, size_t len)
+{
+	for (unsigned int p=0; p < MAX_PARAMS; p++)
+		if (strlen(params[p].name) == len && strncmp(name, params[p].name, len) == 0)
+			return p;
+	return -1;
+}
+
+bool param_integer(unsigned int param)
+{
+	return params[param].integer;
+}
+
+scenario::scenario()
+{
+	for (unsigned int p=0; p < MAX_PARAMS; p++)
+		m_value[p] = params[p].def;
+}
+
+bool scenario::set(unsigned int param, double value)
+{
+	if (param >= MAX_PARAMS || !(value >= params[param].min && value <= params[param].max))
+		return false;
+	if (params[param].integer && value != floor(value))
+		return false;
+	m_value[param] = value;
+	return true;
+}
+
+bool scenario::parse(const char *spec)
+{
+	const char *s = spec;
+
+	while (*s)
+	{
+		const char *eq = strchr(s, '=');
+		const char *end = strchr(s, ',');
+		if (!end)
+			end = s + strlen(s);
+
+		int param = (eq && eq < end) ? param_find(s, eq - s) : -1;
+		if (param < 0)
+		{
+			printf("Unknown scenario parameter '%.*s'\n", (int)(end - s), s);
+			return false;
+		}
+
+		char *stop;
+		double value = strtod(eq + 1, &stop);
+		if (stop == eq + 1 || stop != end || !set(param, value))
+		{
+			printf("Bad value for %s: '%.*s'\n", params[param].name, (int)(end - eq - 1), eq + 1);
+			return false;
+		}
+
+		s = *end ? end + 1 : end;
+	}
+
+	return true;
+}
+
+void scenario::print(FILE *f) const
+{
+	for (unsigned int p=0; p < MAX_PARAMS; p++)
+		fprintf(f, "%s%s=%g", p ? "," : "", params[p].name, m_value[p]);
+}
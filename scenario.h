@@ -0,0 +1,45 @@
+#ifndef _SCENARIO__H
+#define _SCENARIO__H
+
+#include <stdio.h>
+
+/*
+	The settings of a trial that can be changed without rebuilding: how hard the ball is thrown, how fast the
+	robot moves, how often the sensors are read, what counts as a catch, the size of the ensemble, when the
+	estimator may skip a correction and whether it works in a latent space. The defaults are the compile-time
+	values in mysim.h, interaction.h and estimator.h. A scenario is given on the command line as name=value
+	pairs (--scenario), and the sweep driver (sweep.h) runs many of them.
+*/
+enum
+{
+	PARAM_MIN_BALL_VELOCITY,	// m/s, for each component of the launch velocity
+	PARAM_MAX_BALL_VELOCITY,	// m/s
+	PARAM_ROBOT_VELOCITY,		// m/s
+	PARAM_SENSOR_FREQUENCY,		// Hz
+	PARAM_CATCH_TOLERANCE,		// pixels
+	PARAM_ENSEMBLE_MEMBERS,		// ensemble members (or particles)
+	PARAM_GATE_THRESHOLD,		// innovation (Mahalanobis distance) below which the correction is skipped
+	PARAM_GATE_MAX_STALE,		// updates in a row the correction may be skipped
+	PARAM_LATENT_RANK,			// principal components the ensemble filters track (0: the demonstrations themselves)
+	MAX_PARAMS
+};
+
+const char* param_name(unsigned int param);
+int param_find(const char *name, size_t len); // -1 if there is no such parameter
+bool param_integer(unsigned int param); // only takes whole numbers
+
+class scenario
+{
+public:
+	scenario(); // the compile-time defaults
+
+	double get(unsigned int param) const { return m_value[param]; }
+	bool set(unsigned int param, double value); // false (and unchanged) if the value is out of range
+	bool parse(const char *spec); // name=value[,name=value...]
+	void print(FILE *f) const; // in the format parse() reads
+
+private:
+	double m_value[MAX_PARAMS];
+};
+
+#endif // _SCENARIO__H
@@ -1,8 +1,13 @@
+#include <math.h>
+#include <algorithm>
 #include "simulation.h"
+#include "metrics.h"
+#include "timeline.h"
 
 sim_object::sim_object(double x, double y, double scale) :
 		m_name(NULL), m_pos_x(x), m_pos_y(y), m_velocity_x(0), m_velocity_y(0), m_acceleration_x(0), m_acceleration_y(0), m_scale(scale),
-		m_tracerLength(0), m_width(1), m_height(1), m_tracer_elapsed_ns(0), m_max_velocity_x(100), m_max_velocity_y(100)
+		m_tracerLength(0), m_width(1), m_height(1), m_tracer_elapsed_ns(0), m_max_velocity_x(100), m_max_velocity_y(100),
+		m_collidable(true), m_collision_group(0)
 {
 }
 
@@ -52,15 +57,13 @@ void sim_object::Update(uint64_t elapsed_ns)
 			m_tracer_elapsed_ns += elapsed_ns;
 	}
 
-	// update velocity based on acceleration
-	m_velocity_y += (m_acceleration_y * elapsed_ns) / 1.0e9;
-
-	// update position based on velocity
-	double inc_x = (m_velocity_x * m_scale * elapsed_ns) / 1.0e9;
-	double inc_y = (m_velocity_y * m_scale * elapsed_ns) / 1.0e9;
-	//printf("X velocity: %.2f m/s, elapsed time: %.2f us, increment: %.5f\n", m_velocity_x, (double)elapsed_ns/1000, inc_x);
-	m_pos_x += inc_x;
-	m_pos_y += inc_y;
+	// the acceleration is constant over the step, so the motion is advanced in closed form and a step can be
+	// as long as we like without losing accuracy
+	double t = elapsed_ns / 1.0e9;
+	m_pos_x += (m_velocity_x + 0.5 * m_acceleration_x * t) * t * m_scale;
+	m_pos_y += (m_velocity_y + 0.5 * m_acceleration_y * t) * t * m_scale;
+	m_velocity_x += m_acceleration_x * t;
+	m_velocity_y += m_acceleration_y * t;
 	//printf("X: %f Y: %f\n", m_pos_x, m_pos_y);
 }
 
@@ -98,19 +101,46 @@ uint64_t CSimulation::UpdateSimulation(uint64_t abs_ns, uint64_t elapsed_ns)
 		sim_event *event = sim_events.front();
 		if (event->m_timestamp <= abs_ns)
 		{
+			CTimelineSpan span("event");
 			event->m_cb(this, event->m_id, abs_ns);
 			sim_events.pop_front();
 		}
 	}
 
-	// update the sim items
-	for (obj_list::iterator i = sim_objects.begin(); i != sim_objects.end(); i++)
+	// update the sim items, stopping at each contact inside the step. That way a fast object can't pass through
+	// another between two steps, and the collision is handled where and when it really happened, however long
+	// the step is.
+	uint64_t done = 0;
+	while (done < elapsed_ns)
 	{
-		(*i)->Update(elapsed_ns);
+		sim_object *a, *b;
+		uint64_t step;
+		bool contact;
+		{
+			CMetricTimer timer(METRIC_COLLISION);
+			CTimelineSpan span("FirstContact");
+			contact = FirstContact(elapsed_ns - done, &step, &a, &b);
+		}
+
+		for (obj_list::iterator i = sim_objects.begin(); i != sim_objects.end(); i++)
+		{
+			(*i)->Update(step);
+		}
+		done += step;
+
+		if (contact)
+		{
+			OnCollision(abs_ns - elapsed_ns + done, a, b);
+			printf("%s collided with %s\n", a->name(), b->name());
+		}
 	}
 
-	// check for new collisions
-	CheckForCollision(abs_ns);
+	// objects that already overlap don't come into contact, so check for those too
+	{
+		CMetricTimer timer(METRIC_COLLISION);
+		CTimelineSpan span("CheckForCollision");
+		CheckForCollision(abs_ns);
+	}
 
 	return OK;
 }
@@ -137,7 +167,7 @@ bool CSimulation::CheckForCollision(uint64_t abs_ns)
 	{
 		for (obj_list::iterator j = i; j != sim_objects.end(); j++)
 		{
-			if (i != j)
+			if (i != j && (*i)->collides_with(*j))
 			{
 				sim_object *a = *i;
 				sim_object *b = *j;
@@ -157,6 +187,130 @@ bool CSimulation::CheckForCollision(uint64_t abs_ns)
 	return false;
 }
 
+/*
+	Times t >= 0 (seconds) at which |d + v*t + a*t^2/2| < h, i.e. when two boxes overlap along one axis, given the
+	distance between their centres, their relative velocity and acceleration, and the sum of their half-sizes.
+	At most 3 intervals; returns how many.
+*/
+static int axis_overlap(double d, double v, double a, double h, double *start, double *end)
+{
+	double t[6];
+	int n = 0;
+
+	t[n++] = 0;
+	for (int side=-1; side <= 1; side += 2)
+	{
+		// roots of a*t^2/2 + v*t + (d - side*h) = 0
+		double c = d - side * h;
+		if (fabs(a) < 1e-12)
+		{
+			if (v != 0 && -c / v > 0)
+				t[n++] = -c / v;
+			continue;
+		}
+		double disc = v * v - 2 * a * c;
+		if (disc < 0)
+			continue;
+		double r0 = (-v - sqrt(disc)) / a;
+		double r1 = (-v + sqrt(disc)) / a;
+		if (r0 > 0)
+			t[n++] = r0;
+		if (r1 > 0)
+			t[n++] = r1;
+	}
+	std::sort(t, t + n);
+	t[n++] = HUGE_VAL;
+
+	// the sign of the overlap can only change at a root, so test one point between each pair of them
+	int count = 0;
+	for (int i=0; i < n-1; i++)
+	{
+		double mid = (t[i+1] == HUGE_VAL) ? t[i] + 1 : (t[i] + t[i+1]) / 2;
+		if (fabs(d + v * mid + 0.5 * a * mid * mid) >= h)
+			continue;
+		if (count && end[count-1] == t[i])
+			end[count-1] = t[i+1];
+		else
+		{
+			start[count] = t[i];
+			end[count] = t[i+1];
+			count++;
+		}
+	}
+	return count;
+}
+
+double CSimulation::TimeOfContact(sim_object *a, sim_object *b)
+{
+	double start_x[3], end_x[3], start_y[3], end_y[3];
+	double contact = -1;
+
+	// positions are in pixels, velocities and accelerations in m/s and m/s^2
+	int nx = axis_overlap(b->x() - a->x(), (b->velocity_x() - a->velocity_x()) * a->scale(),
+		(b->acceleration_x() - a->acceleration_x()) * a->scale(), (a->width() + b->width()) / 2, start_x, end_x);
+	int ny = axis_overlap(b->y() - a->y(), (b->velocity_y() - a->velocity_y()) * a->scale(),
+		(b->acceleration_y() - a->acceleration_y()) * a->scale(), (a->height() + b->height()) / 2, start_y, end_y);
+
+	// the boxes overlap when they overlap on both axes. An overlap that is already under way doesn't count, but
+	// boxes that are just touching come into contact straight away.
+	bool overlapping = fabs(b->x() - a->x()) < (a->width() + b->width()) / 2 &&
+		fabs(b->y() - a->y()) < (a->height() + b->height()) / 2;
+	for (int i=0; i < nx; i++)
+	{
+		for (int j=0; j < ny; j++)
+		{
+			double s = std::max(start_x[i], start_y[j]);
+			double e = std::min(end_x[i], end_y[j]);
+			if ((s > 0 || !overlapping) && s < e && (contact < 0 || s < contact))
+				contact = s;
+		}
+	}
+	return contact;
+}
+
+bool CSimulation::FirstContact(uint64_t horizon_ns, uint64_t *when_ns, sim_object **a, sim_object **b)
+{
+	bool found = false;
+
+	*when_ns = horizon_ns;
+	for (obj_list::iterator i = sim_objects.begin(); i != sim_objects.end(); i++)
+	{
+		for (obj_list::iterator j = i; j != sim_objects.end(); j++)
+		{
+			if (i == j || !(*i)->collides_with(*j))
+				continue;
+
+			// round up, to land on the contact rather than just before it
+			double t = TimeOfContact(*i, *j);
+			if (t >= 0 && t * 1.0e9 < *when_ns)
+			{
+				*when_ns = std::max((uint64_t)1, (uint64_t)ceil(t * 1.0e9));
+				*a = *i;
+				*b = *j;
+				found = true;
+			}
+		}
+	}
+
+	return found;
+}
+
+uint64_t CSimulation::NextEventTime(uint64_t abs_ns)
+{
+	uint64_t next = UINT64_MAX;
+	sim_object *a, *b;
+
+	if (!sim_events.empty())
+	{
+		uint64_t when = sim_events.front()->m_timestamp;
+		next = (when > abs_ns) ? when - abs_ns : 0;
+	}
+
+	// a step ends at the first contact anyway; stopping there ends the trial as soon as the last ball lands
+	FirstContact(next, &next, &a, &b);
+	return next;
+}
+
 bool CSimulation::who_collided(sim_collision *c, sim_object *a, sim_object *b)
 {
 	return (c->a == a && c->b == b || c->a == b && c->b == a);
@@ -6,6 +6,7 @@
 #include <SDL2/SDL_ttf.h>
 #include <list>
 #include <vector>
+#include "scenario.h"
 
 #define COLLISION 10
 #define OK 0
@@ -35,18 +36,41 @@ public:
 	uint32_t fps_target; // our target frame rate
 	uint64_t total_time; // total running time of the simulation (ns)
 	uint64_t trials; 		// how many times have we run the simulation (this session)
+	uint64_t catches;		// how many balls have been caught (this session)
+	uint64_t estimates;		// how many times the state was estimated (this session)
+	uint64_t skipped;		// of which the correction was skipped by the innovation gate
 	bool quit;				// quit the program
 	uint64_t update_rate; // forced rate (ns) for updating the simulation
 	bool realtime;			// use the wall clock, or update_rate
 	bool ui_visible;		// use graphical mode
+	uint64_t max_trials;	// quit after this many trials (0 to run until the user quits)
 	char *trace_filename; // file to use to record sensor trace
 	char *tracepath;		// directory containing traces from training
 	bool training;			// training mode means the user controls the robot, and we record the actions to a trace file
+	char *metrics_filename; // periodically write latency metrics to this file (NULL to disable)
+	char *snapshot_filename; // model snapshot to start from, or to create if it is missing or stale
+	uint32_t library_size;	// how many demonstrations to load from the trace directory
+	uint32_t selection;		// how the demonstrations are drawn from the directory (SELECT_xxx)
+	bool retrieval;			// rebuild the ensemble from the demonstrations nearest to the observed throw
+	bool learn;				// add the trials that catch the ball to the demonstrations
+	uint64_t learned;		// how many have been added (this session)
+	uint32_t num_balls;		// how many balls are thrown in each trial
+	uint32_t filter;			// how the ensemble is corrected (FILTER_xxx)
+	scenario config;		// throw, robot, sensor and ensemble settings (--scenario)
 };
 
 class CSimulation;
 typedef void(*event_cb)(CSimulation *s, uint64_t id, uint64_t timestamp);
 
+// Storage type for positions, demonstrations and the filters' per-member matrices. Positions are whole pixels,
+// so single precision (make PRECISION=single) is plenty. The ensemble state itself (phase, phase velocity and
+// weight), the sums and the small matrix solves are still done in double.
+#ifdef SINGLE_PRECISION
+typedef float real_t;
+#else
+typedef double real_t;
+#endif
+
 class point
 {
 public:
@@ -54,14 +78,15 @@ public:
 	point(double _x, double _y) : x(_x), y(_y) {}
 
 public:
-	double x;
-	double y;
+	real_t x;
+	real_t y;
 };
 
 class sim_object
 {
 public:
 	sim_object(double x, double y, double scale); 
+	virtual ~sim_object() { free(m_name); }
 	virtual void Update(uint64_t nsec);
 	virtual void Draw(SDL_Renderer* renderer);
 	void set_name(const char* name) { m_name = strdup(name); }
@@ -72,6 +97,8 @@ public:
 	void set_acceleration_x(double v) { m_acceleration_x = v; }
 	void set_acceleration_y(double v) { m_acceleration_y = v; }
 	void set_tracer_length(uint32_t len) { if (len < MAX_TRACER_LENGTH) m_tracerLength = len; }
+	void set_collidable(bool c) { m_collidable = c; }
+	void set_collision_group(uint32_t group) { m_collision_group = group; } // objects in the same (non-zero) group never collide
 	void accelerate_to_position(uint64_t dest_x, uint64_t dest_y);
 	void accelerate_to_velocity(uint64_t dest_x, uint64_t dest_y);
 
@@ -85,6 +112,9 @@ public:
 	double velocity_y() { return m_velocity_y; }
 	double acceleration_x() { return m_acceleration_x; }
 	double acceleration_y() { return m_acceleration_y; }
+	double scale() { return m_scale; } // pixels per metre
+	bool collides_with(sim_object *other) { return m_collidable && other->m_collidable &&
+		(!m_collision_group || m_collision_group != other->m_collision_group); }
 
 protected:
 	char *m_name;
@@ -103,6 +133,9 @@ protected:
 	double m_dest_pos_x;
 	double m_dest_pos_y;
 
+	bool m_collidable;
+	uint32_t m_collision_group;
+
 	uint32_t m_tracerLength;
 	std::vector<point> m_tracerPts;
 	uint64_t m_tracer_elapsed_ns;
@@ -144,15 +177,19 @@ class CSimulation
 {
 public:
 	CSimulation() : m_state(NULL), m_scale(10.0) {}
+	virtual ~CSimulation() {}
 	virtual bool Initialize(program_state *state, uint32_t w, uint32_t h);
 	virtual uint64_t UpdateSimulation(uint64_t abs_ns, uint64_t elapsed_ns);
 	virtual void Draw(SDL_Renderer* r);
 	virtual void HandleEvent(SDL_Event *event) = 0;
 	virtual void OnCollision(uint64_t abs_ns, sim_object *a, sim_object *b)=0;
 	bool who_collided(sim_collision *c, sim_object *a, sim_object *b);
+	virtual uint64_t NextEventTime(uint64_t abs_ns); // how long (ns) until something can happen that a step must not skip over
+	static double TimeOfContact(sim_object *a, sim_object *b); // seconds until a and b start to overlap, or -1 if they never do
 
 protected:
 	bool CheckForCollision(uint64_t abs_ns);
+	bool FirstContact(uint64_t horizon_ns, uint64_t *when_ns, sim_object **a, sim_object **b); // earliest contact within the horizon, and when (ns)
 
 protected:
 	program_state *m_state;
@@ -0,0 +1,284 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot.h"
+#include "library.h"
+#include "bip.h"
+
+#define SNAPSHOT_CHECKSUM_SEED	0xcbf29ce484222325UL
+#define SNAPSHOT_PRIME				0x100000001b3UL
+
+static uint64_t align8(uint64_t v)
+{
+	return (v + 7) & ~7UL;
+}
+
+// FNV-style hash, consuming 8 bytes per step. Chained calls give the same result as one call over the
+// concatenated data, as long as every chunk but the last is a multiple of 8 bytes.
+static uint64_t checksum_update(uint64_t h, const void *data, uint64_t size)
+{
+	const uint8_t *p = (const uint8_t*)data;
+	uint64_t word;
+
+	for (; size >= 8; size -= 8, p += 8)
+	{
+		memcpy(&word, p, 8);
+		h = (h ^ word) * SNAPSHOT_PRIME;
+	}
+	for (; size; size--, p++)
+		h = (h ^ *p) * SNAPSHOT_PRIME;
+
+	return h;
+}
+
+uint64_t snapshot_checksum(const void *data, uint64_t size)
+{
+	return checksum_update(SNAPSHOT_CHECKSUM_SEED, data, size);
+}
+
+// The per-file hashes are summed so the result does not depend on the order readdir returns the files in
+uint64_t snapshot_source_hash(const char *tracepath)
+{
+	DIR *d;
+	struct dirent *entry;
+	struct stat st;
+	char *tmpname;
+	uint64_t hash = 0;
+	uint64_t count = 0;
+
+	d = opendir(tracepath);
+	if (!d)
+		return 0;
+
+	while ((entry = readdir(d)) != NULL)
+	{
+		if (strncmp(entry->d_name, "trace", 5) != 0)
+			continue;
+
+		if (asprintf(&tmpname, "%s/%s", tracepath, entry->d_name) < 0)
+			break;
+
+		if (stat(tmpname, &st) == 0)
+		{
+			uint64_t fields[3] = { (uint64_t)st.st_size, (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec };
+			uint64_t h = checksum_update(SNAPSHOT_CHECKSUM_SEED, entry->d_name, strlen(entry->d_name));
+			hash += checksum_update(h, fields, sizeof(fields));
+			count++;
+		}
+		free(tmpname);
+	}
+	closedir(d);
+
+	return checksum_update(hash, &count, sizeof(count));
+}
+
+static bool write_section(FILE *f, uint64_t *checksum, const void *data, uint64_t size)
+{
+	static const uint8_t padding[8] = {0};
+	uint64_t pad = align8(size) - size;
+
+	if (size && fwrite(data, size, 1, f) != 1)
+		return false;
+	if (pad && fwrite(padding, pad, 1, f) != 1)
+		return false;
+
+	*checksum = checksum_update(*checksum, data, size);
+	*checksum = checksum_update(*checksum, padding, pad);
+	return true;
+}
+
+bool CDemoLibrary::SaveSnapshot(const char *filename)
+{
+	snapshot_header header;
+	char *tmpname = NULL;
+	FILE *f;
+	bool ok = true;
+
+	if (!has_model())
+	{
+		printf("Can't save a snapshot before the model is computed\n");
+		return false;
+	}
+	if (m_samples_dropped)
+	{
+		printf("Can't save a snapshot once the samples are dropped\n");
+		return false;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.header_size = sizeof(snapshot_header);
+	header.source_hash = snapshot_source_hash(m_path);
+	header.scale = m_scale;
+	header.num_interactions = size();
+	header.requested = m_requested;
+	header.selection = m_selection;
+	// the initial ensemble is only shared when the library is the ensemble (see BIP::create_initial_ensemble):
+	// otherwise the section is empty, and the first trial after loading builds it again
+	unsigned int ensemble_count = 0;
+	if (m_initial_ensemble && m_initial_ensemble_count % NUM_ENSEMBLE_STATES == 0)
+		ensemble_count = m_initial_ensemble_count;
+	header.num_members = ensemble_count / NUM_ENSEMBLE_STATES;
+	header.num_ensemble_states = NUM_ENSEMBLE_STATES;
+	header.num_state_variables = NUM_STATE_VARIABLES;
+	header.measurement_size = sizeof(measurement);
+	header.trajectory_samples = m_mean_trajectory_samples;
+	header.phase_velocity_mean = m_phase_velocity_mean;
+	header.phase_velocity_var = m_phase_velocity_var;
+
+	snapshot_interaction *table = (snapshot_interaction*)calloc(sizeof(snapshot_interaction), size() ? size() : 1);
+	unsigned int index = 0;
+	for (interaction_list::iterator i = m_interactions.begin(); i != m_interactions.end(); i++, index++)
+	{
+		table[index].first_sample = header.num_samples;
+		table[index].length = (*i)->length();
+		header.num_samples += (*i)->length();
+	}
+
+	uint64_t ensemble_size = sizeof(double) * ensemble_count;
+	uint64_t trajectory_size = sizeof(double) * NUM_STATE_VARIABLES * m_mean_trajectory_samples;
+	header.interactions_offset = align8(sizeof(snapshot_header));
+	header.samples_offset = header.interactions_offset + align8(sizeof(snapshot_interaction) * size());
+	header.ensemble_offset = header.samples_offset + align8(sizeof(measurement) * header.num_samples);
+	header.trajectory_offset = header.ensemble_offset + align8(ensemble_size);
+	header.file_size = header.trajectory_offset + align8(trajectory_size);
+
+	if (asprintf(&tmpname, "%s.tmp", filename) < 0)
+	{
+		free(table);
+		return false;
+	}
+
+	f = fopen(tmpname, "w");
+	if (!f)
+	{
+		printf("Error opening snapshot file %s\n", tmpname);
+		free(tmpname);
+		free(table);
+		return false;
+	}
+
+	// the header is written twice: once to reserve the space, and again when the checksum is known
+	uint64_t checksum = SNAPSHOT_CHECKSUM_SEED;
+	ok = (fwrite(&header, sizeof(header), 1, f) == 1);
+	ok = ok && write_section(f, &checksum, table, sizeof(snapshot_interaction) * size());
+	for (interaction_list::iterator i = m_interactions.begin(); ok && i != m_interactions.end(); i++)
+	{
+		if (fwrite((*i)->samples(), sizeof(measurement), (*i)->length(), f) != (*i)->length())
+			ok = false;
+		checksum = checksum_update(checksum, (*i)->samples(), sizeof(measurement) * (*i)->length());
+	}
+	// measurement is a multiple of 8 bytes, so the samples never need padding
+	ok = ok && write_section(f, &checksum, m_initial_ensemble, ensemble_size);
+	ok = ok && write_section(f, &checksum, m_mean_trajectory, trajectory_size);
+
+	header.checksum = checksum;
+	ok = ok && (fseek(f, 0, SEEK_SET) == 0);
+	ok = ok && (fwrite(&header, sizeof(header), 1, f) == 1);
+	if (fclose(f) != 0)
+		ok = false;
+
+	if (ok && rename(tmpname, filename) != 0)
+		ok = false;
+
+	if (ok)
+		printf("Saved snapshot of %u demonstrations to %s\n", size(), filename);
+	else
+	{
+		printf("Error writing snapshot %s\n", filename);
+		unlink(tmpname);
+	}
+
+	free(tmpname);
+	free(table);
+	return ok;
+}
+
+// Maps the snapshot and uses the demonstrations in place. Returns -1 if the file is missing, damaged,
+// from a different build, or older than the trace directory.
+int CDemoLibrary::LoadSnapshot(const char *filename)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < sizeof(snapshot_header))
+	{
+		close(fd);
+		return -1;
+	}
+
+	void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return -1;
+
+	const uint8_t *base = (const uint8_t*)mapping;
+	const snapshot_header *header = (const snapshot_header*)base;
+	const char *error = NULL;
+
+	if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0)
+		error = "not a snapshot";
+	else if (header->version != SNAPSHOT_VERSION || header->header_size != sizeof(snapshot_header))
+		error = "unsupported version";
+	else if (header->file_size != (uint64_t)st.st_size)
+		error = "truncated";
+	else if (header->measurement_size != sizeof(measurement) || header->num_state_variables != NUM_STATE_VARIABLES ||
+		header->num_ensemble_states != NUM_ENSEMBLE_STATES)
+		error = "built with different parameters";
+	else if (header->scale != m_scale)
+		error = "different scale";
+	else if (header->requested != m_requested || header->selection != m_selection)
+		error = "different library size or selection";
+	else if (header->interactions_offset + sizeof(snapshot_interaction) * header->num_interactions > header->samples_offset ||
+		header->samples_offset + sizeof(measurement) * header->num_samples > header->ensemble_offset ||
+		header->ensemble_offset + sizeof(double) * NUM_ENSEMBLE_STATES * header->num_members > header->trajectory_offset ||
+		header->trajectory_offset + sizeof(double) * NUM_STATE_VARIABLES * header->trajectory_samples > header->file_size)
+		error = "bad section offsets";
+	else if (header->source_hash != snapshot_source_hash(m_path))
+		error = "stale (the trace directory has changed)";
+	else if (header->checksum != snapshot_checksum(base + header->header_size, header->file_size - header->header_size))
+		error = "checksum mismatch";
+
+	if (error)
+	{
+		printf("Ignoring snapshot %s: %s\n", filename, error);
+		munmap(mapping, st.st_size);
+		return -1;
+	}
+
+	const snapshot_interaction *table = (const snapshot_interaction*)(base + header->interactions_offset);
+	const measurement *samples = (const measurement*)(base + header->samples_offset);
+	for (unsigned int i=0; i < header->num_interactions; i++)
+	{
+		if (table[i].first_sample + table[i].length > header->num_samples)
+		{
+			printf("Ignoring snapshot %s: bad demonstration table\n", filename);
+			for (interaction_list::iterator j = m_interactions.begin(); j != m_interactions.end(); j++)
+				delete *j;
+			m_interactions.clear();
+			munmap(mapping, st.st_size);
+			return -1;
+		}
+		m_interactions.push_back(new CInteraction(m_scale, samples + table[i].first_sample, table[i].length));
+	}
+
+	m_mapping = mapping;
+	m_mapping_size = st.st_size;
+	set_phase_stats(header->phase_velocity_mean, header->phase_velocity_var);
+	if (header->num_members)
+		set_initial_ensemble((const double*)(base + header->ensemble_offset), NUM_ENSEMBLE_STATES * header->num_members);
+	set_mean_trajectory((const double*)(base + header->trajectory_offset), header->trajectory_samples,
+		NUM_ENSEMBLE_MEMBERS); // the model is always the default size (see CMySimulation::Initialize)
+
+	printf("Loaded %u demonstrations from snapshot %s\n", size(), filename);
+	return 0;
+}
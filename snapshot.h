@@ -0,0 +1,60 @@
+#ifndef _SNAPSHOT__H
+#define _SNAPSHOT__H
+
+#include <stdint.h>
+
+/*
+	Binary snapshot of a demonstration library and the model derived from it, so the simulator can map
+	the file and start without reading or preprocessing any traces. Layout (all offsets from the start of
+	the file, each section 8-byte aligned):
+
+	snapshot_header
+	snapshot_interaction[num_interactions]             where each demonstration starts in the sample array
+	measurement[num_samples]                            the samples of all demonstrations, back to back
+	double[num_ensemble_states * num_members]           initial ensemble (none when the library is larger)
+	double[num_state_variables * trajectory_samples]    mean trajectory
+
+	The checksum covers everything after the header. The source hash identifies the state of the trace
+	directory (names, sizes and modification times of the trace files) when the snapshot was taken, so a
+	snapshot is ignored as soon as a trace is added, removed or rewritten.
+*/
+
+#define SNAPSHOT_MAGIC		"BIPSNAP"
+#define SNAPSHOT_VERSION	2
+
+struct snapshot_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t file_size;
+	uint64_t checksum;
+	uint64_t source_hash;
+	double scale;
+	uint32_t num_interactions;
+	uint32_t requested;				// library size and selection mode the demonstrations were drawn with
+	uint32_t selection;
+	uint32_t num_members;
+	uint32_t num_ensemble_states;
+	uint32_t num_state_variables;
+	uint32_t measurement_size;		// sizeof(measurement) of the writer
+	uint32_t trajectory_samples;
+	uint64_t num_samples;
+	double phase_velocity_mean;
+	double phase_velocity_var;
+	uint64_t interactions_offset;
+	uint64_t samples_offset;
+	uint64_t ensemble_offset;
+	uint64_t trajectory_offset;
+};
+
+struct snapshot_interaction
+{
+	uint64_t first_sample;
+	uint64_t length;
+};
+
+uint64_t snapshot_checksum(const void *data, uint64_t size);
+uint64_t snapshot_source_hash(const char *tracepath);
+
+#endif // _SNAPSHOT__H
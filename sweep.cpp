@@ -0,0 +1,311 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+#include <algorithm>
+#include "sweep.h"
+#include "random.h"
+#include "budget.h"
+#include "timeline.h"
+
+#define MAX_SWEEP_CONFIGS	100000 // a grid bigger than this is almost certainly a typo
+
+// the values to try for one parameter
+struct sweep_dimension
+{
+	unsigned int param;
+	bool range;						// lo:hi:n (the random design draws from lo..hi)
+	double lo;
+	double hi;
+	std::vector<double> values;	// the list, or the grid of the range
+};
+
+static double param_round(unsigned int param, double value)
+{
+	return param_integer(param) ? floor(value + 0.5) : value;
+}
+
+static bool parse_dimension(const std::string &text, sweep_dimension *dim)
+{
+	size_t eq = text.find('=');
+	int param = (eq == std::string::npos) ? -1 : param_find(text.c_str(), eq);
+	if (param < 0)
+	{
+		printf("Unknown scenario parameter '%s'\n", text.c_str());
+		return false;
+	}
+
+	const char *v = text.c_str() + eq + 1;
+	dim->param = param;
+	dim->range = (strchr(v, ':') != NULL);
+	if (dim->range)
+	{
+		unsigned int n;
+		int used = 0;
+		if (sscanf(v, "%lf:%lf:%u%n", &dim->lo, &dim->hi, &n, &used) != 3 || v[used] || n < 1)
+		{
+			printf("Bad range for %s: '%s' (expected lo:hi:count)\n", param_name(param), v);
+			return false;
+		}
+		for (unsigned int i=0; i < n; i++)
+			dim->values.push_back(param_round(param, n > 1 ? dim->lo + (dim->hi - dim->lo) * i / (n - 1) : dim->lo));
+	}
+	else
+	{
+		while (*v)
+		{
+			char *end;
+			dim->values.push_back(strtod(v, &end));
+			if (end == v || (*end && *end != '/'))
+			{
+				printf("Bad value list for %s: '%s'\n", param_name(param), text.c_str() + eq + 1);
+				return false;
+			}
+			v = *end ? end + 1 : end;
+		}
+	}
+
+	// catch values out of range now, rather than in every configuration. The random design draws from
+	// anywhere in lo..hi, so both ends are checked, even when the grid has only one of them.
+	std::vector<double> check(dim->values);
+	if (dim->range)
+	{
+		check.push_back(param_round(param, dim->lo));
+		check.push_back(param_round(param, dim->hi));
+	}
+	for (unsigned int i=0; i < check.size(); i++)
+	{
+		scenario test;
+		if (!test.set(param, check[i]))
+		{
+			printf("Value %g is out of range for %s\n", check[i], param_name(param));
+			return false;
+		}
+	}
+	if (dim->values.empty())
+	{
+		printf("No values for %s\n", param_name(param));
+		return false;
+	}
+	return true;
+}
+
+bool sweep_design(const char *design, const scenario &base, unsigned int random, std::vector<scenario> &configs)
+{
+	std::vector<sweep_dimension> dims;
+	std::string text(design);
+	size_t start = 0;
+
+	while (start < text.size())
+	{
+		size_t end = text.find(',', start);
+		if (end == std::string::npos)
+			end = text.size();
+		sweep_dimension dim;
+		if (!parse_dimension(text.substr(start, end - start), &dim))
+			return false;
+		dims.push_back(dim);
+		start = end + 1;
+	}
+
+	configs.clear();
+	if (random)
+	{
+		// each draw has its own stream, so the n-th configuration doesn't depend on how many are drawn
+		for (unsigned int c=0; c < random; c++)
+		{
+			scenario config = base;
+			for (unsigned int d=0; d < dims.size(); d++)
+			{
+				CRandom r(RNG_BLOCK_SWEEP, 0, c, d);
+				const sweep_dimension &dim = dims[d];
+				double value = dim.range ? param_round(dim.param, dim.lo + r.uniform() * (dim.hi - dim.lo)) :
+					dim.values[r.below(dim.values.size())];
+				config.set(dim.param, value);
+			}
+			configs.push_back(config);
+		}
+		return true;
+	}
+
+	// every combination, with the last parameter of the design changing fastest
+	uint64_t count = 1;
+	for (unsigned int d=0; d < dims.size(); d++)
+	{
+		count *= dims[d].values.size();
+		if (count > MAX_SWEEP_CONFIGS)
+		{
+			printf("The grid has more than %u configurations\n", MAX_SWEEP_CONFIGS);
+			return false;
+		}
+	}
+	for (uint64_t c=0; c < count; c++)
+	{
+		scenario config = base;
+		uint64_t rest = c;
+		for (int d=dims.size()-1; d >= 0; d--)
+		{
+			config.set(dims[d].param, dims[d].values[rest % dims[d].values.size()]);
+			rest /= dims[d].values.size();
+		}
+		configs.push_back(config);
+	}
+	return true;
+}
+
+void sweep_table(const std::vector<scenario> &configs, const std::vector<sweep_result> &results,
+	const std::vector<bool> &ok, FILE *f)
+{
+	for (unsigned int p=0; p < MAX_PARAMS; p++)
+		fprintf(f, "%18s ", param_name(p));
+	fprintf(f, "%8s %8s %8s %8s %9s %12s %10s %12s %10s\n", "trials", "balls", "caught", "rate", "skipped",
+		"steps/trial", "step (us)", "update (us)", "time (s)");
+
+	for (unsigned int c=0; c < configs.size(); c++)
+	{
+		for (unsigned int p=0; p < MAX_PARAMS; p++)
+			fprintf(f, "%18g ", configs[c].get(p));
+		if (!ok[c])
+		{
+			fprintf(f, "failed\n");
+			continue;
+		}
+
+		const sweep_result &r = results[c];
+		fprintf(f, "%8lu %8lu %8lu %7.1f%% %8.1f%% %12.1f %10.2f %12.1f %10.2f\n", r.trials, r.balls, r.catches,
+			r.balls ? r.catches * 100.0 / r.balls : 0, r.estimates ? r.skipped * 100.0 / r.estimates : 0,
+			r.trials ? (double)r.steps / r.trials : 0, r.step_us, r.estimate_us, r.seconds);
+	}
+}
+
+unsigned int sweep_fork(const std::vector<scenario> &configs, sweep_fn fn, unsigned int jobs,
+	std::vector<sweep_result> &results, std::vector<bool> &ok, bool progress)
+{
+	struct worker
+	{
+		pid_t pid;
+		int fd;		// the child writes its sweep_result here
+		unsigned int config;
+		unsigned int slot;	// of the thread budget: which share of the cores it runs on
+	};
+
+	std::vector<worker> running;
+	std::vector<bool> busy;
+	unsigned int next = 0;
+	unsigned int done = 0;
+	unsigned int failed = 0;
+
+	if (!jobs)
+		jobs = 1;
+	busy.assign(jobs, false);
+	results.assign(configs.size(), sweep_result());
+	ok.assign(configs.size(), false);
+
+	while (done < configs.size())
+	{
+		// keep 'jobs' children busy
+		while (next < configs.size() && running.size() < jobs)
+		{
+			int fds[2];
+			pid_t pid = -1;
+			unsigned int slot = std::find(busy.begin(), busy.end(), false) - busy.begin();
+
+			// the children would print whatever is still buffered too
+			fflush(NULL);
+			if (pipe(fds) == 0)
+			{
+				pid = fork();
+				if (pid == 0)
+				{
+					// the results table is all that is printed; the trials' own output goes nowhere
+					close(fds[0]);
+					if (!freopen("/dev/null", "w", stdout))
+						_exit(1);
+
+					budget_worker(slot);
+					timeline_worker(slot);
+					sweep_result result;
+					memset(&result, 0, sizeof(result));
+					bool success;
+					{
+						CTimelineSpan span("configuration");
+						success = fn(configs[next], &result);
+					}
+					timeline_worker_done();
+					if (success && write(fds[1], &result, sizeof(result)) != sizeof(result))
+						success = false;
+					_exit(success ? 0 : 1);
+				}
+				close(fds[1]);
+				if (pid < 0)
+					close(fds[0]);
+			}
+
+			if (pid < 0)
+			{
+				perror("Can't start a sweep worker");
+				done++;
+				failed++;
+			}
+			else
+			{
+				worker w = { pid, fds[0], next, slot };
+				running.push_back(w);
+				busy[slot] = true;
+			}
+			next++;
+		}
+
+		if (running.empty())
+			continue;
+
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid < 0)
+		{
+			perror("waitpid");
+			break;
+		}
+
+		for (unsigned int i=0; i < running.size(); i++)
+		{
+			if (running[i].pid != pid)
+				continue;
+
+			unsigned int c = running[i].config;
+			timeline_adopt(pid);
+			ok[c] = WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+				read(running[i].fd, &results[c], sizeof(sweep_result)) == sizeof(sweep_result);
+			close(running[i].fd);
+			busy[running[i].slot] = false;
+			running.erase(running.begin() + i);
+			done++;
+			if (!ok[c])
+				failed++;
+			if (!progress)
+				break;
+
+			printf("[%u/%zu] ", done, configs.size());
+			configs[c].print(stdout);
+			if (ok[c])
+				printf(": %lu of %lu caught\n", results[c].catches, results[c].balls);
+			else
+				printf(": failed\n");
+			break;
+		}
+	}
+
+	return failed;
+}
+
+unsigned int sweep_run(const std::vector<scenario> &configs, sweep_fn fn, unsigned int jobs, FILE *table)
+{
+	std::vector<sweep_result> results;
+	std::vector<bool> ok;
+
+	unsigned int failed = sweep_fork(configs, fn, jobs, results, ok, true);
+	sweep_table(configs, results, ok, table);
+	return failed;
+}
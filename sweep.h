@@ -0,0 +1,55 @@
+#ifndef _SWEEP__H
+#define _SWEEP__H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include "scenario.h"
+
+/*
+	Parameter sweeps over the scenario (see scenario.h). A design is a comma separated list of the parameters
+	to vary, each with the values to try:
+
+	name=value			a single value
+	name=v1/v2/v3		a list of values
+	name=lo:hi:n		n evenly spaced values from lo to hi
+
+	The grid design runs every combination of the values. The random design draws a given number of
+	configurations instead, each parameter uniformly from lo..hi (or from its list). Parameters that the design
+	doesn't name keep their value from the base scenario.
+
+	Every configuration runs in a process of its own (fork), up to 'jobs' at once, so the simulation needs no
+	locking at all. The demonstrations are loaded by the parent before forking, and shared by the children.
+	With the same seed, all configurations see the same throws where the parameters allow it.
+*/
+struct sweep_result
+{
+	uint64_t trials;
+	uint64_t balls;
+	uint64_t catches;
+	uint64_t estimates;		// calls to estimate_state (a single ball)
+	uint64_t skipped;		// corrections skipped by the innovation gate
+	uint64_t steps;			// calls to UpdateSimulation
+	double step_us;			// mean cost of one
+	double estimate_us;		// mean cost of one estimate_state
+	uint64_t estimate_samples;	// calls to estimate_state that estimate_us is the mean of
+	double seconds;			// wall time of all the trials
+};
+
+// runs the trials of one configuration (in the child process)
+typedef bool (*sweep_fn)(const scenario &config, sweep_result *result);
+
+// the configurations of a design: random == 0 for the grid design, otherwise the number to draw
+bool sweep_design(const char *design, const scenario &base, unsigned int random, std::vector<scenario> &configs);
+
+// runs every configuration and writes the results table. Returns the number of configurations that failed.
+unsigned int sweep_run(const std::vector<scenario> &configs, sweep_fn fn, unsigned int jobs, FILE *table);
+
+// sweep_run in two halves, for the runs that fork more than once: sweep_fork runs every configuration in a
+// process of its own (printing a line as each one is done, with progress), sweep_table writes the results
+unsigned int sweep_fork(const std::vector<scenario> &configs, sweep_fn fn, unsigned int jobs,
+	std::vector<sweep_result> &results, std::vector<bool> &ok, bool progress);
+void sweep_table(const std::vector<scenario> &configs, const std::vector<sweep_result> &results,
+	const std::vector<bool> &ok, FILE *f);
+
+#endif // _SWEEP__H
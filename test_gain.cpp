@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <math.h>
+#include "bip.h"
+
+/*
+	Checks the Kalman gain of the stochastic filter against answers worked out by hand, with the rows of the
+	latent coefficients that the filter has when latent_rank > 0. Returns 0 when every element matches.
+*/
+
+static const unsigned int D = NUM_STATE_VARIABLES;
+static const unsigned int states = MAX_ENSEMBLE_STATES; // the rows of the largest latent rank
+
+static unsigned int check(const char *name, const real_t *gain, const double *expected)
+{
+	unsigned int failed = 0;
+
+	for (unsigned int b=0; b < states; b++)
+	{
+		for (unsigned int d=0; d < D; d++)
+		{
+			if (fabs(gain[D * b + d] - expected[D * b + d]) > 1e-5 * (1 + fabs(expected[D * b + d])))
+			{
+				printf("%s: K[%u][%u] is %f, expected %f\n", name, b, d, gain[D * b + d], expected[D * b + d]);
+				failed++;
+			}
+		}
+	}
+	return failed;
+}
+
+/*
+	Independent sensors: S is diagonal, each sensor with the spread p of its reading plus the noise r, and
+	the gain of every state for a sensor is its covariance with the reading over p + r.
+*/
+static unsigned int scalar_case()
+{
+	real_t partial[MAX_ENSEMBLE_STATES * NUM_STATE_VARIABLES];
+	real_t gain[MAX_ENSEMBLE_STATES * NUM_STATE_VARIABLES];
+	real_t S_inv[NUM_STATE_VARIABLES * NUM_STATE_VARIABLES] = {0};
+	double expected[MAX_ENSEMBLE_STATES * NUM_STATE_VARIABLES];
+	const double p[NUM_STATE_VARIABLES] = { 4, 9, 1 };
+	const double r = 1;
+
+	for (unsigned int d=0; d < D; d++)
+		S_inv[D * d + d] = 1 / (p[d] + r);
+	for (unsigned int b=0; b < states; b++)
+	{
+		for (unsigned int d=0; d < D; d++)
+		{
+			double covariance = (b % 2 ? -0.5 : 1.0) * (b + 1) * (d + 1);
+			partial[D * b + d] = covariance;
+			expected[D * b + d] = covariance / (p[d] + r);
+		}
+	}
+
+	kalman_gain(partial, S_inv, gain, states);
+	return check("independent sensors", gain, expected);
+}
+
+/*
+	The ball's readings are correlated: S = [2 1 0; 1 2 0; 0 0 1], so S^-1 = [2 -1 0; -1 2 0; 0 0 3] / 3.
+	The rows of P cycle through three covariances with known gains:
+	[1 1 1] -> [1/3 1/3 1], [3 0 0] -> [2 -1 0] and [0 3 0] -> [-1 2 0].
+*/
+static unsigned int correlated_case()
+{
+	real_t partial[MAX_ENSEMBLE_STATES * NUM_STATE_VARIABLES];
+	real_t gain[MAX_ENSEMBLE_STATES * NUM_STATE_VARIABLES];
+	const real_t S_inv[NUM_STATE_VARIABLES * NUM_STATE_VARIABLES] =
+	{
+		2.0 / 3, -1.0 / 3, 0,
+		-1.0 / 3, 2.0 / 3, 0,
+		0, 0, 1,
+	};
+	const double rows[3][NUM_STATE_VARIABLES] = { { 1, 1, 1 }, { 3, 0, 0 }, { 0, 3, 0 } };
+	const double gains[3][NUM_STATE_VARIABLES] = { { 1.0 / 3, 1.0 / 3, 1 }, { 2, -1, 0 }, { -1, 2, 0 } };
+	double expected[MAX_ENSEMBLE_STATES * NUM_STATE_VARIABLES];
+
+	for (unsigned int b=0; b < states; b++)
+	{
+		for (unsigned int d=0; d < D; d++)
+		{
+			partial[D * b + d] = rows[b % 3][d];
+			expected[D * b + d] = gains[b % 3][d];
+		}
+	}
+
+	kalman_gain(partial, S_inv, gain, states);
+	return check("correlated sensors", gain, expected);
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int failed = scalar_case() + correlated_case();
+
+	printf("Kalman gain: %s\n", failed ? "FAILED" : "OK");
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "metrics.h"
+#include "timeline.h"
+
+#define TIMELINE_WORKER_THREADS		1000 // tracks of the threads a sweep worker starts: 1000 x (slot + 1) and up
+
+bool timeline_enabled = false;
+
+struct timeline_span
+{
+	const char *name;
+	uint64_t start;
+	uint64_t end;
+};
+
+// the spans of one thread: only that thread writes them
+struct timeline_thread
+{
+	unsigned int track;
+	char name[32];
+	timeline_span *spans;
+	unsigned int count;
+	uint64_t dropped;
+};
+
+static std::mutex threads_lock; // only taken when a thread records its first span, and when writing
+static std::vector<timeline_thread*> threads;
+static thread_local timeline_thread *local = NULL;
+static unsigned int next_track;
+static char *timeline_filename;
+static pid_t timeline_pid;		// of the process that enabled the timeline: the workers' spans are shown as its own
+static uint64_t origin;			// ns
+static std::vector<std::string> fragments; // files of the workers that are done
+
+void timeline_enable(const char *filename)
+{
+	free(timeline_filename);
+	timeline_filename = strdup(filename);
+	timeline_pid = getpid();
+	origin = metrics_now_ns();
+	timeline_enabled = true;
+}
+
+// the first thread to record a span is the main track
+static void register_thread()
+{
+	local = new timeline_thread;
+	local->spans = new timeline_span[TIMELINE_MAX_SPANS];
+	local->count = 0;
+	local->dropped = 0;
+
+	std::lock_guard<std::mutex> guard(threads_lock);
+	local->track = next_track++;
+	if (local->track)
+		snprintf(local->name, sizeof(local->name), "thread %u", local->track);
+	else
+		strcpy(local->name, "main");
+	threads.push_back(local);
+}
+
+void CTimelineSpan::begin()
+{
+	m_start = metrics_now_ns();
+}
+
+void CTimelineSpan::end()
+{
+	if (!m_start)
+		return;
+
+	if (!local)
+		register_thread();
+	if (local->count == TIMELINE_MAX_SPANS)
+	{
+		local->dropped++;
+		return;
+	}
+	timeline_span &span = local->spans[local->count++];
+	span.name = m_name;
+	span.start = m_start;
+	span.end = metrics_now_ns();
+}
+
+// every event starts with a comma: the first line of the file is the one that doesn't
+static uint64_t write_spans(FILE *f)
+{
+	uint64_t written = 0;
+
+	std::lock_guard<std::mutex> guard(threads_lock);
+	for (unsigned int t=0; t < threads.size(); t++)
+	{
+		const timeline_thread *thread = threads[t];
+		if (!thread->count)
+			continue;
+
+		fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+			timeline_pid, thread->track, thread->name);
+		fprintf(f, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"sort_index\":%u}}",
+			timeline_pid, thread->track, thread->track);
+		for (unsigned int i=0; i < thread->count; i++)
+		{
+			const timeline_span &span = thread->spans[i];
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", span.name,
+				timeline_pid, thread->track, (span.start - origin) / 1000.0, (span.end - span.start) / 1000.0);
+		}
+		written += thread->count;
+		if (thread->dropped)
+			printf("Timeline: %lu spans of %s dropped (the buffer holds %u)\n", thread->dropped, thread->name,
+				TIMELINE_MAX_SPANS);
+	}
+	return written;
+}
+
+// right after the fork, nothing else runs in the worker: the spans it inherited are the parent's to write
+void timeline_worker(unsigned int slot)
+{
+	if (!timeline_enabled)
+		return;
+
+	if (!local)
+		register_thread();
+
+	std::lock_guard<std::mutex> guard(threads_lock);
+	for (unsigned int t=0; t < threads.size(); t++)
+	{
+		threads[t]->count = 0;
+		threads[t]->dropped = 0;
+	}
+	next_track = TIMELINE_WORKER_THREADS * (slot + 1);
+	local->track = slot + 1;
+	snprintf(local->name, sizeof(local->name), "worker %u", slot);
+}
+
+void timeline_worker_done()
+{
+	char *name;
+
+	if (!timeline_enabled || asprintf(&name, "%s.%d", timeline_filename, getpid()) < 0)
+		return;
+
+	FILE *f = fopen(name, "w");
+	if (f)
+	{
+		write_spans(f);
+		fclose(f);
+	}
+	free(name);
+}
+
+void timeline_adopt(pid_t worker)
+{
+	char *name;
+
+	if (!timeline_enabled || asprintf(&name, "%s.%d", timeline_filename, worker) < 0)
+		return;
+	fragments.push_back(name);
+	free(name);
+}
+
+bool timeline_write()
+{
+	if (!timeline_enabled)
+		return false;
+
+	FILE *f = fopen(timeline_filename, "w");
+	if (!f)
+	{
+		printf("Error opening timeline file %s\n", timeline_filename);
+		return false;
+	}
+
+	fprintf(f, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"sim\"}}",
+		timeline_pid);
+	uint64_t spans = write_spans(f);
+
+	// the workers' files are events already
+	for (unsigned int i=0; i < fragments.size(); i++)
+	{
+		FILE *part = fopen(fragments[i].c_str(), "r");
+		if (!part)
+			continue;
+
+		char buffer[65536];
+		size_t n;
+		while ((n = fread(buffer, 1, sizeof(buffer), part)) > 0)
+			fwrite(buffer, 1, n, f);
+		fclose(part);
+		unlink(fragments[i].c_str());
+	}
+
+	fprintf(f, "\n],\n\"displayTimeUnit\":\"ns\"}\n");
+	fclose(f);
+	printf("Timeline of %lu spans%s written to %s\n", spans, fragments.empty() ? "" : " (and the workers')",
+		timeline_filename);
+	return true;
+}
@@ -0,0 +1,45 @@
+#ifndef _TIMELINE__H
+#define _TIMELINE__H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define TIMELINE_MAX_SPANS		(1 << 18)	// per thread (24 bytes each): later spans are dropped, and counted
+
+/*
+	Timeline of what the program was doing, written as a Chrome trace (JSON) that chrome://tracing and Perfetto
+	can open. Each CTimelineSpan is one span: it takes the time when it is created and when it is destroyed,
+	and spans inside other spans show up nested under them.
+
+	Every thread writes its spans to a buffer of its own, so recording takes no lock and no atomic operation;
+	the buffers are only read by timeline_write, at exit. Until timeline_enable is called, a span costs one test
+	of a flag.
+
+	Every thread is a track of its own. The workers of a sweep are processes: each of them takes the track of its
+	slot (timeline_worker) and saves its spans to a file of its own when it is done (timeline_worker_done). The
+	parent adds the file of every worker it reaps (timeline_adopt) to what it writes at exit, so the whole sweep
+	is one timeline, with one track per worker.
+*/
+extern bool timeline_enabled;
+
+void timeline_enable(const char *filename);
+void timeline_worker(unsigned int slot); // in a forked worker: drops the parent's spans, and takes this track
+void timeline_worker_done();
+void timeline_adopt(pid_t worker);
+bool timeline_write();
+
+class CTimelineSpan
+{
+public:
+	CTimelineSpan(const char *name) : m_name(name), m_start(0) { if (timeline_enabled) begin(); }
+	~CTimelineSpan() { if (timeline_enabled) end(); }
+
+private:
+	void begin();
+	void end();
+
+	const char *m_name; // a string constant: only the pointer is kept
+	uint64_t m_start;
+};
+
+#endif // _TIMELINE__H
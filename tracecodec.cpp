@@ -0,0 +1,214 @@
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include "tracecodec.h"
+
+#define MAX_POSITION		(1LL << 52)	// larger positions may not be whole numbers in a double
+
+static inline uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// column 1..6 of a sample (column 0 is the timestamp)
+static double position(const measurement &m, unsigned int column)
+{
+	switch (column)
+	{
+	case 1: return m.player.x;
+	case 2: return m.player.y;
+	case 3: return m.robot.x;
+	case 4: return m.robot.y;
+	case 5: return m.ball.x;
+	default: return m.ball.y;
+	}
+}
+
+// TRACE_PACK_BLOCK values of 'width' bits each into 'dst' (8 * width bytes, zeroed by the caller)
+static void pack_bits(const uint64_t *values, unsigned int width, uint8_t *dst)
+{
+	for (unsigned int i=0; i < TRACE_PACK_BLOCK; i++)
+	{
+		uint64_t bit = (uint64_t)i * width;
+		for (unsigned int done=0; done < width; )
+		{
+			unsigned int offset = (bit + done) & 7;
+			unsigned int take = std::min(8 - offset, width - done);
+			dst[(bit + done) >> 3] |= ((values[i] >> done) & ((1u << take) - 1)) << offset;
+			done += take;
+		}
+	}
+}
+
+/*
+	The inverse: every value is one unaligned 8-byte load, a shift and a mask, with no branches in the loop
+	(the compiler unrolls it). Widths above 56 bits can straddle 9 bytes, and take one more load.
+*/
+static void unpack_bits(const uint8_t *src, unsigned int width, uint64_t *values)
+{
+	if (!width)
+	{
+		memset(values, 0, sizeof(uint64_t) * TRACE_PACK_BLOCK);
+		return;
+	}
+
+	const uint64_t mask = (width == 64) ? ~0ULL : (1ULL << width) - 1;
+	if (width <= 56)
+	{
+		for (unsigned int i=0; i < TRACE_PACK_BLOCK; i++)
+		{
+			uint64_t bit = (uint64_t)i * width;
+			uint64_t word;
+			memcpy(&word, src + (bit >> 3), sizeof(word));
+			values[i] = (word >> (bit & 7)) & mask;
+		}
+		return;
+	}
+
+	for (unsigned int i=0; i < TRACE_PACK_BLOCK; i++)
+	{
+		uint64_t bit = (uint64_t)i * width;
+		unsigned int shift = bit & 7;
+		uint64_t word;
+		memcpy(&word, src + (bit >> 3), sizeof(word));
+		uint64_t v = word >> shift;
+		if (shift)
+			v |= (uint64_t)src[(bit >> 3) + 8] << (64 - shift);
+		values[i] = v & mask;
+	}
+}
+
+bool trace_is_packed(const void *data, size_t size)
+{
+	return size >= sizeof(packed_trace_header) && memcmp(data, TRACE_PACK_MAGIC, sizeof(TRACE_PACK_MAGIC)) == 0;
+}
+
+bool trace_pack(const measurement *samples, uint64_t length, std::vector<uint8_t> &out)
+{
+	packed_trace_header header;
+	int64_t prev[TRACE_PACK_COLUMNS] = { 0 };
+	uint64_t values[TRACE_PACK_BLOCK];
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_PACK_MAGIC, sizeof(TRACE_PACK_MAGIC));
+	header.version = TRACE_PACK_VERSION;
+	header.header_size = sizeof(header);
+	header.num_samples = length;
+	header.start_ns = length ? samples[0].timestamp : 0;
+	header.period_ns = (length > 1) ? (samples[length - 1].timestamp - samples[0].timestamp) / (length - 1) : 0;
+	for (unsigned int c=1; c < TRACE_PACK_COLUMNS && length; c++)
+	{
+		double v = position(samples[0], c);
+		if (v != floor(v) || fabs(v) >= MAX_POSITION)
+			return false;
+		header.origin[c - 1] = prev[c] = (int64_t)v;
+	}
+	out.assign((const uint8_t*)&header, (const uint8_t*)&header + sizeof(header));
+
+	for (uint64_t first=0; first < length; first += TRACE_PACK_BLOCK)
+	{
+		for (unsigned int c=0; c < TRACE_PACK_COLUMNS; c++)
+		{
+			uint64_t used = 0;
+			for (unsigned int i=0; i < TRACE_PACK_BLOCK; i++)
+			{
+				uint64_t s = first + i;
+				int64_t delta = 0;
+				if (s < length && c == 0)
+				{
+					// wraps around for timestamps that go backwards, which the decoder undoes
+					delta = samples[s].timestamp - (header.start_ns + s * header.period_ns);
+				}
+				else if (s < length)
+				{
+					double v = position(samples[s], c);
+					if (v != floor(v) || fabs(v) >= MAX_POSITION)
+						return false;
+					delta = (int64_t)v - prev[c];
+					prev[c] = (int64_t)v;
+				}
+				values[i] = zigzag(delta);
+				used |= values[i];
+			}
+
+			unsigned int width = used ? 64 - __builtin_clzll(used) : 0;
+			size_t at = out.size();
+			out.resize(at + 1 + 8 * width, 0);
+			out[at] = width;
+			pack_bits(values, width, &out[at + 1]);
+		}
+	}
+
+	out.resize(out.size() + TRACE_PACK_SLACK, 0);
+	return true;
+}
+
+bool trace_unpack(const void *data, size_t size, std::vector<measurement> &out)
+{
+	const uint8_t *base = (const uint8_t*)data;
+	packed_trace_header header;
+	uint64_t values[TRACE_PACK_COLUMNS][TRACE_PACK_BLOCK];
+	int64_t prev[TRACE_PACK_COLUMNS] = { 0 };
+	size_t first = out.size();
+
+	if (!trace_is_packed(data, size))
+		return false;
+	memcpy(&header, base, sizeof(header));
+	if (header.version != TRACE_PACK_VERSION || header.header_size != sizeof(header) ||
+		size < sizeof(header) + TRACE_PACK_SLACK)
+		return false;
+
+	// every block takes one byte per column at least, which bounds the sample count before anything is reserved
+	const uint8_t *p = base + header.header_size;
+	const uint8_t *end = base + size - TRACE_PACK_SLACK;
+	uint64_t blocks = (header.num_samples + TRACE_PACK_BLOCK - 1) / TRACE_PACK_BLOCK;
+	if (blocks > (uint64_t)(end - p) / TRACE_PACK_COLUMNS)
+		return false;
+	out.reserve(first + header.num_samples);
+	for (unsigned int c=1; c < TRACE_PACK_COLUMNS; c++)
+		prev[c] = header.origin[c - 1];
+
+	for (uint64_t b=0; b < blocks; b++)
+	{
+		for (unsigned int c=0; c < TRACE_PACK_COLUMNS; c++)
+		{
+			unsigned int width = (p < end) ? *p++ : 65;
+			if (width > 64 || 8 * width > (uint64_t)(end - p))
+			{
+				out.resize(first);
+				return false;
+			}
+			unpack_bits(p, width, values[c]);
+			p += 8 * width;
+		}
+
+		uint64_t start = b * TRACE_PACK_BLOCK;
+		unsigned int count = std::min<uint64_t>(TRACE_PACK_BLOCK, header.num_samples - start);
+		for (unsigned int i=0; i < count; i++)
+		{
+			measurement m;
+			m.timestamp = header.start_ns + (start + i) * header.period_ns + unzigzag(values[0][i]);
+			for (unsigned int c=1; c < TRACE_PACK_COLUMNS; c++)
+				prev[c] += unzigzag(values[c][i]);
+			m.player.x = prev[1];
+			m.player.y = prev[2];
+			m.robot.x = prev[3];
+			m.robot.y = prev[4];
+			m.ball.x = prev[5];
+			m.ball.y = prev[6];
+			out.push_back(m);
+		}
+	}
+
+	if (p != end)
+	{
+		out.resize(first);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,54 @@
+#ifndef _TRACECODEC__H
+#define _TRACECODEC__H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "simulation.h"
+
+/*
+	Packed trace format. A text trace spends ~35 bytes on each sample, although the samples are evenly spaced
+	and the positions change by a few pixels between two of them. The packed format stores the timestamps as
+	a start and a period, and every position as the difference from the previous sample:
+
+	packed_trace_header
+	block[(num_samples + TRACE_PACK_BLOCK - 1) / TRACE_PACK_BLOCK]
+	TRACE_PACK_SLACK zero bytes
+
+	A block holds TRACE_PACK_BLOCK samples (the last one is padded with zeros), one column after the other:
+	the timestamp residual (timestamp - (start + i * period), so zero at a steady rate), then the x,y
+	differences of the player, the robot and the ball. The positions of the first sample are in the header, so
+	the first difference is as small as the others. Each column is one byte with the bit width w, followed
+	by TRACE_PACK_BLOCK zig-zag encoded values of w bits each, packed from the least significant bit up
+	(8 * w bytes). A column that never changes takes one byte per block. The slack at the end lets the
+	decoder always load 8 bytes at once. All integers are little endian, like the hosts that write them.
+
+	Only traces whose positions are whole numbers can be packed, which is all that the simulator records.
+*/
+
+#define TRACE_PACK_MAGIC		"BTRPACK"
+#define TRACE_PACK_VERSION		1
+#define TRACE_PACK_BLOCK		64
+#define TRACE_PACK_COLUMNS		7	// timestamp, then x,y of the player, the robot and the ball
+#define TRACE_PACK_SLACK		8
+
+struct packed_trace_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t num_samples;
+	uint64_t start_ns;		// timestamp of the first sample
+	uint64_t period_ns;		// mean time between two samples
+	int64_t origin[TRACE_PACK_COLUMNS - 1];	// positions of the first sample
+};
+
+bool trace_is_packed(const void *data, size_t size); // starts with a packed trace header
+
+// false if a position isn't a whole number (the trace has to stay text)
+bool trace_pack(const measurement *samples, uint64_t length, std::vector<uint8_t> &out);
+
+// appends the samples to 'out'. False (and 'out' unchanged) if the data is truncated or corrupt.
+bool trace_unpack(const void *data, size_t size, std::vector<measurement> &out);
+
+#endif // _TRACECODEC__H
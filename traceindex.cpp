@@ -0,0 +1,194 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "traceindex.h"
+#include "tracecodec.h"
+
+#define SCAN_BLOCK 65536
+
+// Count the samples in a trace the same way CInteraction::Load does (every line that isn't a comment),
+// without parsing anything. A packed trace has the count in its header.
+static uint32_t count_samples(FILE *f)
+{
+	static char buf[SCAN_BLOCK];
+	size_t n;
+	uint32_t lines = 0;
+	bool line_start = true;
+	bool comment = false;
+	bool first = true;
+
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+	{
+		if (first && trace_is_packed(buf, n))
+		{
+			packed_trace_header header;
+			memcpy(&header, buf, sizeof(header));
+			return header.num_samples;
+		}
+		first = false;
+
+		char *p = buf;
+		char *end = buf + n;
+		while (p < end)
+		{
+			if (line_start)
+			{
+				comment = (*p == '#');
+				line_start = false;
+			}
+
+			char *nl = (char*)memchr(p, '\n', end - p);
+			if (!nl)
+				break;
+
+			if (!comment)
+				lines++;
+			p = nl + 1;
+			line_start = true;
+		}
+	}
+
+	return lines;
+}
+
+CTraceIndex::CTraceIndex() : m_path(NULL), m_seen(0)
+{
+}
+
+CTraceIndex::~CTraceIndex()
+{
+	Clear();
+}
+
+void CTraceIndex::Clear()
+{
+	for (unsigned int i=0; i < m_entries.size(); i++)
+		free(m_entries[i].name);
+	m_entries.clear();
+	free(m_path);
+	m_path = NULL;
+	m_seen = 0;
+}
+
+// One pass over the directory using reservoir sampling (Algorithm R): the first 'capacity' traces are
+// kept, and after that the n-th trace replaces a random entry with probability capacity/n.
+int CTraceIndex::Build(const char *path, unsigned int capacity)
+{
+	DIR *d;
+	struct dirent *entry;
+	char *tmpname;
+	FILE *f;
+
+	Clear();
+	m_path = strdup(path);
+	CRandom random(RNG_BLOCK_INDEX);
+
+	d = opendir(path);
+	if (!d)
+		return -1;
+
+	while ((entry = readdir(d)) != NULL)
+	{
+		if (strncmp(entry->d_name, "trace", 5) != 0)
+			continue;
+
+		// decide before opening the file, so traces that won't be kept cost nothing but the readdir
+		m_seen++;
+		uint64_t slot = m_entries.size();
+		if (m_entries.size() >= capacity)
+		{
+			slot = random.below(m_seen);
+			if (slot >= capacity)
+				continue;
+		}
+
+		if (asprintf(&tmpname, "%s/%s", path, entry->d_name) < 0)
+			break;
+		f = fopen(tmpname, "r");
+		free(tmpname);
+		if (!f)
+			continue;
+
+		trace_summary summary;
+		summary.name = strdup(entry->d_name);
+		summary.length = count_samples(f);
+		fclose(f);
+
+		if (slot == m_entries.size())
+			m_entries.push_back(summary);
+		else
+		{
+			free(m_entries[slot].name);
+			m_entries[slot] = summary;
+		}
+	}
+	closedir(d);
+
+	printf("Indexed %u of %lu traces in %s\n", size(), m_seen, path);
+	return 0;
+}
+
+// partial Fisher-Yates shuffle: the first 'count' candidates end up being a uniform random subset
+void CTraceIndex::DrawFrom(std::vector<unsigned int> &candidates, unsigned int count, std::vector<const trace_summary*> &out,
+	CRandom &random)
+{
+	if (count > candidates.size())
+		count = candidates.size();
+
+	for (unsigned int i=0; i < count; i++)
+	{
+		unsigned int j = i + random.below(candidates.size() - i);
+		std::swap(candidates[i], candidates[j]);
+		out.push_back(&m_entries[candidates[i]]);
+	}
+}
+
+// Draw 'count' distinct traces (or all of them, if the index is smaller). Returns how many were drawn.
+unsigned int CTraceIndex::Draw(unsigned int count, unsigned int mode, std::vector<const trace_summary*> &out)
+{
+	std::vector<unsigned int> order(m_entries.size());
+	for (unsigned int i=0; i < order.size(); i++)
+		order[i] = i;
+
+	out.clear();
+	if (mode == SELECT_UNIFORM || count >= order.size())
+	{
+		CRandom random(RNG_BLOCK_INDEX_DRAW);
+		DrawFrom(order, count, out, random);
+		return out.size();
+	}
+
+	// split the traces into bands of (nearly) equal size by length, and draw from each band in proportion
+	std::sort(order.begin(), order.end(), [this](unsigned int a, unsigned int b)
+		{ return m_entries[a].length < m_entries[b].length; });
+
+	unsigned int band_start[INDEX_NUM_STRATA + 1];
+	unsigned int quota[INDEX_NUM_STRATA];
+	unsigned int assigned = 0;
+	for (unsigned int s=0; s <= INDEX_NUM_STRATA; s++)
+		band_start[s] = (uint64_t)order.size() * s / INDEX_NUM_STRATA;
+	for (unsigned int s=0; s < INDEX_NUM_STRATA; s++)
+	{
+		quota[s] = (uint64_t)count * (band_start[s+1] - band_start[s]) / order.size();
+		assigned += quota[s];
+	}
+	for (unsigned int s=0; assigned < count; s = (s + 1) % INDEX_NUM_STRATA)
+	{
+		if (quota[s] < band_start[s+1] - band_start[s])
+		{
+			quota[s]++;
+			assigned++;
+		}
+	}
+
+	for (unsigned int s=0; s < INDEX_NUM_STRATA; s++)
+	{
+		std::vector<unsigned int> band(order.begin() + band_start[s], order.begin() + band_start[s+1]);
+		CRandom random(RNG_BLOCK_INDEX_DRAW, 0, 0, s); // one stream per band
+		DrawFrom(band, quota[s], out, random);
+	}
+
+	return out.size();
+}
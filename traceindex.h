@@ -0,0 +1,54 @@
+#ifndef _TRACEINDEX__H
+#define _TRACEINDEX__H
+
+#include <stdint.h>
+#include <vector>
+#include "random.h"
+
+#define INDEX_MAX_ENTRIES			65536	// upper bound on the number of summaries kept in memory
+#define INDEX_NUM_STRATA			8		// number of trace length bands for stratified draws
+
+enum
+{
+	SELECT_UNIFORM,		// every trace has the same chance of being drawn
+	SELECT_STRATIFIED		// draws are spread over the trace length bands in proportion to their size
+};
+
+// what we know about a trace without loading it
+struct trace_summary
+{
+	char *name;			// file name (without the directory)
+	uint32_t length;		// number of samples
+};
+
+/*
+	Summary index of a (possibly huge) trace directory, built in one streaming pass. Each trace is only
+	scanned for its length; nothing is parsed or kept except the summary. If the directory holds more than
+	'capacity' traces, the index is a uniform reservoir sample of them, so memory stays bounded no matter
+	how large the library gets. Subsets of any size can then be drawn from the index without touching the
+	directory again.
+*/
+class CTraceIndex
+{
+public:
+	CTraceIndex();
+	~CTraceIndex();
+	int Build(const char *path, unsigned int capacity);
+	unsigned int Draw(unsigned int count, unsigned int mode, std::vector<const trace_summary*> &out);
+
+	const char* path() { return m_path; }
+	unsigned int size() { return m_entries.size(); }
+	uint64_t seen() { return m_seen; } // number of traces in the directory
+	const trace_summary& entry(unsigned int i) { return m_entries[i]; }
+
+private:
+	void Clear();
+	void DrawFrom(std::vector<unsigned int> &candidates, unsigned int count, std::vector<const trace_summary*> &out,
+		CRandom &random);
+
+	char *m_path;
+	uint64_t m_seen;
+	std::vector<trace_summary> m_entries;
+};
+
+#endif // _TRACEINDEX__H
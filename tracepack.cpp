@@ -0,0 +1,147 @@
+/*
+	Converts recorded traces between the text format written by the simulator and the packed format (see
+	tracecodec.h). Both the simulator and compare read either one, so a library can be packed once it has been
+	recorded, and a packed trace unpacked to read it.
+
+	Every file is replaced through a temporary file and a rename, so an interrupted run leaves each trace in
+	one format or the other. With -o, the converted traces are written to another directory instead.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "interaction.h"
+
+static struct option options[] =
+{
+	{"help", no_argument, 0, 'h'},
+	{"output", required_argument, 0, 'o'},
+	{"unpack", no_argument, 0, 'u'},
+	{0, no_argument, 0, 0}
+};
+
+static void usage(void)
+{
+	printf("Trace packer v%u\n", VERSION);
+	printf("usage:\n");
+	printf("tracepack [options] <trace file>...\n\n");
+	printf("h: Help - this screen\n");
+	printf("o <string>: Write the converted traces to this directory, instead of replacing them\n");
+	printf("u: Unpack: write the traces as text\n");
+}
+
+static uint64_t file_size(const char *filename)
+{
+	struct stat st;
+	return stat(filename, &st) == 0 ? st.st_size : 0;
+}
+
+// returns the size of the converted trace, or 0 if it failed
+static uint64_t convert(const char *filename, const char *outdir, bool packed)
+{
+	char *outname = NULL;
+	char *tmpname = NULL;
+	char *copy = strdup(filename);
+	uint64_t size = 0;
+
+	if (outdir)
+	{
+		if (asprintf(&outname, "%s/%s", outdir, basename(copy)) < 0)
+			outname = NULL;
+	}
+	else
+		outname = strdup(filename);
+	free(copy);
+	if (!outname || asprintf(&tmpname, "%s.tmp", outname) < 0)
+	{
+		free(outname);
+		return 0;
+	}
+
+	FILE *in = fopen(filename, "r");
+	if (!in)
+		printf("Can't open %s\n", filename);
+	else
+	{
+		CInteraction trace(1.0);
+		bool loaded = trace.Load(in);
+		fclose(in);
+
+		FILE *out = loaded ? fopen(tmpname, "w") : NULL;
+		if (!loaded)
+			printf("Can't read %s\n", filename);
+		else if (!out)
+			printf("Can't write %s\n", tmpname);
+		else
+		{
+			bool ok = trace.Save(out, packed);
+			ok &= (fclose(out) == 0);
+			if (ok && rename(tmpname, outname) == 0)
+				size = file_size(outname);
+			else
+			{
+				printf("Can't %s %s\n", packed ? "pack" : "unpack", filename);
+				unlink(tmpname);
+			}
+		}
+	}
+
+	free(tmpname);
+	free(outname);
+	return size;
+}
+
+int main(int argc, char* argv[])
+{
+	const char *outdir = NULL;
+	bool packed = true;
+	uint64_t total_in = 0;
+	uint64_t total_out = 0;
+	unsigned int failed = 0;
+
+	int c;
+	while ((c = getopt_long(argc, argv, "ho:u", options, 0)) != -1)
+	{
+		switch (c)
+		{
+		case 'h':
+			usage();
+			return 0;
+		case 'o':
+			outdir = optarg;
+			break;
+		case 'u':
+			packed = false;
+			break;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		usage();
+		return -1;
+	}
+
+	for (int i=optind; i < argc; i++)
+	{
+		uint64_t before = file_size(argv[i]);
+		uint64_t after = convert(argv[i], outdir, packed);
+		if (!after)
+		{
+			failed++;
+			continue;
+		}
+
+		printf("%s: %lu -> %lu bytes\n", argv[i], before, after);
+		total_in += before;
+		total_out += after;
+	}
+
+	printf("%u traces, %lu -> %lu bytes (%.1fx)%s\n", (unsigned int)(argc - optind) - failed, total_in, total_out,
+		total_out ? (double)total_in / total_out : 0, failed ? ", some failed" : "");
+	return failed ? 1 : 0;
+}